@@ -20,6 +20,7 @@ namespace art {
     RuntimeCallbacks* (*get_runtime_callbacks_)(Runtime*) = nullptr;
     void (*add_class_load_callback_)(RuntimeCallbacks*, ClassLoadCallback*) = nullptr;
     void (*remove_class_load_callback_)(RuntimeCallbacks*, ClassLoadCallback*) = nullptr;
+    mirror::Object* (*get_cleared_jni_weak_global_)(Runtime*) = nullptr;
     ReaderWriterMutex** classlinker_class_lock_ptr = nullptr;
 
     bool ClassLinker::Init(elf_parser::Elf &art) {
@@ -107,6 +108,13 @@ namespace art {
             success = false;
         }
 
+        // only needed by the global ref census, which counts the sentinel as an object without it
+        get_cleared_jni_weak_global_ = reinterpret_cast<decltype(get_cleared_jni_weak_global_)>(
+                art.getSymbAddress("_ZN3art7Runtime23GetClearedJniWeakGlobalEv"));
+        if (get_cleared_jni_weak_global_ == nullptr) {
+            LOGE("not found: Runtime::GetClearedJniWeakGlobal");
+        }
+
         // get classLinker
 
         JavaVM *vm;
@@ -219,6 +227,10 @@ namespace art {
         return get_runtime_callbacks_(this);
     }
 
+    mirror::Object *Runtime::GetClearedJniWeakGlobal() {
+        return get_cleared_jni_weak_global_ ? get_cleared_jni_weak_global_(this) : nullptr;
+    }
+
     void RuntimeCallbacks::AddClassLoadCallback(art::ClassLoadCallback *cb) {
         add_class_load_callback_(this, cb);
     }
@@ -258,6 +270,38 @@ namespace art {
         return 0;
     }
 
+    const char* (*class_get_descriptor_)(mirror::Class*, std::string*) = nullptr;
+
+    bool mirror::Class::Init(elf_parser::Elf &art) {
+        class_get_descriptor_ = reinterpret_cast<decltype(class_get_descriptor_)>(
+                art.getSymbAddress("_ZN3art6mirror5Class13GetDescriptorEPNSt3__112basic_stringIcNS2_11char_traitsIcEENS2_9allocatorIcEEEE"));
+        if (!class_get_descriptor_) {
+            LOGE("not found: art::mirror::Class::GetDescriptor");
+            return false;
+        }
+        return true;
+    }
+
+    const char* mirror::Class::GetDescriptor(std::string *storage) {
+        return class_get_descriptor_ ? class_get_descriptor_(this, storage) : nullptr;
+    }
+
+    mirror::Class* mirror::Object::GetClass() {
+        return reinterpret_cast<mirror::ObjectReference<false, mirror::Class>*>(this)->AsMirrorPtr();
+    }
+
+    mirror::ClassLoader* mirror::Class::GetClassLoader() {
+        constexpr size_t kClassLoaderOffset = 8;
+        return reinterpret_cast<mirror::ObjectReference<false, mirror::ClassLoader>*>(
+                reinterpret_cast<uintptr_t>(this) + kClassLoaderOffset)->AsMirrorPtr();
+    }
+
+    uint64_t mirror::ClassLoader::GetClassTable() {
+        // header, packages_, parent_, proxyCache_, padding_ and allocator_ come first
+        constexpr size_t kClassTableOffset = 32;
+        return *reinterpret_cast<uint64_t*>(reinterpret_cast<uintptr_t>(this) + kClassTableOffset);
+    }
+
     void (*symSetJdwpAllowed)(bool) = nullptr;
     bool (*symIsJdwpAllowed)() = nullptr;
 
@@ -278,6 +322,9 @@ namespace art {
 
         success &= Runtime::Init(env, art);
 
+        // only needed by the class load monitor, which falls back to JNI without it
+        mirror::Class::Init(art);
+
         return success;
     }
 
@@ -1,6 +1,7 @@
 #pragma once
 #include "elf_parser.hpp"
 #include <atomic>
+#include <string>
 
 #ifndef NDEBUG
 #define ALWAYS_INLINE
@@ -33,14 +34,31 @@ namespace art {
 
     namespace mirror {
 
-        class Object {
+        class Class;
 
+        class Object {
+        public:
+            // klass_ is the first field of every object
+            Class* GetClass();
         };
 
         class MANAGED ClassLoader : public Object {
+        public:
+            // ClassLoader.classTable, the native ClassTable of the loader. Unlike the mirror it
+            // does not move, 0 until the first class of the loader is inserted.
+            uint64_t GetClassTable();
         };
 
         class MANAGED Class : public Object {
+        public:
+            static bool Init(elf_parser::Elf &art);
+
+            // Returns a pointer into the dex file for ordinary classes, storage is only used
+            // (and returned) for array and proxy classes. Null if the symbol is unavailable.
+            const char* GetDescriptor(std::string* storage);
+
+            // class_loader_ is the first field of mirror::Class on every supported version.
+            ClassLoader* GetClassLoader();
         };
 
         template<bool kPoisonReferences, class MirrorType>
@@ -181,7 +199,42 @@ namespace art {
         REQUIRES_SHARED(Locks::classlinker_classes_lock_, Locks::mutator_lock_) = 0;
     };
 
+    enum RootType {
+        kRootUnknown = 0,
+        kRootJNIGlobal,
+        kRootJNILocal,
+        kRootJavaFrame,
+        kRootNativeStack,
+        kRootStickyClass,
+        kRootThreadBlock,
+        kRootMonitorUsed,
+        kRootThreadObject,
+        kRootInternedString,
+        kRootFinalizing,  // used for HPROF's conversion to HprofHeapTag
+        kRootDebugger,
+        kRootReferenceCleanup,  // used for HPROF's conversion to HprofHeapTag
+        kRootVMInternal,
+        kRootJNIMonitor,
+        kRootTypeCount,
+    };
+
     class RootInfo {
+    public:
+        virtual ~RootInfo() {}
+
+        virtual void Describe(void* /*std::ostream&*/ os) const {}
+
+        RootType GetType() const {
+            return type_;
+        }
+
+        uint32_t GetThreadId() const {
+            return thread_id_;
+        }
+
+    private:
+        RootType type_;
+        uint32_t thread_id_;
     };
 
     class RootVisitor {
@@ -313,6 +366,8 @@ namespace art {
         ClassLinker* getClassLinker();
         inline static Runtime *Current() { return instance_; }
         RuntimeCallbacks* GetRuntimeCallbacks();
+        // the object cleared weak globals point to, null if the symbol is unavailable
+        mirror::Object* GetClearedJniWeakGlobal();
     };
 
     bool Init(JNIEnv *env, elf_parser::Elf &art);
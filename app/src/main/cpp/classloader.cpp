@@ -3,11 +3,21 @@
 #include <unistd.h>
 #include "classloader.h"
 #include "logging.h"
+#include "utils.h"
 #include "art.hpp"
+#include "ring_buffer.hpp"
+#include "jvmti/stethox_jvmti.hpp"
+#include "histogram.hpp"
 #include <functional>
 #include <utility>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <string>
+#include <ctime>
+#include <cstring>
 
 struct JNIEnvExt {
 private:
@@ -259,6 +269,299 @@ Java_io_github_a13e300_tools_NativeUtils_getGlobalRefs(JNIEnv *env, jclass, jcla
     return arr;
 }
 
+// Counts JNI global and weak global references per class without creating any reference.
+class GlobalRefCensus : public art::SingleRootVisitor, public art::IsMarkedVisitor {
+public:
+    struct Counts {
+        jint globals = 0;
+        jint weak_globals = 0;
+    };
+
+    std::unordered_map<art::mirror::Class*, Counts> classes;
+    jint root_types[art::kRootTypeCount + 2]{};
+    // set while runnable, before sweeping
+    art::mirror::Object *cleared = nullptr;
+
+    static constexpr int kWeakGlobal = art::kRootTypeCount;
+    // weak globals whose referent was collected
+    static constexpr int kClearedWeakGlobal = art::kRootTypeCount + 1;
+
+    void VisitRoot(art::mirror::Object *root, const art::RootInfo &info) final {
+        classes[root->GetClass()].globals++;
+        auto type = info.GetType();
+        root_types[type >= 0 && type < art::kRootTypeCount ? type : art::kRootUnknown]++;
+    }
+
+    // JavaVMExt::SweepJniWeakGlobals, the object is kept as is
+    art::mirror::Object *IsMarked(art::mirror::Object *obj) override {
+        // SweepJniWeakGlobals passes cleared entries as the runtime's sentinel object
+        if (obj == cleared) {
+            root_types[kClearedWeakGlobal]++;
+            return obj;
+        }
+        classes[obj->GetClass()].weak_globals++;
+        root_types[kWeakGlobal]++;
+        return obj;
+    }
+};
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeGlobalRefCensus(JNIEnv *env, jclass) {
+    JavaVM *jvm;
+    env->GetJavaVM(&jvm);
+    GlobalRefCensus census;
+    std::vector<std::pair<std::string, GlobalRefCensus::Counts>> rows;
+    {
+        // objects must not move while their classes are read
+        art::ScopedObjectAccess soa;
+        census.cleared = art::Runtime::Current()->GetClearedJniWeakGlobal();
+        JavaVMExt::From(jvm)->VisitRoots(&census);
+        JavaVMExt::From(jvm)->SweepJniWeakGlobals(&census);
+        std::string storage;
+        auto getName = env->GetMethodID(env->FindClass("java/lang/Class"), "getName", "()Ljava/lang/String;");
+        for (auto &[klass, counts]: census.classes) {
+            if (auto descriptor = klass->GetDescriptor(&storage); descriptor) {
+                rows.emplace_back(DescriptorToName(descriptor), counts);
+                continue;
+            }
+            auto ref = JNIEnvExt::From(env)->NewLocalRef(klass);
+            auto str = (jstring) env->CallObjectMethod(ref, getName);
+            auto chars = env->GetStringUTFChars(str, nullptr);
+            rows.emplace_back(chars, counts);
+            env->ReleaseStringUTFChars(str, chars);
+            env->DeleteLocalRef(str);
+            JNIEnvExt::From(env)->DeleteLocalRef(ref);
+        }
+    }
+    std::sort(rows.begin(), rows.end(), [](auto &a, auto &b) {
+        return a.second.globals + a.second.weak_globals > b.second.globals + b.second.weak_globals;
+    });
+
+    auto size = static_cast<jsize>(rows.size());
+    auto names = env->NewObjectArray(size, env->FindClass("java/lang/String"), nullptr);
+    std::vector<jint> globals(size), weak_globals(size);
+    for (jsize i = 0; i < size; i++) {
+        auto name = env->NewStringUTF(rows[i].first.c_str());
+        env->SetObjectArrayElement(names, i, name);
+        env->DeleteLocalRef(name);
+        globals[i] = rows[i].second.globals;
+        weak_globals[i] = rows[i].second.weak_globals;
+    }
+    auto globalArr = env->NewIntArray(size);
+    env->SetIntArrayRegion(globalArr, 0, size, globals.data());
+    auto weakArr = env->NewIntArray(size);
+    env->SetIntArrayRegion(weakArr, 0, size, weak_globals.data());
+    constexpr jsize kRootTypes = art::kRootTypeCount + 2;
+    auto rootTypeArr = env->NewIntArray(kRootTypes);
+    env->SetIntArrayRegion(rootTypeArr, 0, kRootTypes, census.root_types);
+
+    auto censusClass = env->FindClass("io/github/a13e300/tools/NativeUtils$GlobalRefCensus");
+    auto ctor = env->GetMethodID(censusClass, "<init>", "([Ljava/lang/String;[I[I[I)V");
+    return env->NewObject(censusClass, ctor, names, globalArr, weakArr, rootTypeArr);
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeOpenClassLoaderCursor(JNIEnv *env, jclass, jint pageSize) {
+    auto cursor = ObjectCursor::Create(env, pageSize);
+    if (!cursor) return 0;
+    // tag outside of the class linker lock, there are not many class loaders
+    std::vector<jobject> class_loaders;
+    {
+        art::ScopedObjectAccess soa;
+        art::ReaderMutexLock mu{art::classlinker_classes_lock()};
+        MyClassLoaderVisitor v(env, [&](art::mirror::Object* o) {
+            class_loaders.push_back(JNIEnvExt::From(env)->NewLocalRef(o));
+        });
+        art::Runtime::Current()->getClassLinker()->VisitClassLoaders(&v);
+    }
+    for (auto o: class_loaders) {
+        cursor->Add(o);
+        JNIEnvExt::From(env)->DeleteLocalRef(o);
+    }
+    return cursor->Handle();
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeOpenGlobalRefCursor(JNIEnv *env, jclass, jclass clazz, jint pageSize) {
+    auto cursor = ObjectCursor::Create(env, pageSize);
+    if (!cursor) return 0;
+    JavaVM *jvm;
+    env->GetJavaVM(&jvm);
+    // VisitRoots holds the JNI globals lock: objects are filtered by their raw class, checked
+    // once per distinct class, and only matches get a local ref. They are tagged after the
+    // visit, in batches of one local frame each.
+    constexpr jint kBatch = 512;
+    std::unordered_map<art::mirror::Class*, bool> matches;
+    std::vector<jobject> hits;
+    int frames = 0;
+    {
+        art::ScopedObjectAccess soa;
+        GlobalRefVisitor visitor{[&](art::mirror::Object* o) {
+            auto klass = o->GetClass();
+            auto [it, inserted] = matches.try_emplace(klass, !clazz);
+            if (inserted && clazz) {
+                auto ref = JNIEnvExt::From(env)->NewLocalRef(klass);
+                it->second = env->IsAssignableFrom(reinterpret_cast<jclass>(ref), clazz);
+                JNIEnvExt::From(env)->DeleteLocalRef(ref);
+            }
+            if (!it->second) return;
+            if (hits.size() % kBatch == 0) {
+                if (env->PushLocalFrame(kBatch) != JNI_OK) {
+                    env->ExceptionClear();
+                    return;
+                }
+                frames++;
+            }
+            hits.push_back(JNIEnvExt::From(env)->NewLocalRef(o));
+        }};
+        JavaVMExt::From(jvm)->VisitRoots(&visitor);
+    }
+    // the innermost frame holds the last batch
+    for (; frames > 0; frames--) {
+        auto begin = (frames - 1) * static_cast<size_t>(kBatch);
+        for (auto i = begin; i < hits.size(); i++) cursor->Add(hits[i]);
+        hits.resize(begin);
+        env->PopLocalFrame(nullptr);
+    }
+    return cursor->Handle();
+}
+
+// OAT paths of a BaseDexClassLoader joined by ",", like NativeUtils.getOatPath
+static jstring GetOatPaths(JNIEnv *env, jobject loader) {
+    static jclass base_dex_class_loader = nullptr;
+    static jfieldID path_list, dex_elements, dex_file, cookie;
+    if (!base_dex_class_loader) {
+        auto clazz = env->FindClass("dalvik/system/BaseDexClassLoader");
+        path_list = env->GetFieldID(clazz, "pathList", "Ldalvik/system/DexPathList;");
+        dex_elements = env->GetFieldID(env->FindClass("dalvik/system/DexPathList"), "dexElements", "[Ldalvik/system/DexPathList$Element;");
+        dex_file = env->GetFieldID(env->FindClass("dalvik/system/DexPathList$Element"), "dexFile", "Ldalvik/system/DexFile;");
+        cookie = env->GetFieldID(env->FindClass("dalvik/system/DexFile"), "mCookie", "Ljava/lang/Object;");
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+            return nullptr;
+        }
+        base_dex_class_loader = reinterpret_cast<jclass>(env->NewGlobalRef(clazz));
+    }
+    if (!env->IsInstanceOf(loader, base_dex_class_loader)) return nullptr;
+    std::string result;
+    auto pathList = env->GetObjectField(loader, path_list);
+    auto elements = pathList ? (jobjectArray) env->GetObjectField(pathList, dex_elements) : nullptr;
+    auto count = elements ? env->GetArrayLength(elements) : 0;
+    for (jsize i = 0; i < count; i++) {
+        auto element = env->GetObjectArrayElement(elements, i);
+        auto dexFile = element ? env->GetObjectField(element, dex_file) : nullptr;
+        auto c = dexFile ? (jlongArray) env->GetObjectField(dexFile, cookie) : nullptr;
+        if (c && env->GetArrayLength(c) > 0) {
+            jlong addr;
+            env->GetLongArrayRegion(c, 0, 1, &addr);
+            if (!result.empty()) result += ",";
+            result += ReadOatPath(addr);
+        }
+        env->DeleteLocalRef(c);
+        env->DeleteLocalRef(dexFile);
+        env->DeleteLocalRef(element);
+    }
+    env->DeleteLocalRef(elements);
+    env->DeleteLocalRef(pathList);
+    return env->NewStringUTF(result.c_str());
+}
+
+static jobjectArray ToObjectArray(JNIEnv *env, std::vector<jobject> &objects, const char *clazz) {
+    auto arr = env->NewObjectArray(static_cast<jsize>(objects.size()), env->FindClass(clazz), nullptr);
+    for (size_t i = 0; i < objects.size(); i++) {
+        env->SetObjectArrayElement(arr, static_cast<jsize>(i), objects[i]);
+        env->DeleteLocalRef(objects[i]);
+    }
+    objects.clear();
+    return arr;
+}
+
+// Runs several queries with one transition to runnable and one acquisition of the class
+// linker lock. Classes are visited last and the visit stops at the deadline, so the lock
+// (which blocks class loading in other threads) is held for at most maxHoldNanos.
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeQuery(JNIEnv *env, jclass, jint queries, jclass rootClass, jlong maxHoldNanos) {
+    constexpr jint kClassLoaders = 1, kClasses = 2, kGlobalRefs = 4, kOatPaths = 8;
+    if (queries & kOatPaths) queries |= kClassLoaders;
+
+    std::vector<jobject> class_loaders, classes, global_refs;
+    bool truncated = false;
+    uint64_t hold_ns;
+
+    art::ScopedObjectAccess soa;
+    {
+        art::ReaderMutexLock mu{art::classlinker_classes_lock()};
+        auto start = NowNanos();
+        auto deadline = maxHoldNanos > 0 ? start + maxHoldNanos : UINT64_MAX;
+        auto linker = art::Runtime::Current()->getClassLinker();
+        if (queries & kClassLoaders) {
+            MyClassLoaderVisitor v(env, [&](art::mirror::Object *o) {
+                class_loaders.push_back(JNIEnvExt::From(env)->NewLocalRef(o));
+            });
+            linker->VisitClassLoaders(&v);
+        }
+        if (queries & kClasses) {
+            class Visitor : public art::ClassVisitor {
+                JNIEnvExt *env_;
+                std::vector<jobject> &classes_;
+                uint64_t deadline_;
+            public:
+                bool truncated = false;
+
+                Visitor(JNIEnv *env, std::vector<jobject> &classes, uint64_t deadline)
+                    : env_(JNIEnvExt::From(env)), classes_(classes), deadline_(deadline) {}
+
+                bool operator()(art::ObjPtr<art::mirror::Class> klass) override {
+                    classes_.push_back(env_->NewLocalRef(klass.Ptr()));
+                    // reading the clock is not free, check it once in a while
+                    if ((classes_.size() & 0xff) == 0 && NowNanos() > deadline_) {
+                        truncated = true;
+                        return false;
+                    }
+                    return true;
+                }
+            } v{env, classes, deadline};
+            linker->VisitClasses(&v);
+            truncated = v.truncated;
+        }
+        hold_ns = NowNanos() - start;
+    }
+    if (queries & kGlobalRefs) {
+        JavaVM *jvm;
+        env->GetJavaVM(&jvm);
+        GlobalRefVisitor visitor{[&](art::mirror::Object* o) {
+            auto obj = JNIEnvExt::From(env)->NewLocalRef(o);
+            if (!rootClass || env->IsInstanceOf(obj, rootClass))
+                global_refs.push_back(obj);
+            else
+                JNIEnvExt::From(env)->DeleteLocalRef(obj);
+        }};
+        JavaVMExt::From(jvm)->VisitRoots(&visitor);
+    }
+
+    jobjectArray oat_paths = nullptr;
+    if (queries & kOatPaths) {
+        oat_paths = env->NewObjectArray(static_cast<jsize>(class_loaders.size()), env->FindClass("java/lang/String"), nullptr);
+        for (size_t i = 0; i < class_loaders.size(); i++) {
+            auto path = GetOatPaths(env, class_loaders[i]);
+            env->SetObjectArrayElement(oat_paths, static_cast<jsize>(i), path);
+            env->DeleteLocalRef(path);
+        }
+    }
+    auto loaderArr = queries & kClassLoaders ? ToObjectArray(env, class_loaders, "java/lang/ClassLoader") : nullptr;
+    auto classArr = queries & kClasses ? ToObjectArray(env, classes, "java/lang/Class") : nullptr;
+    auto globalRefArr = queries & kGlobalRefs ? ToObjectArray(env, global_refs, "java/lang/Object") : nullptr;
+
+    auto resultClass = env->FindClass("io/github/a13e300/tools/NativeUtils$QueryResult");
+    auto ctor = env->GetMethodID(resultClass, "<init>", "([Ljava/lang/ClassLoader;[Ljava/lang/String;[Ljava/lang/Class;[Ljava/lang/Object;ZJ)V");
+    return env->NewObject(resultClass, ctor, loaderArr, oat_paths, classArr, globalRefArr,
+                          static_cast<jboolean>(truncated), static_cast<jlong>(hold_ns));
+}
+
 extern "C"
 JNIEXPORT void JNICALL
 Java_io_github_a13e300_tools_NativeUtils_visitClasses(JNIEnv *env, jclass clazz) {
@@ -282,6 +585,101 @@ Java_io_github_a13e300_tools_NativeUtils_visitClasses(JNIEnv *env, jclass clazz)
     art::Runtime::Current()->getClassLinker()->VisitClasses(&v);
 }
 
+static JNIEnv *CurrentEnv(JavaVM *vm) {
+    JNIEnv *env = nullptr;
+    vm->GetEnv((void**) &env, JNI_VERSION_1_4);
+    return env;
+}
+
+// Names of the live class loaders by ClassLoader.classTable, the key the class load
+// callbacks record without any JNI call (0 is the boot class path). Loaders are named
+// outside of the class linker lock. A loader unloaded before its events are read has no
+// name anymore.
+class LoaderNames {
+    std::unordered_map<uint64_t, std::string> names_;
+
+public:
+    explicit LoaderNames(JNIEnv *env) {
+        std::vector<jobject> loaders;
+        {
+            art::ScopedObjectAccess soa;
+            art::ReaderMutexLock mu{art::classlinker_classes_lock()};
+            MyClassLoaderVisitor v(env, [&](art::mirror::Object *o) {
+                loaders.push_back(JNIEnvExt::From(env)->NewLocalRef(o));
+            });
+            art::Runtime::Current()->getClassLinker()->VisitClassLoaders(&v);
+        }
+        auto classTable = env->GetFieldID(env->FindClass("java/lang/ClassLoader"), "classTable", "J");
+        auto getName = env->GetMethodID(env->FindClass("java/lang/Class"), "getName", "()Ljava/lang/String;");
+        auto system = env->FindClass("java/lang/System");
+        auto identityHashCode = env->GetStaticMethodID(system, "identityHashCode", "(Ljava/lang/Object;)I");
+        for (auto loader: loaders) {
+            auto table = static_cast<uint64_t>(env->GetLongField(loader, classTable));
+            if (table) {
+                auto loaderClass = env->GetObjectClass(loader);
+                auto str = (jstring) env->CallObjectMethod(loaderClass, getName);
+                auto chars = env->GetStringUTFChars(str, nullptr);
+                names_[table] = Format("%s@%x", chars, env->CallStaticIntMethod(system, identityHashCode, loader));
+                env->ReleaseStringUTFChars(str, chars);
+                env->DeleteLocalRef(str);
+                env->DeleteLocalRef(loaderClass);
+            }
+            JNIEnvExt::From(env)->DeleteLocalRef(loader);
+        }
+    }
+
+    std::string Name(uint64_t key) const {
+        if (!key) return "boot";
+        auto it = names_.find(key);
+        return it != names_.end() ? it->second : Format("unloaded@%llx", (unsigned long long) key);
+    }
+};
+
+// the key of LoaderNames, read from the mirror while the caller is runnable
+static inline uint64_t LoaderKey(art::mirror::ClassLoader *loader) {
+    return loader ? loader->GetClassTable() : 0;
+}
+
+struct ClassLoadEvent {
+    // malloc'ed, the dex file may be unloaded before the event is drained
+    const char *descriptor;
+    // LoaderNames key
+    uint64_t loader;
+    pid_t tid;
+    uint64_t timestamp_ns;
+};
+
+struct ClassEventRing : SpscRing<ClassLoadEvent, 512> {
+    ClassEventRing *next = nullptr;
+    std::atomic<bool> in_use{true};
+};
+
+// rings are never freed, a ring left by a dead thread is adopted by the next new thread
+static std::atomic<ClassEventRing*> class_event_rings{nullptr};
+
+static ClassEventRing *AcquireClassEventRing() {
+    for (auto ring = class_event_rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        bool expected = false;
+        if (ring->in_use.compare_exchange_strong(expected, true)) return ring;
+    }
+    auto ring = new ClassEventRing();
+    ring->next = class_event_rings.load(std::memory_order_relaxed);
+    while (!class_event_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed));
+    return ring;
+}
+
+static ClassEventRing &CurrentClassEventRing() {
+    static thread_local struct Holder {
+        ClassEventRing *ring = AcquireClassEventRing();
+        ~Holder() {
+            ring->in_use.store(false, std::memory_order_release);
+        }
+    } holder;
+    return *holder.ring;
+}
+
+// Records prepared classes into a per-thread ring, class and loader names are resolved later
+// by drainClassEvents. No JNI call or lock is made unless GetDescriptor is missing.
 class MyCallback : public art::ClassLoadCallback {
 public:
     JavaVM* vm;
@@ -296,14 +694,32 @@ public:
     }
 
     void ClassPrepare(art::Handle<art::mirror::Class> temp_klass, art::Handle<art::mirror::Class> klass) override {
-        JNIEnv *env = nullptr;
-        vm->GetEnv((void**) &env, JNI_VERSION_1_4);
-        auto clz = JNIEnvExt::From(env)->NewLocalRef(klass.Get());
+        static thread_local std::string storage;
+        auto k = klass.Get();
+        auto descriptor = k->GetDescriptor(&storage);
+        ClassLoadEvent event{
+            .descriptor = descriptor ? strdup(descriptor) : SlowGetName(k),
+            .loader = LoaderKey(k->GetClassLoader()),
+            .tid = gettid(),
+            .timestamp_ns = NowNanos(),
+        };
+        if (!CurrentClassEventRing().Push(event)) {
+            free(const_cast<char*>(event.descriptor));
+        }
+    }
+
+private:
+    // fallback if art::mirror::Class::GetDescriptor is not found
+    char *SlowGetName(art::mirror::Class *k) {
+        auto env = CurrentEnv(vm);
+        auto clz = JNIEnvExt::From(env)->NewLocalRef(k);
         auto str = (jstring) env->CallObjectMethod(clz, getClassName);
         auto chars = env->GetStringUTFChars(str, nullptr);
-        LOGD("prepared class %s", chars);
+        auto name = strdup(chars);
         env->ReleaseStringUTFChars(str, chars);
+        env->DeleteLocalRef(str);
         JNIEnvExt::From(env)->DeleteLocalRef(clz);
+        return name;
     }
 };
 
@@ -322,3 +738,364 @@ Java_io_github_a13e300_tools_NativeUtils_monitorClasses(JNIEnv *env, jclass claz
         art::Runtime::Current()->GetRuntimeCallbacks()->RemoveClassLoadCallback(ptr);
     }
 }
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_drainClassEvents(JNIEnv *env, jclass, jint max) {
+    static std::mutex drain_mutex;
+    std::lock_guard lk{drain_mutex};
+
+    std::vector<ClassLoadEvent> events(max > 0 ? max : 0);
+    size_t count = 0;
+    uint64_t dropped = 0;
+    for (auto ring = class_event_rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        count += ring->Drain(events.data() + count, events.size() - count);
+        dropped += ring->TakeDropped();
+    }
+    events.resize(count);
+    std::sort(events.begin(), events.end(), [](auto &a, auto &b) { return a.timestamp_ns < b.timestamp_ns; });
+
+    std::unique_ptr<LoaderNames> loaderNames;
+    if (count) loaderNames = std::make_unique<LoaderNames>(env);
+    jsize extra = dropped ? 1 : 0;
+    auto arr = env->NewObjectArray(static_cast<jsize>(count) + extra, env->FindClass("java/lang/String"), nullptr);
+    if (dropped) {
+        auto str = env->NewStringUTF(Format("dropped %llu class events", (unsigned long long) dropped).c_str());
+        env->SetObjectArrayElement(arr, 0, str);
+        env->DeleteLocalRef(str);
+    }
+    for (size_t i = 0; i < count; i++) {
+        auto &event = events[i];
+        auto loader = loaderNames->Name(event.loader);
+        auto line = Format("[%llu.%09llu] tid=%d %s (loader=%s)",
+                           (unsigned long long) (event.timestamp_ns / 1000000000ull),
+                           (unsigned long long) (event.timestamp_ns % 1000000000ull),
+                           event.tid, DescriptorToName(event.descriptor).c_str(), loader.c_str());
+        auto str = env->NewStringUTF(line.c_str());
+        env->SetObjectArrayElement(arr, static_cast<jsize>(i) + extra, str);
+        env->DeleteLocalRef(str);
+        free(const_cast<char*>(event.descriptor));
+    }
+    return arr;
+}
+
+static uint64_t HashDescriptor(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *s; s++) {
+        h = (h ^ static_cast<uint8_t>(*s)) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+// Fixed size open addressing table of latency histograms, full tables fold into the last slot.
+template<size_t N>
+class LatencyTable {
+public:
+    struct Slot {
+        std::atomic<uint64_t> key{0};
+        std::atomic<bool> ready{false};
+        char name[96]{};
+        LatencyHistogram histogram;
+    };
+
+private:
+    Slot slots_[N];
+
+public:
+    // key must not be 0, name is only copied by the thread creating the slot
+    LatencyHistogram &Get(uint64_t key, const char *name = nullptr) {
+        auto start = (key * 0x9e3779b97f4a7c15ull) >> 32;
+        for (size_t i = 0; i < N - 1; i++) {
+            auto &slot = slots_[(start + i) % (N - 1)];
+            auto k = slot.key.load(std::memory_order_acquire);
+            if (k == key) return slot.histogram;
+            if (k == 0) {
+                if (slot.key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+                    if (name) strlcpy(slot.name, name, sizeof(slot.name));
+                    slot.ready.store(true, std::memory_order_release);
+                    return slot.histogram;
+                }
+                if (k == key) return slot.histogram;
+            }
+        }
+        return slots_[N - 1].histogram;
+    }
+
+    // slots sorted by total time, the overflow slot has key 0
+    std::vector<Slot*> Sorted() {
+        std::vector<Slot*> result;
+        for (auto &slot: slots_) {
+            if (slot.histogram.Count() == 0) continue;
+            if (&slot != &slots_[N - 1] && !slot.ready.load(std::memory_order_acquire)) continue;
+            result.push_back(&slot);
+        }
+        std::sort(result.begin(), result.end(), [](auto a, auto b) { return a->histogram.Sum() > b->histogram.Sum(); });
+        return result;
+    }
+
+    void Reset() {
+        for (auto &slot: slots_) {
+            slot.key.store(0, std::memory_order_relaxed);
+            slot.ready.store(false, std::memory_order_relaxed);
+            slot.name[0] = 0;
+            slot.histogram.Reset();
+        }
+    }
+};
+
+struct SlowClass {
+    char descriptor[128];
+    // LoaderNames key
+    uint64_t loader;
+    pid_t tid;
+    uint64_t total_ns;
+    uint64_t self_ns;
+};
+
+struct ClassLoadProfile {
+    static constexpr size_t kSlowest = 32;
+
+    LatencyHistogram define_to_load;
+    LatencyHistogram load_to_prepare;
+    LatencyHistogram total;
+    LatencyTable<32> loaders;
+    LatencyTable<256> packages;
+    LatencyTable<64> threads;
+    std::atomic<uint64_t> untracked{0};
+
+    // only taken for classes slower than the current slowest list
+    std::mutex slowest_mutex;
+    std::atomic<uint64_t> slowest_threshold{0};
+    std::vector<SlowClass> slowest;
+
+    void AddSlowClass(const SlowClass &c) {
+        if (c.total_ns <= slowest_threshold.load(std::memory_order_relaxed)) return;
+        std::lock_guard lk{slowest_mutex};
+        auto cmp = [](auto &a, auto &b) { return a.total_ns > b.total_ns; };
+        slowest.insert(std::upper_bound(slowest.begin(), slowest.end(), c, cmp), c);
+        if (slowest.size() > kSlowest) slowest.pop_back();
+        if (slowest.size() == kSlowest) slowest_threshold.store(slowest.back().total_ns, std::memory_order_relaxed);
+    }
+
+    void Reset() {
+        define_to_load.Reset();
+        load_to_prepare.Reset();
+        total.Reset();
+        loaders.Reset();
+        packages.Reset();
+        threads.Reset();
+        untracked.store(0, std::memory_order_relaxed);
+        std::lock_guard lk{slowest_mutex};
+        slowest.clear();
+        slowest.reserve(kSlowest + 1);
+        slowest_threshold.store(0, std::memory_order_relaxed);
+    }
+};
+
+static ClassLoadProfile *class_load_profile = nullptr;
+
+// Times ClassPreDefine -> ClassLoad -> ClassPrepare of every defined class. Definitions nest
+// (linking loads the super classes), so every thread keeps a stack of open definitions and
+// the time spent in nested definitions is subtracted to get the self time.
+class ClassLoadProfiler : public art::ClassLoadCallback {
+    struct Frame {
+        uint64_t hash;
+        uint64_t define_ns;
+        uint64_t load_ns;
+        uint64_t children_ns;
+        char descriptor[128];
+    };
+
+    struct Stack {
+        static constexpr int kMaxDepth = 32;
+        Frame frames[kMaxDepth];
+        int depth = 0;
+    };
+
+    static Stack &CurrentStack() {
+        static thread_local Stack stack;
+        return stack;
+    }
+
+    ClassLoadProfile &profile_;
+
+public:
+    explicit ClassLoadProfiler(ClassLoadProfile &profile) : profile_(profile) {}
+
+    void ClassPreDefine(const char* descriptor,
+                        art::Handle<art::mirror::Class> klass,
+                        art::Handle<art::mirror::ClassLoader> class_loader,
+                        void* initial_dex_file,
+                        void* initial_class_def,
+                        void* final_dex_file,
+                        void* final_class_def) override {
+        auto &stack = CurrentStack();
+        if (stack.depth == Stack::kMaxDepth) {
+            profile_.untracked.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto &frame = stack.frames[stack.depth++];
+        frame.hash = HashDescriptor(descriptor);
+        frame.load_ns = 0;
+        frame.children_ns = 0;
+        strlcpy(frame.descriptor, descriptor, sizeof(frame.descriptor));
+        frame.define_ns = NowNanos();
+    }
+
+    void ClassLoad(art::Handle<art::mirror::Class> klass) override {
+        auto now = NowNanos();
+        auto &stack = CurrentStack();
+        if (stack.depth == 0) return;
+        auto &top = stack.frames[stack.depth - 1];
+        if (top.load_ns != 0) return;
+        // array classes created while defining are loaded without ClassPreDefine
+        static thread_local std::string storage;
+        auto descriptor = klass.Get()->GetDescriptor(&storage);
+        if (descriptor && HashDescriptor(descriptor) != top.hash) return;
+        top.load_ns = now;
+    }
+
+    void ClassPrepare(art::Handle<art::mirror::Class> temp_klass, art::Handle<art::mirror::Class> klass) override {
+        auto now = NowNanos();
+        auto &stack = CurrentStack();
+        if (stack.depth == 0) return;
+        static thread_local std::string storage;
+        auto descriptor = klass.Get()->GetDescriptor(&storage);
+        int index = stack.depth - 1;
+        if (descriptor) {
+            auto hash = HashDescriptor(descriptor);
+            while (index >= 0 && stack.frames[index].hash != hash) index--;
+            // not defined through ClassPreDefine, e.g. arrays and proxies
+            if (index < 0) return;
+        }
+        // frames above belong to definitions which failed, the popped frame is copied as
+        // anything defined from here on reuses its slot
+        stack.depth = index;
+        auto frame = stack.frames[index];
+        auto total = now - frame.define_ns;
+        auto load_ns = frame.load_ns ? frame.load_ns : now;
+        if (index > 0) stack.frames[index - 1].children_ns += total;
+
+        auto tid = gettid();
+        // read here rather than in ClassPreDefine, the loader has a class table by now
+        auto loader = LoaderKey(klass.Get()->GetClassLoader());
+        profile_.define_to_load.Record(load_ns - frame.define_ns);
+        profile_.load_to_prepare.Record(now - load_ns);
+        profile_.total.Record(total);
+        profile_.loaders.Get(loader + 1).Record(total);
+        profile_.threads.Get(static_cast<uint64_t>(tid)).Record(total);
+
+        char package[96];
+        auto start = frame.descriptor[0] == 'L' ? frame.descriptor + 1 : frame.descriptor;
+        auto end = strrchr(start, '/');
+        if (end && end - start < static_cast<ptrdiff_t>(sizeof(package))) {
+            memcpy(package, start, end - start);
+            package[end - start] = 0;
+        } else {
+            strlcpy(package, end ? "<long>" : "<default>", sizeof(package));
+        }
+        profile_.packages.Get(HashDescriptor(package), package).Record(total);
+
+        SlowClass slow{
+            .loader = loader,
+            .tid = tid,
+            .total_ns = total,
+            .self_ns = total - std::min(total, frame.children_ns),
+        };
+        memcpy(slow.descriptor, frame.descriptor, sizeof(slow.descriptor));
+        profile_.AddSlowClass(slow);
+    }
+};
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_profileClassLoading(JNIEnv *env, jclass clazz,
+                                                             jboolean enabled) {
+    static std::unique_ptr<art::ClassLoadCallback> callback;
+
+    if (!callback && enabled == JNI_TRUE) {
+        // the profile is reused rather than freed, a removed callback may still be running
+        if (!class_load_profile) class_load_profile = new ClassLoadProfile();
+        class_load_profile->Reset();
+        auto ptr = new ClassLoadProfiler(*class_load_profile);
+        callback.reset(ptr);
+        art::Runtime::Current()->GetRuntimeCallbacks()->AddClassLoadCallback(ptr);
+    } else if (callback && enabled == JNI_FALSE) {
+        auto ptr = callback.release();
+        art::Runtime::Current()->GetRuntimeCallbacks()->RemoveClassLoadCallback(ptr);
+    }
+}
+
+static std::string FormatHistogram(const LatencyHistogram &h) {
+    return Format("count=%llu total=%s p50=%s p90=%s p99=%s max=%s",
+                  (unsigned long long) h.Count(), FormatNanos(h.Sum()).c_str(),
+                  FormatNanos(h.Percentile(50)).c_str(), FormatNanos(h.Percentile(90)).c_str(),
+                  FormatNanos(h.Percentile(99)).c_str(), FormatNanos(h.Max()).c_str());
+}
+
+static std::string ThreadName(pid_t tid) {
+    char path[64], name[32] = "?";
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+    if (int fd = open(path, O_RDONLY | O_CLOEXEC); fd >= 0) {
+        auto n = read(fd, name, sizeof(name) - 1);
+        if (n > 0) name[name[n - 1] == '\n' ? n - 1 : n] = 0;
+        close(fd);
+    }
+    return name;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_getClassLoadProfile(JNIEnv *env, jclass, jint top) {
+    if (!class_load_profile) return env->NewStringUTF("class load profiler was never enabled");
+    auto &profile = *class_load_profile;
+    size_t limit = top > 0 ? top : 10;
+
+    std::vector<SlowClass> slowest;
+    {
+        std::lock_guard lk{profile.slowest_mutex};
+        slowest = profile.slowest;
+    }
+    auto loaders = profile.loaders.Sorted();
+    LoaderNames loaderNames(env);
+
+    std::string report = "class load profile";
+    if (auto untracked = profile.untracked.load(std::memory_order_relaxed); untracked) {
+        report += Format(" (%llu untracked)", (unsigned long long) untracked);
+    }
+    report += "\n  total          " + FormatHistogram(profile.total);
+    report += "\n  define->load   " + FormatHistogram(profile.define_to_load);
+    report += "\n  load->prepare  " + FormatHistogram(profile.load_to_prepare);
+
+    report += "\nslowest classes:";
+    for (size_t i = 0; i < slowest.size() && i < limit; i++) {
+        auto &c = slowest[i];
+        report += Format("\n  %s (self %s) %s loader=%s tid=%d",
+                         FormatNanos(c.total_ns).c_str(), FormatNanos(c.self_ns).c_str(),
+                         DescriptorToName(c.descriptor).c_str(), loaderNames.Name(c.loader).c_str(), c.tid);
+    }
+
+    report += "\nloaders:";
+    for (size_t i = 0; i < loaders.size() && i < limit; i++) {
+        auto key = loaders[i]->key.load(std::memory_order_relaxed);
+        auto name = key == 0 ? std::string("<other>") : loaderNames.Name(key - 1);
+        report += "\n  " + name + " " + FormatHistogram(loaders[i]->histogram);
+    }
+
+    report += "\npackages:";
+    auto packages = profile.packages.Sorted();
+    for (size_t i = 0; i < packages.size() && i < limit; i++) {
+        auto name = packages[i]->key.load(std::memory_order_relaxed) == 0 ? std::string("<other>") : DescriptorToName(packages[i]->name);
+        report += "\n  " + name + " " + FormatHistogram(packages[i]->histogram);
+    }
+
+    report += "\nthreads:";
+    auto threads = profile.threads.Sorted();
+    for (size_t i = 0; i < threads.size() && i < limit; i++) {
+        auto tid = static_cast<pid_t>(threads[i]->key.load(std::memory_order_relaxed));
+        auto name = tid == 0 ? std::string("<other>") : Format("%d(%s)", tid, ThreadName(tid).c_str());
+        report += "\n  " + name + " " + FormatHistogram(threads[i]->histogram);
+    }
+
+    return env->NewStringUTF(report.c_str());
+}
@@ -4,3 +4,6 @@
 #include "elf_parser.hpp"
 
 bool InitClassLoaders(elf_parser::Elf &art);
+
+// addr is the first element of DexFile.mCookie
+const char *ReadOatPath(jlong addr);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram with fixed memory in the spirit of HdrHistogram: every power of 2
+// is split into kSubBuckets linear buckets, so the relative error stays below 1 / kSubBuckets.
+// Recording is lock-free and may race with readers.
+class LatencyHistogram {
+    static constexpr int kSubBucketBits = 3;
+    static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMaxExponent = 42;
+    static constexpr size_t kBucketCount = (kMaxExponent - kSubBucketBits + 1) * kSubBuckets + kSubBuckets;
+
+    std::atomic<uint32_t> counts_[kBucketCount]{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+
+    static size_t BucketOf(uint64_t value) {
+        if (value < kSubBuckets) return value;
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent > kMaxExponent) return kBucketCount - 1;
+        auto sub = (value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+        return (exponent - kSubBucketBits + 1) * kSubBuckets + sub;
+    }
+
+    static uint64_t UpperBoundOf(size_t bucket) {
+        if (bucket < kSubBuckets) return bucket;
+        int exponent = static_cast<int>(bucket / kSubBuckets) + kSubBucketBits - 1;
+        auto sub = bucket % kSubBuckets;
+        auto shift = exponent - kSubBucketBits;
+        return ((kSubBuckets + sub + 1) << shift) - 1;
+    }
+
+public:
+    void Record(uint64_t value) {
+        counts_[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        auto max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed));
+    }
+
+    void Reset() {
+        for (auto &c: counts_) c.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+    uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the given percentile (0-100).
+    uint64_t Percentile(double percentile) const {
+        auto count = Count();
+        if (count == 0) return 0;
+        auto target = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(count) + 0.5);
+        if (target == 0) target = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                auto bound = UpperBoundOf(i);
+                auto max = Max();
+                return bound < max ? bound : max;
+            }
+        }
+        return Max();
+    }
+};
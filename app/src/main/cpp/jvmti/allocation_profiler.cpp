@@ -0,0 +1,190 @@
+#include "stethox_jvmti.hpp"
+#include "stack_trie.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+// Sampled allocation tracking. ART reports every allocation as VMObjectAlloc (it has no
+// SampledObjectAlloc), so the sampling happens here: each thread draws exponentially
+// distributed byte distances and only takes a stack at the allocation crossing one, which
+// keeps the cost of the other allocations at a thread local subtraction. Samples go to a
+// stack trie owned by the thread, its lock is only ever contended by a dump.
+namespace {
+    constexpr jint kMaxFrames = 128;
+
+    struct ThreadTable {
+        std::mutex lock;
+        StackTrie trie;
+        int64_t until_sample = 0;
+        // bytes allocated by the thread since its last sample, the weight of the next one
+        int64_t since_sample = 0;
+        uint64_t random;
+        std::atomic<bool> in_use{true};
+    };
+
+    std::mutex g_alloc_mutex;
+    jvmtiEnv *g_alloc_env = nullptr;
+    std::atomic<jlong> g_interval{0};
+    std::atomic<jint> g_max_depth{kMaxFrames};
+    std::atomic<uint64_t> g_samples{0};
+    // tables are never freed, a thread may still be in a callback after the events are disabled.
+    // The table of an exited thread (and its samples) is adopted by the next new thread, so there
+    // are never more tables than threads alive at once.
+    std::mutex g_tables_mutex;
+    std::vector<ThreadTable *> g_tables;
+
+    thread_local struct TableHolder {
+        ThreadTable *table = nullptr;
+
+        ~TableHolder() {
+            if (table) table->in_use.store(false, std::memory_order_release);
+        }
+    } t_table;
+
+    int64_t NextSampleDistance(ThreadTable *table) {
+        auto interval = g_interval.load(std::memory_order_relaxed);
+        if (interval <= 0) return 0;
+        // xorshift64*
+        table->random ^= table->random >> 12;
+        table->random ^= table->random << 25;
+        table->random ^= table->random >> 27;
+        auto u = static_cast<double>((table->random * 0x2545F4914F6CDD1DULL) >> 11) / static_cast<double>(1ULL << 53);
+        return static_cast<int64_t>(-std::log(1.0 - u) * static_cast<double>(interval)) + 1;
+    }
+
+    ThreadTable *CurrentTable() {
+        if (t_table.table) return t_table.table;
+        ThreadTable *table = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(g_tables_mutex);
+            for (auto t: g_tables) {
+                bool expected = false;
+                if (t->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    table = t;
+                    break;
+                }
+            }
+            if (!table) {
+                table = new ThreadTable();
+                table->random = (reinterpret_cast<uintptr_t>(table) ^ NowNanos()) | 1;
+                g_tables.push_back(table);
+            }
+        }
+        table->since_sample = 0;
+        table->until_sample = NextSampleDistance(table);
+        t_table.table = table;
+        return table;
+    }
+
+    void JNICALL OnVMObjectAlloc(jvmtiEnv *ti, JNIEnv *, jthread, jobject, jclass klass, jlong size) {
+        auto table = CurrentTable();
+        table->since_sample += size;
+        table->until_sample -= size;
+        if (table->until_sample > 0) return;
+        table->until_sample = NextSampleDistance(table);
+
+        jvmtiFrameInfo frames[kMaxFrames];
+        jint count = 0;
+        if (ti->GetStackTrace(nullptr, 0, g_max_depth.load(std::memory_order_relaxed), frames, &count)) count = 0;
+        char *signature = nullptr;
+        ti->GetClassSignature(klass, &signature, nullptr);
+        {
+            std::lock_guard<std::mutex> lk(table->lock);
+            auto &trie = table->trie;
+            auto node = trie.LabelChild(trie.Intern(frames, count), signature ? DescriptorToName(signature) : "<unknown>");
+            trie.nodes[node].count++;
+            trie.nodes[node].weight += table->since_sample;
+        }
+        table->since_sample = 0;
+        if (signature) ti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+        g_samples.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStartAllocationTracking(JNIEnv *env, jclass, jlong interval, jint maxDepth) {
+    std::lock_guard<std::mutex> lk(g_alloc_mutex);
+    if (g_alloc_env) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "allocation tracking is running");
+        return;
+    }
+    jvmtiCapabilities cap{};
+    cap.can_generate_vm_object_alloc_events = true;
+    auto ti = NewEnv(env, cap);
+    if (!ti) return;
+
+    {
+        std::lock_guard<std::mutex> tables_lk(g_tables_mutex);
+        for (auto table: g_tables) {
+            std::lock_guard<std::mutex> table_lk(table->lock);
+            table->trie.Clear();
+            table->since_sample = 0;
+        }
+    }
+    g_interval = interval;
+    g_max_depth = maxDepth > 0 && maxDepth < kMaxFrames ? maxDepth : kMaxFrames;
+    g_samples = 0;
+
+    jvmtiEventCallbacks callbacks{};
+    callbacks.VMObjectAlloc = OnVMObjectAlloc;
+    auto r = ti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_OBJECT_ALLOC, nullptr);
+    if (r) {
+        ti->DisposeEnvironment();
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("enable VMObjectAlloc: " + to_string(r)).c_str());
+        return;
+    }
+    g_alloc_env = ti;
+    LOGD("allocation tracking started, interval %lld", static_cast<long long>(interval));
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStopAllocationTracking(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_alloc_mutex);
+    if (!g_alloc_env) return;
+    g_alloc_env->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_VM_OBJECT_ALLOC, nullptr);
+    // gives the capability back, so ART can leave the instrumented allocation entrypoints
+    g_alloc_env->DisposeEnvironment();
+    g_alloc_env = nullptr;
+    LOGD("allocation tracking stopped, %llu samples", static_cast<unsigned long long>(g_samples.load()));
+}
+
+// Writes the samples taken since the last start as collapsed stacks ending with the
+// allocated class, weighted by sample count or by bytes. Returns the number of stacks.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDumpAllocations(JNIEnv *env, jclass, jstring path, jboolean bytes, jboolean lines) {
+    std::vector<ThreadTable *> tables;
+    {
+        std::lock_guard<std::mutex> lk(g_tables_mutex);
+        tables = g_tables;
+    }
+    FrameNames names{env, static_cast<bool>(lines)};
+    std::unordered_map<std::string, uint64_t> stacks;
+    for (auto table: tables) {
+        StackTrie trie;
+        {
+            std::lock_guard<std::mutex> lk(table->lock);
+            if (table->trie.nodes.size() <= 1) continue;
+            trie = table->trie;
+        }
+        CollapseStacks(trie, names, bytes, stacks);
+    }
+
+    auto file = env->GetStringUTFChars(path, nullptr);
+    auto ok = WriteCollapsed(file, stacks);
+    if (!ok) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), Format("write %s: %s", file, strerror(errno)).c_str());
+    }
+    env->ReleaseStringUTFChars(path, file);
+    LOGD("dumped %zu allocation stacks from %zu threads", stacks.size(), tables.size());
+    return ok ? static_cast<jint>(stacks.size()) : 0;
+}
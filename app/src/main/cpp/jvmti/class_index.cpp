@@ -0,0 +1,219 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Subtype index of the loaded classes, built on the first query and kept up to date by
+// ClassPrepare events. Classes are tagged with their node id in a private environment and
+// every node lists its direct subtypes (subclasses, implementing classes and extending
+// interfaces) and holds a weak global ref to its class, so a subtype query is a traversal
+// over node ids instead of one JNI IsAssignableFrom call per loaded class.
+namespace {
+    constexpr jint kAccInterface = 0x200;
+    // weak globals share a table of 51200 entries with the app, classes indexed beyond this
+    // many have no ref and queries reaching them fall back to a scan of the loaded classes
+    constexpr size_t kMaxRefs = 16384;
+
+    class ClassIndex {
+        struct Node {
+            std::vector<uint32_t> subtypes;
+            // null once the class is unloaded, or if the node is beyond kMaxRefs
+            jweak ref = nullptr;
+            // edges are added once the class is prepared
+            bool linked = false;
+        };
+
+        std::mutex lock_;
+        jvmtiEnv *ti_ = nullptr;
+        // node 0 is unused, tag 0 means not indexed
+        std::vector<Node> nodes_{1};
+        uint32_t object_ = 0;
+        size_t refs_ = 0;
+
+        static inline std::atomic<ClassIndex *> instance_{nullptr};
+
+        // the index is the environment local storage, so events during the build are not missed
+        // and class loading threads never wait for the build
+        static void JNICALL OnClassPrepare(jvmtiEnv *ti, JNIEnv *env, jthread, jclass klass) {
+            void *data = nullptr;
+            if (ti->GetEnvironmentLocalStorage(&data) || !data) return;
+            auto index = static_cast<ClassIndex *>(data);
+            std::lock_guard<std::mutex> lk(index->lock_);
+            index->Add(env, klass);
+        }
+
+        // Indexes klass and its supertypes, returns its node.
+        uint32_t Add(JNIEnv *env, jclass klass) {
+            jlong tag = 0;
+            ti_->GetTag(klass, &tag);
+            auto id = static_cast<uint32_t>(tag);
+            if (!id) {
+                id = static_cast<uint32_t>(nodes_.size());
+                nodes_.emplace_back();
+                ti_->SetTag(klass, id);
+                if (refs_ < kMaxRefs) {
+                    nodes_[id].ref = env->NewWeakGlobalRef(klass);
+                    refs_++;
+                }
+            }
+            if (nodes_[id].linked) return id;
+            jint status = 0;
+            ti_->GetClassStatus(klass, &status);
+            if (status & JVMTI_CLASS_STATUS_PRIMITIVE) {
+                nodes_[id].linked = true;
+                return id;
+            }
+            if (!(status & (JVMTI_CLASS_STATUS_PREPARED | JVMTI_CLASS_STATUS_ARRAY))) return id;
+            nodes_[id].linked = true;
+
+            if (auto super = env->GetSuperclass(klass)) {
+                auto parent = Add(env, super);
+                nodes_[parent].subtypes.push_back(id);
+                env->DeleteLocalRef(super);
+            } else {
+                // interfaces are assignable to Object without having it as superclass
+                jint modifiers = 0;
+                ti_->GetClassModifiers(klass, &modifiers);
+                if ((modifiers & kAccInterface) && object_) nodes_[object_].subtypes.push_back(id);
+            }
+            jint count;
+            jclass *interfaces;
+            if (!ti_->GetImplementedInterfaces(klass, &count, &interfaces)) {
+                for (jint i = 0; i < count; i++) {
+                    auto parent = Add(env, interfaces[i]);
+                    nodes_[parent].subtypes.push_back(id);
+                    env->DeleteLocalRef(interfaces[i]);
+                }
+                ti_->Deallocate(reinterpret_cast<unsigned char *>(interfaces));
+            }
+            return id;
+        }
+
+        jvmtiError Build(JNIEnv *env) {
+            jvmtiCapabilities cap{};
+            cap.can_tag_objects = true;
+            ti_ = NewEnv(env, cap);
+            if (!ti_) return JVMTI_ERROR_INTERNAL;
+            // events first, so no class prepared during the build is missed
+            auto r = ti_->SetEnvironmentLocalStorage(this);
+            jvmtiEventCallbacks callbacks{};
+            callbacks.ClassPrepare = OnClassPrepare;
+            if (!r) r = ti_->SetEventCallbacks(&callbacks, sizeof(callbacks));
+            if (!r) r = ti_->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, nullptr);
+            if (r) return r;
+
+            auto start = NowNanos();
+            auto object_class = env->FindClass("java/lang/Object");
+            {
+                std::lock_guard<std::mutex> lk(lock_);
+                object_ = Add(env, object_class);
+            }
+            env->DeleteLocalRef(object_class);
+            jint count;
+            jclass *classes;
+            r = ti_->GetLoadedClasses(&count, &classes);
+            if (r) return r;
+            // locked per class, so prepare events of other threads interleave
+            for (jint i = 0; i < count; i++) {
+                {
+                    std::lock_guard<std::mutex> lk(lock_);
+                    Add(env, classes[i]);
+                }
+                env->DeleteLocalRef(classes[i]);
+            }
+            ti_->Deallocate(reinterpret_cast<unsigned char *>(classes));
+            LOGD("class index: %zu classes in %llu ms", nodes_.size() - 1,
+                 static_cast<unsigned long long>((NowNanos() - start) / 1000000));
+            return JVMTI_ERROR_NONE;
+        }
+
+    public:
+        // Builds the index on the first call, null if JVMTI is unavailable.
+        static ClassIndex *Get(JNIEnv *env) {
+            if (auto index = instance_.load(std::memory_order_acquire)) return index;
+            // only serializes the first queries, events go through the environment
+            static std::mutex build_lock;
+            std::lock_guard<std::mutex> lk(build_lock);
+            if (auto index = instance_.load(std::memory_order_relaxed)) return index;
+            auto index = new ClassIndex();
+            if (auto r = index->Build(env); r) {
+                LOGE("build class index: %s", to_string(r).c_str());
+                // a callback may already hold the index, so it is leaked instead of freed
+                if (index->ti_) index->ti_->DisposeEnvironment();
+                return nullptr;
+            }
+            instance_.store(index, std::memory_order_release);
+            return index;
+        }
+
+        // Local references to target and all its loaded subtypes, restricted to the classes
+        // of loader if it is not null.
+        jvmtiError Subtypes(JNIEnv *env, jclass target, jobject loader, std::vector<jclass> &out) {
+            std::vector<bool> found;
+            std::vector<jweak> refs;
+            bool all_refs = !loader;
+            {
+                std::lock_guard<std::mutex> lk(lock_);
+                std::vector<uint32_t> queue{Add(env, target)};
+                found.resize(nodes_.size());
+                found[queue[0]] = true;
+                for (size_t head = 0; head < queue.size(); head++) {
+                    for (auto sub: nodes_[queue[head]].subtypes) {
+                        if (found[sub]) continue;
+                        found[sub] = true;
+                        queue.push_back(sub);
+                    }
+                }
+                if (all_refs) {
+                    refs.reserve(queue.size());
+                    for (auto id: queue) {
+                        if (!nodes_[id].ref) {
+                            all_refs = false;
+                            break;
+                        }
+                        refs.push_back(nodes_[id].ref);
+                    }
+                }
+            }
+
+            if (all_refs) {
+                out.reserve(out.size() + refs.size());
+                for (auto ref: refs) {
+                    if (auto klass = env->NewLocalRef(ref)) out.push_back(reinterpret_cast<jclass>(klass));
+                }
+                return JVMTI_ERROR_NONE;
+            }
+
+            // GetClassLoaderClasses also returns the classes the loader only initiated
+            jint count;
+            jclass *classes;
+            auto r = loader ? ti_->GetClassLoaderClasses(loader, &count, &classes) : ti_->GetLoadedClasses(&count, &classes);
+            if (r) return r;
+            for (jint i = 0; i < count; i++) {
+                jlong tag = 0;
+                ti_->GetTag(classes[i], &tag);
+                if (tag > 0 && static_cast<size_t>(tag) < found.size() && found[tag]) {
+                    out.push_back(classes[i]);
+                } else {
+                    env->DeleteLocalRef(classes[i]);
+                }
+            }
+            ti_->Deallocate(reinterpret_cast<unsigned char *>(classes));
+            return JVMTI_ERROR_NONE;
+        }
+    };
+}
+
+jvmtiError FindSubtypes(JNIEnv *env, jclass target, jobject loader, std::vector<jclass> &out) {
+    jint status = 0;
+    gJvmtiEnv->GetClassStatus(target, &status);
+    // array classes are covariant in their component type, which the index does not model
+    if (status & JVMTI_CLASS_STATUS_ARRAY) return JVMTI_ERROR_NOT_AVAILABLE;
+    auto index = ClassIndex::Get(env);
+    if (!index) return JVMTI_ERROR_NOT_AVAILABLE;
+    return index->Subtypes(env, target, loader, out);
+}
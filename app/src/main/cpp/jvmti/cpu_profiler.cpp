@@ -0,0 +1,249 @@
+#include "stethox_jvmti.hpp"
+#include "stack_trie.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Sampling CPU profiler: a native thread attached as a daemon takes GetAllStackTraces at a
+// fixed rate and interns the stacks below a label node per thread name. Only the trie and a
+// (leaf node, time) pair per sample are recorded, methods are named when the profile is
+// written. By default only threads running Java code are sampled, threads blocked or idle in
+// native code (such as a looper waiting for messages) are skipped.
+namespace {
+    class CpuProfiler {
+        jvmtiEnv *ti_;
+        JavaVM *vm_;
+        std::thread thread_;
+        std::mutex wait_lock_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+        jlong interval_us_;
+        jint max_depth_;
+        bool all_threads_;
+        bool lines_;
+
+        void Run() {
+            JNIEnv *env;
+            JavaVMAttachArgs args{JNI_VERSION_1_6, "StethoX-CpuProfiler", nullptr};
+            if (vm_->AttachCurrentThreadAsDaemon(&env, &args) != JNI_OK) {
+                LOGE("cpu profiler: failed to attach");
+                return;
+            }
+            std::unique_lock<std::mutex> wait_lk(wait_lock_);
+            while (!wake_.wait_for(wait_lk, std::chrono::microseconds(interval_us_), [this] { return stop_; })) {
+                wait_lk.unlock();
+                env->PushLocalFrame(64);
+                Sample(env);
+                env->PopLocalFrame(nullptr);
+                wait_lk.lock();
+            }
+            vm_->DetachCurrentThread();
+        }
+
+        void Sample(JNIEnv *env) {
+            jvmtiStackInfo *infos;
+            jint count;
+            if (ti_->GetAllStackTraces(max_depth_, &infos, &count)) return;
+            auto now = NowNanos();
+            std::lock_guard<std::mutex> lk(lock);
+            for (jint i = 0; i < count; i++) {
+                auto &info = infos[i];
+                bool running = (info.state & JVMTI_THREAD_STATE_RUNNABLE) && !(info.state & JVMTI_THREAD_STATE_IN_NATIVE);
+                if (info.frame_count == 0 || (!all_threads_ && !running)) {
+                    env->DeleteLocalRef(info.thread);
+                    continue;
+                }
+                jvmtiThreadInfo thread_info{};
+                std::string name = "<unknown>";
+                if (!ti_->GetThreadInfo(info.thread, &thread_info)) {
+                    if (thread_info.name) name = thread_info.name;
+                    ti_->Deallocate(reinterpret_cast<unsigned char *>(thread_info.name));
+                    env->DeleteLocalRef(thread_info.thread_group);
+                    env->DeleteLocalRef(thread_info.context_class_loader);
+                }
+                env->DeleteLocalRef(info.thread);
+                if (!lines_) {
+                    for (jint f = 0; f < info.frame_count; f++) info.frame_buffer[f].location = 0;
+                }
+                auto node = trie.Intern(info.frame_buffer, info.frame_count, trie.LabelChild(0, name));
+                trie.nodes[node].count++;
+                samples.emplace_back(node, now);
+            }
+            end_ns = now;
+            ti_->Deallocate(reinterpret_cast<unsigned char *>(infos));
+        }
+
+    public:
+        // guards trie, samples and end_ns
+        std::mutex lock;
+        StackTrie trie;
+        std::vector<std::pair<uint32_t, uint64_t>> samples;
+        uint64_t start_ns;
+        uint64_t end_ns;
+
+        CpuProfiler(jvmtiEnv *ti, JavaVM *vm, jlong interval_us, jint max_depth, bool all_threads, bool lines)
+                : ti_(ti), vm_(vm), interval_us_(interval_us), max_depth_(max_depth), all_threads_(all_threads),
+                  lines_(lines), start_ns(NowNanos()), end_ns(start_ns) {
+            thread_ = std::thread([this] { Run(); });
+        }
+
+        ~CpuProfiler() {
+            Stop();
+            ti_->DisposeEnvironment();
+        }
+
+        bool lines() const { return lines_; }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lk(wait_lock_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            if (thread_.joinable()) thread_.join();
+        }
+    };
+
+    std::mutex g_cpu_mutex;
+    // the last profile is kept after stopping so it can still be written
+    CpuProfiler *g_cpu_profiler = nullptr;
+    bool g_cpu_running = false;
+
+    void AppendJsonString(std::string &out, const std::string &s) {
+        out += '"';
+        for (unsigned char c: s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            } else if (c < 0x20) {
+                out += Format("\\u%04x", c);
+            } else {
+                out += static_cast<char>(c);
+            }
+        }
+        out += '"';
+    }
+
+    // Chrome DevTools .cpuprofile: one node per trie node (ids shifted by one, node 1 is the
+    // root), the samples as leaf ids with time deltas in microseconds.
+    std::string ChromeProfile(const StackTrie &trie, const std::vector<std::pair<uint32_t, uint64_t>> &samples,
+                              uint64_t start_ns, uint64_t end_ns, FrameNames &names) {
+        std::string out = "{\"nodes\":[";
+        for (size_t i = 0; i < trie.nodes.size(); i++) {
+            auto &node = trie.nodes[i];
+            if (i) out += ',';
+            out += Format("{\"id\":%zu,\"callFrame\":{\"functionName\":", i + 1);
+            jint line = -1;
+            if (i == 0) {
+                out += "\"(root)\"";
+            } else if (node.method) {
+                AppendJsonString(out, names.MethodName(node.method));
+                line = names.Line(node.method, node.location);
+            } else {
+                AppendJsonString(out, trie.labels[node.location]);
+            }
+            out += Format(",\"scriptId\":\"0\",\"url\":\"\",\"lineNumber\":%d,\"columnNumber\":-1},\"hitCount\":%llu,\"children\":[",
+                          line > 0 ? line - 1 : -1, static_cast<unsigned long long>(node.count));
+            bool first = true;
+            for (auto c = node.first_child; c; c = trie.nodes[c].next_sibling) {
+                if (!first) out += ',';
+                first = false;
+                out += std::to_string(c + 1);
+            }
+            out += "]}";
+        }
+        out += Format("],\"startTime\":%llu,\"endTime\":%llu,\"samples\":[",
+                      static_cast<unsigned long long>(start_ns / 1000), static_cast<unsigned long long>(end_ns / 1000));
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (i) out += ',';
+            out += std::to_string(samples[i].first + 1);
+        }
+        out += "],\"timeDeltas\":[";
+        auto last = start_ns / 1000;
+        for (size_t i = 0; i < samples.size(); i++) {
+            if (i) out += ',';
+            auto time = samples[i].second / 1000;
+            out += std::to_string(time - last);
+            last = time;
+        }
+        out += "]}";
+        return out;
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStartCpuProfiling(JNIEnv *env, jclass, jlong intervalMicros, jint maxDepth,
+                                                                 jboolean allThreads, jboolean lines) {
+    std::lock_guard<std::mutex> lk(g_cpu_mutex);
+    if (g_cpu_running) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "cpu profiling is running");
+        return;
+    }
+    auto ti = NewEnv(env, jvmtiCapabilities{});
+    if (!ti) return;
+    JavaVM *vm;
+    env->GetJavaVM(&vm);
+    delete g_cpu_profiler;
+    g_cpu_profiler = new CpuProfiler(ti, vm, intervalMicros > 0 ? intervalMicros : 10000, maxDepth > 0 ? maxDepth : 128,
+                                     allThreads, lines);
+    g_cpu_running = true;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStopCpuProfiling(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_cpu_mutex);
+    if (!g_cpu_running) return;
+    g_cpu_profiler->Stop();
+    g_cpu_running = false;
+    LOGD("cpu profiling stopped, %zu samples", g_cpu_profiler->samples.size());
+}
+
+// Writes the current or last profile as collapsed stacks (sample counts) or as a Chrome
+// .cpuprofile. Returns the number of samples.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDumpCpuProfile(JNIEnv *env, jclass, jstring path, jboolean chrome) {
+    std::lock_guard<std::mutex> lk(g_cpu_mutex);
+    if (!g_cpu_profiler) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "no cpu profile");
+        return 0;
+    }
+    auto profiler = g_cpu_profiler;
+    StackTrie trie;
+    std::vector<std::pair<uint32_t, uint64_t>> samples;
+    uint64_t end_ns;
+    {
+        std::lock_guard<std::mutex> profile_lk(profiler->lock);
+        trie = profiler->trie;
+        samples = profiler->samples;
+        end_ns = profiler->end_ns;
+    }
+    FrameNames names{env, profiler->lines()};
+    auto file = env->GetStringUTFChars(path, nullptr);
+    bool ok;
+    if (chrome) {
+        auto json = ChromeProfile(trie, samples, profiler->start_ns, end_ns, names);
+        auto f = fopen(file, "we");
+        ok = f && fwrite(json.data(), 1, json.size(), f) == json.size();
+        if (f && fclose(f)) ok = false;
+    } else {
+        std::unordered_map<std::string, uint64_t> stacks;
+        CollapseStacks(trie, names, false, stacks);
+        ok = WriteCollapsed(file, stacks);
+    }
+    if (!ok) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), Format("write %s: %s", file, strerror(errno)).c_str());
+    }
+    env->ReleaseStringUTFChars(path, file);
+    return ok ? static_cast<jint>(samples.size()) : 0;
+}
@@ -0,0 +1,263 @@
+#include "stethox_jvmti.hpp"
+#include "heap_graph.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <vector>
+
+// Dominator tree and retained sizes of the heap graph, computed with Lengauer-Tarjan
+// (simple variant with path compression) from the virtual root. Only the per-node results
+// are kept afterwards, the edges are freed once the tree is built, and the tags of the
+// private environment map objects back to nodes for queries.
+class DominatorTree {
+    jvmtiEnv *ti_;
+    HeapGraph graph_;
+    std::vector<uint32_t> idom_;
+    std::vector<uint64_t> retained_;
+    uint32_t reachable_ = 0;
+    uint64_t edge_count_ = 0;
+    uint64_t build_ns_ = 0;
+
+    explicit DominatorTree(jvmtiEnv *ti) : ti_(ti) {}
+
+public:
+    // Throws and returns null on failure.
+    static DominatorTree *Create(JNIEnv *env) {
+        auto ti = NewTagEnv(env);
+        if (!ti) return nullptr;
+        auto tree = new DominatorTree(ti);
+        auto start = NowNanos();
+        auto r = tree->graph_.Prepare(env, ti);
+        if (!r) r = tree->graph_.Walk(ti, nullptr);
+        if (r) {
+            delete tree;
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("FollowReferences: " + to_string(r)).c_str());
+            return nullptr;
+        }
+        tree->Compute();
+        tree->build_ns_ = NowNanos() - start;
+        LOGD("dominator tree: %s", tree->Stats().c_str());
+        return tree;
+    }
+
+    ~DominatorTree() {
+        ti_->DisposeEnvironment();
+    }
+
+    static DominatorTree *From(jlong handle) { return reinterpret_cast<DominatorTree *>(handle); }
+
+    jlong Handle() { return reinterpret_cast<jlong>(this); }
+
+    uint32_t NodeOf(jobject obj) const {
+        jlong tag = 0;
+        if (!obj || ti_->GetTag(obj, &tag) || tag <= 0 || static_cast<uint64_t>(tag) >= idom_.size()) return HeapGraph::kNone;
+        return static_cast<uint32_t>(tag);
+    }
+
+    jlong Retained(uint32_t node) const {
+        return node == HeapGraph::kNone ? -1 : static_cast<jlong>(retained_[node]);
+    }
+
+    jlong Shallow(uint32_t node) const {
+        return node == HeapGraph::kNone ? -1 : graph_.nodes[node].size;
+    }
+
+    // Children of node in the dominator tree (the top level retainers for the root) with the
+    // largest retained sizes.
+    std::vector<uint32_t> Top(uint32_t node, size_t n) const {
+        std::vector<uint32_t> children;
+        for (uint32_t i = 1; i < idom_.size(); i++) {
+            if (idom_[i] == node && i != node) children.push_back(i);
+        }
+        n = std::min(n, children.size());
+        std::partial_sort(children.begin(), children.begin() + static_cast<long>(n), children.end(), [&](uint32_t a, uint32_t b) {
+            return retained_[a] > retained_[b];
+        });
+        children.resize(n);
+        return children;
+    }
+
+    jobjectArray Objects(JNIEnv *env, const std::vector<uint32_t> &nodes) const {
+        std::vector<jobject> objects;
+        auto r = graph_.Objects(env, ti_, nodes, objects);
+        if (r) {
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetObjectsWithTags: " + to_string(r)).c_str());
+            return nullptr;
+        }
+        auto arr = env->NewObjectArray(static_cast<jsize>(objects.size()), env->FindClass("java/lang/Object"), nullptr);
+        for (size_t i = 0; i < objects.size(); i++) {
+            env->SetObjectArrayElement(arr, static_cast<jsize>(i), objects[i]);
+            env->DeleteLocalRef(objects[i]);
+        }
+        return arr;
+    }
+
+    std::string Stats() const {
+        auto memory = graph_.MemoryUsage() + idom_.capacity() * sizeof(uint32_t) + retained_.capacity() * sizeof(uint64_t);
+        return Format("%u reachable objects, %llu edges, %llu bytes retained by the roots, built in %llu ms, "
+                      "%zu bytes native memory (%.1f bytes per object)",
+                      reachable_, static_cast<unsigned long long>(edge_count_),
+                      static_cast<unsigned long long>(retained_.empty() ? 0 : retained_[HeapGraph::kRoot]),
+                      static_cast<unsigned long long>(build_ns_ / 1000000), memory,
+                      reachable_ ? static_cast<double>(memory) / reachable_ : 0.0);
+    }
+
+private:
+    template<typename F>
+    void ForEachSuccessor(uint32_t node, F &&f) const {
+        if (node == HeapGraph::kRoot) {
+            for (auto to: graph_.roots) f(to);
+            return;
+        }
+        auto &n = graph_.nodes[node];
+        for (uint32_t e = n.first_edge; e < n.first_edge + n.edge_count; e++) f(graph_.edges[e]);
+    }
+
+    void Compute() {
+        auto n = static_cast<uint32_t>(graph_.nodes.size());
+        edge_count_ = graph_.edges.size() + graph_.roots.size();
+
+        // depth first numbering from 1, dfnum 0 is unreachable
+        std::vector<uint32_t> dfnum(n, 0), vertex(1, 0), parent(1, 0);
+        {
+            std::vector<std::pair<uint32_t, uint32_t>> stack;
+            dfnum[HeapGraph::kRoot] = 1;
+            vertex.push_back(HeapGraph::kRoot);
+            parent.push_back(0);
+            stack.emplace_back(HeapGraph::kRoot, 0);
+            while (!stack.empty()) {
+                auto &[node, next] = stack.back();
+                auto row = node == HeapGraph::kRoot ? graph_.roots.data() : graph_.edges.data() + graph_.nodes[node].first_edge;
+                auto size = node == HeapGraph::kRoot ? graph_.roots.size() : graph_.nodes[node].edge_count;
+                if (next == size) {
+                    stack.pop_back();
+                    continue;
+                }
+                auto to = row[next++];
+                if (dfnum[to]) continue;
+                dfnum[to] = static_cast<uint32_t>(vertex.size());
+                vertex.push_back(to);
+                parent.push_back(dfnum[node]);
+                stack.emplace_back(to, 0);
+            }
+        }
+        auto count = static_cast<uint32_t>(vertex.size() - 1);
+        reachable_ = count - 1;
+
+        // predecessors in dfnum space
+        std::vector<uint32_t> pred_start(count + 2, 0), preds;
+        for (uint32_t v = 1; v <= count; v++) {
+            ForEachSuccessor(vertex[v], [&](uint32_t to) {
+                if (dfnum[to]) pred_start[dfnum[to] + 1]++;
+            });
+        }
+        for (uint32_t i = 1; i < pred_start.size(); i++) pred_start[i] += pred_start[i - 1];
+        preds.resize(pred_start[count + 1]);
+        {
+            std::vector<uint32_t> fill(pred_start.begin(), pred_start.end() - 1);
+            for (uint32_t v = 1; v <= count; v++) {
+                ForEachSuccessor(vertex[v], [&](uint32_t to) {
+                    if (dfnum[to]) preds[fill[dfnum[to]]++] = v;
+                });
+            }
+        }
+        // the graph is no longer needed, only the node sizes are
+        std::vector<uint32_t>().swap(graph_.edges);
+        std::vector<uint32_t>().swap(graph_.labels);
+        std::vector<uint32_t>().swap(graph_.roots);
+        std::vector<uint32_t>().swap(graph_.root_labels);
+
+        std::vector<uint32_t> semi(count + 1), label(count + 1), ancestor(count + 1, 0), idom(count + 1, 0);
+        std::vector<uint32_t> bucket_head(count + 1, 0), bucket_next(count + 1, 0), path;
+        for (uint32_t i = 0; i <= count; i++) semi[i] = label[i] = i;
+        auto eval = [&](uint32_t v) {
+            if (!ancestor[v]) return v;
+            path.clear();
+            for (auto x = v; ancestor[ancestor[x]]; x = ancestor[x]) path.push_back(x);
+            for (auto it = path.rbegin(); it != path.rend(); it++) {
+                auto y = *it;
+                if (semi[label[ancestor[y]]] < semi[label[y]]) label[y] = label[ancestor[y]];
+                ancestor[y] = ancestor[ancestor[y]];
+            }
+            return label[v];
+        };
+        for (uint32_t w = count; w >= 2; w--) {
+            for (auto p = pred_start[w]; p < pred_start[w + 1]; p++) {
+                auto u = eval(preds[p]);
+                if (semi[u] < semi[w]) semi[w] = semi[u];
+            }
+            bucket_next[w] = bucket_head[semi[w]];
+            bucket_head[semi[w]] = w;
+            auto pw = parent[w];
+            ancestor[w] = pw;
+            for (auto v = bucket_head[pw]; v; v = bucket_next[v]) {
+                auto u = eval(v);
+                idom[v] = semi[u] < semi[v] ? u : pw;
+            }
+            bucket_head[pw] = 0;
+        }
+        for (uint32_t w = 2; w <= count; w++) {
+            if (idom[w] != semi[w]) idom[w] = idom[idom[w]];
+        }
+
+        // children have larger numbers than their dominators
+        idom_.assign(n, HeapGraph::kNone);
+        retained_.assign(n, 0);
+        for (uint32_t w = 1; w <= count; w++) {
+            idom_[vertex[w]] = w == 1 ? HeapGraph::kRoot : vertex[idom[w]];
+            retained_[vertex[w]] = graph_.nodes[vertex[w]].size;
+        }
+        for (uint32_t w = count; w >= 2; w--) {
+            retained_[vertex[idom[w]]] += retained_[vertex[w]];
+        }
+    }
+};
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeBuildDominatorTree(JNIEnv *env, jclass) {
+    auto tree = DominatorTree::Create(env);
+    return tree ? tree->Handle() : 0;
+}
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDominatorTop(JNIEnv *env, jclass, jlong handle, jobject parent, jint n) {
+    auto tree = DominatorTree::From(handle);
+    auto node = parent ? tree->NodeOf(parent) : HeapGraph::kRoot;
+    if (node == HeapGraph::kNone) return env->NewObjectArray(0, env->FindClass("java/lang/Object"), nullptr);
+    return tree->Objects(env, tree->Top(node, n > 0 ? n : 0));
+}
+
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDominatorSizes(JNIEnv *env, jclass, jlong handle, jobjectArray objects) {
+    auto tree = DominatorTree::From(handle);
+    auto size = env->GetArrayLength(objects);
+    // retained and shallow size of each object, -1 for objects which were not reachable
+    std::vector<jlong> sizes(size * 2);
+    for (jsize i = 0; i < size; i++) {
+        auto obj = env->GetObjectArrayElement(objects, i);
+        auto node = tree->NodeOf(obj);
+        sizes[i * 2] = tree->Retained(node);
+        sizes[i * 2 + 1] = tree->Shallow(node);
+        env->DeleteLocalRef(obj);
+    }
+    auto arr = env->NewLongArray(size * 2);
+    env->SetLongArrayRegion(arr, 0, size * 2, sizes.data());
+    return arr;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDominatorStats(JNIEnv *env, jclass, jlong handle) {
+    return env->NewStringUTF(DominatorTree::From(handle)->Stats().c_str());
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDominatorClose(JNIEnv *, jclass, jlong handle) {
+    delete DominatorTree::From(handle);
+}
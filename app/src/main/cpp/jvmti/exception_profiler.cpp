@@ -0,0 +1,226 @@
+#include "stethox_jvmti.hpp"
+#include "stack_trie.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Exception throw-site profiler. The Exception event counts every throw in a fixed open
+// addressing table keyed by (exception class, throw method, location, catch method), claimed
+// and bumped with atomics only. Exception classes are tagged with an id in the private
+// environment, the first throw of a class takes a lock to name it. A stack is only walked
+// for the first throw of a site and every stack_interval-th one after, and interned below a
+// label of the site in a shared trie.
+namespace {
+    constexpr size_t kMaxSites = 4096;
+    constexpr jint kMaxFrames = 64;
+
+    struct ThrowSite {
+        std::atomic<uint64_t> key{0};
+        std::atomic<bool> ready{false};
+        uint32_t klass;
+        jmethodID method;
+        jlocation location;
+        jmethodID catch_method;
+        jlocation catch_location;
+        std::atomic<uint64_t> count{0};
+    };
+
+    ThrowSite *g_sites = nullptr;
+    std::atomic<uint64_t> g_dropped_throws{0};
+    std::atomic<uint64_t> g_total_throws{0};
+
+    std::mutex g_exception_mutex;
+    jvmtiEnv *g_exception_env = nullptr;
+    jint g_stack_interval = 0;
+    jint g_stack_depth = kMaxFrames;
+
+    // guards g_exception_classes and g_exception_stacks, not taken by counting a known site
+    std::mutex g_exception_data_mutex;
+    // index is the tag of the class, 0 is unused
+    std::vector<std::string> g_exception_classes;
+    // one label per site, named by its index in g_sites
+    StackTrie g_exception_stacks;
+
+    uint64_t Mix(uint64_t h, uint64_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        return h;
+    }
+
+    ThrowSite *FindSite(uint32_t klass, jmethodID method, jlocation location, jmethodID catch_method, jlocation catch_location) {
+        auto key = Mix(Mix(Mix(Mix(klass, reinterpret_cast<uintptr_t>(method)), location), reinterpret_cast<uintptr_t>(catch_method)), catch_location);
+        if (!key) key = 1;
+        auto start = (key * 0x9e3779b97f4a7c15ull) >> 32;
+        for (size_t i = 0; i < kMaxSites; i++) {
+            auto &site = g_sites[(start + i) % kMaxSites];
+            auto k = site.key.load(std::memory_order_acquire);
+            if (k == 0 && site.key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+                site.klass = klass;
+                site.method = method;
+                site.location = location;
+                site.catch_method = catch_method;
+                site.catch_location = catch_location;
+                site.ready.store(true, std::memory_order_release);
+                return &site;
+            }
+            if (k == key) return &site;
+        }
+        return nullptr;
+    }
+
+    uint32_t ClassId(jvmtiEnv *ti, JNIEnv *env, jobject exception) {
+        auto klass = env->GetObjectClass(exception);
+        jlong tag = 0;
+        ti->GetTag(klass, &tag);
+        if (!tag) {
+            std::lock_guard<std::mutex> lk(g_exception_data_mutex);
+            // another thread may have named it meanwhile
+            ti->GetTag(klass, &tag);
+            char *signature;
+            if (!tag && !ti->GetClassSignature(klass, &signature, nullptr)) {
+                tag = static_cast<jlong>(g_exception_classes.size());
+                g_exception_classes.push_back(DescriptorToName(signature));
+                ti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+                ti->SetTag(klass, tag);
+            }
+        }
+        env->DeleteLocalRef(klass);
+        return static_cast<uint32_t>(tag);
+    }
+
+    void JNICALL OnException(jvmtiEnv *ti, JNIEnv *env, jthread, jmethodID method, jlocation location, jobject exception,
+                             jmethodID catch_method, jlocation catch_location) {
+        g_total_throws.fetch_add(1, std::memory_order_relaxed);
+        auto site = FindSite(ClassId(ti, env, exception), method, location, catch_method, catch_location);
+        if (!site) {
+            g_dropped_throws.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto count = site->count.fetch_add(1, std::memory_order_relaxed) + 1;
+        auto interval = g_stack_interval;
+        if (interval <= 0 || (count != 1 && count % interval != 0)) return;
+
+        jvmtiFrameInfo frames[kMaxFrames];
+        jint depth = 0;
+        if (ti->GetStackTrace(nullptr, 0, g_stack_depth, frames, &depth)) return;
+        std::lock_guard<std::mutex> lk(g_exception_data_mutex);
+        auto &trie = g_exception_stacks;
+        auto node = trie.Intern(frames, depth, trie.LabelChild(0, std::to_string(site - g_sites)));
+        trie.nodes[node].count++;
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStartExceptionProfiling(JNIEnv *env, jclass, jint stackInterval, jint maxDepth) {
+    std::lock_guard<std::mutex> lk(g_exception_mutex);
+    if (g_exception_env) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "exception profiling is running");
+        return;
+    }
+    jvmtiCapabilities cap{};
+    cap.can_tag_objects = true;
+    cap.can_generate_exception_events = true;
+    auto ti = NewEnv(env, cap);
+    if (!ti) return;
+    // sites are never freed, a thread may still be in a callback after the events are disabled
+    if (!g_sites) g_sites = new ThrowSite[kMaxSites];
+    for (size_t i = 0; i < kMaxSites; i++) {
+        g_sites[i].ready.store(false, std::memory_order_relaxed);
+        g_sites[i].count.store(0, std::memory_order_relaxed);
+        g_sites[i].key.store(0, std::memory_order_relaxed);
+    }
+    g_dropped_throws = 0;
+    g_total_throws = 0;
+    {
+        std::lock_guard<std::mutex> data_lk(g_exception_data_mutex);
+        g_exception_classes.assign(1, "<unknown>");
+        g_exception_stacks.Clear();
+    }
+    g_stack_interval = stackInterval;
+    g_stack_depth = maxDepth > 0 && maxDepth < kMaxFrames ? maxDepth : kMaxFrames;
+
+    jvmtiEventCallbacks callbacks{};
+    callbacks.Exception = OnException;
+    auto r = ti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, nullptr);
+    if (r) {
+        ti->DisposeEnvironment();
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("enable Exception: " + to_string(r)).c_str());
+        return;
+    }
+    g_exception_env = ti;
+    LOGD("exception profiling started");
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStopExceptionProfiling(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_exception_mutex);
+    if (!g_exception_env) return;
+    g_exception_env->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_EXCEPTION, nullptr);
+    g_exception_env->DisposeEnvironment();
+    g_exception_env = nullptr;
+    LOGD("exception profiling stopped, %llu throws", static_cast<unsigned long long>(g_total_throws.load()));
+}
+
+// The hottest throw sites with their catch sites and the most sampled stack of each.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeExceptionReport(JNIEnv *env, jclass, jint top, jint maxFrames, jboolean lines) {
+    std::lock_guard<std::mutex> lk(g_exception_mutex);
+    if (!g_sites) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "exception profiling was never started");
+        return nullptr;
+    }
+    struct Row {
+        size_t index;
+        uint64_t count;
+    };
+    std::vector<Row> rows;
+    for (size_t i = 0; i < kMaxSites; i++) {
+        auto &site = g_sites[i];
+        if (!site.ready.load(std::memory_order_acquire)) continue;
+        if (auto count = site.count.load(std::memory_order_relaxed)) rows.push_back({i, count});
+    }
+    std::sort(rows.begin(), rows.end(), [](auto &a, auto &b) { return a.count > b.count; });
+    if (top > 0 && rows.size() > static_cast<size_t>(top)) rows.resize(top);
+
+    std::vector<std::string> classes;
+    StackTrie stacks;
+    {
+        std::lock_guard<std::mutex> data_lk(g_exception_data_mutex);
+        classes = g_exception_classes;
+        stacks = g_exception_stacks;
+    }
+    std::unordered_map<std::string, uint32_t> labels;
+    for (auto c = stacks.nodes[0].first_child; c; c = stacks.nodes[c].next_sibling) {
+        labels[stacks.labels[stacks.nodes[c].location]] = c;
+    }
+
+    FrameNames names{env, static_cast<bool>(lines)};
+    auto depth = maxFrames > 0 ? maxFrames : 8;
+    auto report = Format("%llu throws, %zu sites", static_cast<unsigned long long>(g_total_throws.load()), rows.size());
+    if (auto dropped = g_dropped_throws.load()) report += Format(", %llu throws beyond the site table", static_cast<unsigned long long>(dropped));
+    for (auto &row: rows) {
+        auto &site = g_sites[row.index];
+        report += Format("\n%10llu  %s\n    thrown at %s\n    ", static_cast<unsigned long long>(row.count),
+                         site.klass < classes.size() ? classes[site.klass].c_str() : "<unknown>",
+                         names.Name(site.method, site.location).c_str());
+        report += site.catch_method ? "caught at " + names.Name(site.catch_method, site.catch_location) : "uncaught";
+        auto label = labels.find(std::to_string(row.index));
+        if (label == labels.end()) continue;
+        auto best = stacks.Heaviest(label->second, false);
+        if (!best) continue;
+        report += Format("\n    %llu sampled stacks like:", static_cast<unsigned long long>(stacks.nodes[best].count));
+        int frames = 0;
+        for (auto id = best; id && id != label->second && frames < depth; id = stacks.nodes[id].parent, frames++) {
+            report += "\n        at " + names.Name(stacks.nodes[id].method, stacks.nodes[id].location);
+        }
+    }
+    return env->NewStringUTF(report.c_str());
+}
@@ -0,0 +1,263 @@
+#include "stethox_jvmti.hpp"
+#include "histogram.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// GC pause timeline. ART posts GarbageCollectionStart and GarbageCollectionFinish around
+// the pauses of a collection, with every mutator suspended, and JVMTI forbids JNI and most
+// JVMTI calls there. The callbacks only store timestamps into a fixed ring, record the pause
+// into a lock-free histogram and signal a native sampler thread. The sampler reads the heap
+// occupancy (Runtime.totalMemory - freeMemory) once the mutators run again, and also at a
+// fixed rate, so the occupancy before a pause is the last periodic sample.
+namespace {
+    constexpr size_t kRingSize = 1024;
+
+    // fields are atomic so the console can copy slots while the GC thread overwrites old ones
+    struct GcSlot {
+        std::atomic<uint64_t> start_ns{0};
+        std::atomic<uint64_t> end_ns{0};
+        std::atomic<int64_t> used_before{-1};
+        std::atomic<int64_t> used_after{-1};
+    };
+
+    class GcMonitor {
+        jvmtiEnv *ti_;
+        JavaVM *vm_;
+        std::thread thread_;
+        std::mutex wait_lock_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+        std::atomic<bool> pending_{false};
+        uint64_t interval_ms_;
+
+        void Run() {
+            JNIEnv *env;
+            JavaVMAttachArgs args{JNI_VERSION_1_6, "StethoX-GcMonitor", nullptr};
+            if (vm_->AttachCurrentThreadAsDaemon(&env, &args) != JNI_OK) {
+                LOGE("gc monitor: failed to attach");
+                return;
+            }
+            auto runtime_class = env->FindClass("java/lang/Runtime");
+            auto get_runtime = env->GetStaticMethodID(runtime_class, "getRuntime", "()Ljava/lang/Runtime;");
+            auto total_memory = env->GetMethodID(runtime_class, "totalMemory", "()J");
+            auto free_memory = env->GetMethodID(runtime_class, "freeMemory", "()J");
+            auto runtime = env->CallStaticObjectMethod(runtime_class, get_runtime);
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+                LOGE("gc monitor: no Runtime");
+                vm_->DetachCurrentThread();
+                return;
+            }
+            std::unique_lock<std::mutex> wait_lk(wait_lock_);
+            while (!stop_) {
+                wait_lk.unlock();
+                // the pause is taken before sampling, so the sample is never from before the pause
+                // it is stored for; a pause finishing meanwhile is sampled on the next round
+                auto pending = pending_.exchange(false, std::memory_order_acquire);
+                auto count = pending ? finished.load(std::memory_order_acquire) : 0;
+                auto used = env->CallLongMethod(runtime, total_memory) - env->CallLongMethod(runtime, free_memory);
+                // the latest finished pause, unless the ring wrapped meanwhile
+                if (count) ring[(count - 1) % kRingSize].used_after.store(used, std::memory_order_relaxed);
+                last_used.store(used, std::memory_order_relaxed);
+                wait_lk.lock();
+                wake_.wait_for(wait_lk, std::chrono::milliseconds(interval_ms_), [this] {
+                    return stop_ || pending_.load(std::memory_order_relaxed);
+                });
+            }
+            wait_lk.unlock();
+            env->DeleteLocalRef(runtime);
+            vm_->DetachCurrentThread();
+        }
+
+    public:
+        GcSlot ring[kRingSize];
+        // number of finished pauses, the next slot is ring[finished % kRingSize]
+        std::atomic<uint64_t> finished{0};
+        std::atomic<uint64_t> start_ns{0};
+        std::atomic<int64_t> last_used{-1};
+        LatencyHistogram pauses;
+
+        GcMonitor(jvmtiEnv *ti, JavaVM *vm, uint64_t interval_ms) : ti_(ti), vm_(vm), interval_ms_(interval_ms) {
+            thread_ = std::thread([this] { Run(); });
+        }
+
+        ~GcMonitor() {
+            Stop();
+            ti_->DisposeEnvironment();
+        }
+
+        jvmtiEnv *ti() const { return ti_; }
+
+        // from the GC callback: no locks, no allocation
+        void Finish(uint64_t end) {
+            // 0 if the pause started before the events were enabled, its length is unknown
+            auto start = start_ns.exchange(0, std::memory_order_relaxed);
+            if (!start) return;
+            auto index = finished.load(std::memory_order_relaxed);
+            auto &slot = ring[index % kRingSize];
+            slot.start_ns.store(start, std::memory_order_relaxed);
+            slot.end_ns.store(end, std::memory_order_relaxed);
+            slot.used_before.store(last_used.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            slot.used_after.store(-1, std::memory_order_relaxed);
+            finished.store(index + 1, std::memory_order_release);
+            pauses.Record(end - start);
+            pending_.store(true, std::memory_order_release);
+            // pthread_cond_signal does not allocate, the sampler also wakes up on its own
+            wake_.notify_one();
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lk(wait_lock_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            if (thread_.joinable()) thread_.join();
+        }
+    };
+
+    std::mutex g_gc_mutex;
+    std::atomic<GcMonitor *> g_gc_monitor{nullptr};
+    // the last monitor is kept after stopping so its timeline can still be read
+    GcMonitor *g_gc_last = nullptr;
+
+    void JNICALL OnGcStart(jvmtiEnv *) {
+        if (auto monitor = g_gc_monitor.load(std::memory_order_acquire)) monitor->start_ns.store(NowNanos(), std::memory_order_relaxed);
+    }
+
+    void JNICALL OnGcFinish(jvmtiEnv *) {
+        if (auto monitor = g_gc_monitor.load(std::memory_order_acquire)) monitor->Finish(NowNanos());
+    }
+
+    struct GcEvent {
+        uint64_t start_ns;
+        uint64_t end_ns;
+        int64_t used_before;
+        int64_t used_after;
+    };
+
+    // the pauses still in the ring which ended after since_ns, oldest first
+    std::vector<GcEvent> Timeline(GcMonitor *monitor, uint64_t since_ns) {
+        auto end = monitor->finished.load(std::memory_order_acquire);
+        auto begin = end > kRingSize ? end - kRingSize : 0;
+        std::vector<GcEvent> events;
+        for (auto i = begin; i < end; i++) {
+            auto &slot = monitor->ring[i % kRingSize];
+            events.push_back({slot.start_ns.load(std::memory_order_relaxed), slot.end_ns.load(std::memory_order_relaxed),
+                              slot.used_before.load(std::memory_order_relaxed), slot.used_after.load(std::memory_order_relaxed)});
+        }
+        // slots overwritten while copying belong to newer pauses
+        auto now = monitor->finished.load(std::memory_order_acquire);
+        size_t first = now > begin + kRingSize ? std::min<size_t>(now - (begin + kRingSize), events.size()) : 0;
+        while (first < events.size() && events[first].end_ns <= since_ns) first++;
+        events.erase(events.begin(), events.begin() + first);
+        return events;
+    }
+
+    GcMonitor *CurrentMonitor(JNIEnv *env) {
+        if (!g_gc_last) env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "gc monitor was never started");
+        return g_gc_last;
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStartGcMonitor(JNIEnv *env, jclass, jlong sampleIntervalMs) {
+    std::lock_guard<std::mutex> lk(g_gc_mutex);
+    if (g_gc_monitor.load()) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "gc monitor is running");
+        return;
+    }
+    jvmtiCapabilities cap{};
+    cap.can_generate_garbage_collection_events = true;
+    auto ti = NewEnv(env, cap);
+    if (!ti) return;
+    JavaVM *vm;
+    env->GetJavaVM(&vm);
+    delete g_gc_last;
+    g_gc_last = new GcMonitor(ti, vm, sampleIntervalMs > 0 ? sampleIntervalMs : 100);
+    g_gc_monitor.store(g_gc_last, std::memory_order_release);
+
+    jvmtiEventCallbacks callbacks{};
+    callbacks.GarbageCollectionStart = OnGcStart;
+    callbacks.GarbageCollectionFinish = OnGcFinish;
+    auto r = ti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, nullptr);
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, nullptr);
+    if (r) {
+        g_gc_monitor.store(nullptr);
+        delete g_gc_last;
+        g_gc_last = nullptr;
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("enable gc events: " + to_string(r)).c_str());
+        return;
+    }
+    LOGD("gc monitor started");
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStopGcMonitor(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_gc_mutex);
+    auto monitor = g_gc_monitor.exchange(nullptr);
+    if (!monitor) return;
+    monitor->ti()->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, nullptr);
+    monitor->ti()->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, nullptr);
+    monitor->Stop();
+    LOGD("gc monitor stopped, %llu pauses", static_cast<unsigned long long>(monitor->finished.load()));
+}
+
+// Pauses which ended after sinceNanos (System.nanoTime), packed as
+// (start, end, used before, used after) quadruples, -1 for an unknown occupancy.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeGcTimeline(JNIEnv *env, jclass, jlong sinceNanos) {
+    std::lock_guard<std::mutex> lk(g_gc_mutex);
+    auto monitor = CurrentMonitor(env);
+    if (!monitor) return nullptr;
+    auto events = Timeline(monitor, static_cast<uint64_t>(sinceNanos));
+    std::vector<jlong> packed;
+    packed.reserve(events.size() * 4);
+    for (auto &event: events) {
+        packed.push_back(static_cast<jlong>(event.start_ns));
+        packed.push_back(static_cast<jlong>(event.end_ns));
+        packed.push_back(event.used_before);
+        packed.push_back(event.used_after);
+    }
+    auto arr = env->NewLongArray(static_cast<jsize>(packed.size()));
+    env->SetLongArrayRegion(arr, 0, static_cast<jsize>(packed.size()), packed.data());
+    return arr;
+}
+
+// Pause percentiles of the whole run and the last pauses with the heap occupancy around them.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeGcReport(JNIEnv *env, jclass, jint last) {
+    std::lock_guard<std::mutex> lk(g_gc_mutex);
+    auto monitor = CurrentMonitor(env);
+    if (!monitor) return nullptr;
+    auto &h = monitor->pauses;
+    auto report = Format("%llu gc pauses, total %s p50=%s p90=%s p99=%s p99.9=%s max=%s",
+                         static_cast<unsigned long long>(h.Count()), FormatNanos(h.Sum()).c_str(),
+                         FormatNanos(h.Percentile(50)).c_str(), FormatNanos(h.Percentile(90)).c_str(),
+                         FormatNanos(h.Percentile(99)).c_str(), FormatNanos(h.Percentile(99.9)).c_str(),
+                         FormatNanos(h.Max()).c_str());
+    auto events = Timeline(monitor, 0);
+    size_t limit = last > 0 ? last : 20;
+    auto now = NowNanos();
+    auto formatUsed = [](int64_t used) { return used < 0 ? std::string("?") : Format("%.1fM", used / 1048576.0); };
+    for (size_t i = events.size() > limit ? events.size() - limit : 0; i < events.size(); i++) {
+        auto &event = events[i];
+        report += Format("\n  %s ago: pause %s, heap %s -> %s", FormatNanos(now - event.start_ns).c_str(),
+                         FormatNanos(event.end_ns - event.start_ns).c_str(),
+                         formatUsed(event.used_before).c_str(), formatUsed(event.used_after).c_str());
+    }
+    return env->NewStringUTF(report.c_str());
+}
@@ -0,0 +1,238 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Duplicate values: one IterateThroughHeap with only the string and primitive array value
+// callbacks hashes every payload (64-bit, 8 bytes per round) into an open addressing table
+// keyed by (hash, kind, length). Everything is bounded: the table starts small and doubles
+// at 70% load up to 2^20 entries (32 MB), then stops taking new values (later distinct
+// values are only counted as untracked), and the previews of duplicated values are copied
+// into an arena of at most 4 MB on their second occurrence only.
+namespace {
+    constexpr size_t kInitialTableSize = size_t{1} << 14;
+    constexpr size_t kMaxTableSize = size_t{1} << 20;
+    constexpr size_t kArenaSize = 4 << 20;
+    constexpr size_t kPreviewBytes = 96;
+
+    // 0 is a String, otherwise the jvmtiPrimitiveType of the array
+    constexpr uint8_t kString = 0;
+
+    inline uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    uint64_t HashPayload(const uint8_t *p, size_t n, uint64_t seed) {
+        constexpr uint64_t k1 = 0x9e3779b97f4a7c15ull;
+        constexpr uint64_t k2 = 0xc2b2ae3d27d4eb4full;
+        auto h = seed ^ (n * k1);
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            h = Rotl(h ^ (v * k2), 31) * k1;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, p, n);
+        h = Rotl(h ^ (tail * k2), 31) * k1;
+        // splitmix64 finalizer
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    struct Entry {
+        uint64_t hash;
+        // object size reported by the heap iteration
+        uint64_t size;
+        uint32_t count;
+        uint32_t length;
+        // offset + 1 of the preview in the arena, 0 without one
+        uint32_t preview;
+        uint16_t preview_length;
+        uint8_t kind;
+    };
+
+    struct DuplicateData {
+        std::vector<Entry> table = std::vector<Entry>(kInitialTableSize);
+        std::vector<uint8_t> arena;
+        size_t entries = 0;
+        uint64_t objects[2]{};
+        uint64_t bytes[2]{};
+        uint64_t untracked = 0;
+
+        void Grow() {
+            std::vector<Entry> old(table.size() * 2);
+            old.swap(table);
+            auto mask = table.size() - 1;
+            for (auto &e: old) {
+                if (e.hash == 0) continue;
+                auto i = e.hash & mask;
+                while (table[i].hash != 0) i = (i + 1) & mask;
+                table[i] = e;
+            }
+        }
+
+        void Add(uint8_t kind, jlong size, const void *payload, size_t length) {
+            auto is_array = kind != kString;
+            objects[is_array]++;
+            bytes[is_array] += size;
+            auto data = static_cast<const uint8_t *>(payload);
+            auto hash = HashPayload(data, length, kind);
+            if (hash == 0) hash = 1;
+            auto &e = Find(hash, kind, length);
+            if (e.hash == hash) {
+                if (e.count++ == 1 && arena.size() + kPreviewBytes <= kArenaSize) {
+                    auto n = std::min(length, kPreviewBytes);
+                    e.preview = static_cast<uint32_t>(arena.size() + 1);
+                    e.preview_length = static_cast<uint16_t>(n);
+                    arena.insert(arena.end(), data, data + n);
+                }
+                return;
+            }
+            if (entries >= table.size() / 10 * 7) {
+                if (table.size() == kMaxTableSize) {
+                    untracked++;
+                    return;
+                }
+                Grow();
+            }
+            entries++;
+            Find(hash, kind, length) = Entry{hash, static_cast<uint64_t>(size), 1, static_cast<uint32_t>(length), 0, 0, kind};
+        }
+
+        // the entry of the value, or the free slot for it
+        Entry &Find(uint64_t hash, uint8_t kind, size_t length) {
+            auto mask = table.size() - 1;
+            for (auto i = hash & mask;; i = (i + 1) & mask) {
+                auto &e = table[i];
+                if (e.hash == 0 || (e.hash == hash && e.kind == kind && e.length == length)) return e;
+            }
+        }
+    };
+
+    jint JNICALL OnString(jlong, jlong size, jlong *, const jchar *value, jint length, void *user_data) {
+        static_cast<DuplicateData *>(user_data)->Add(kString, size, value, length * sizeof(jchar));
+        return JVMTI_VISIT_OBJECTS;
+    }
+
+    size_t ElementSize(jvmtiPrimitiveType type) {
+        switch (type) {
+            case JVMTI_PRIMITIVE_TYPE_BOOLEAN:
+            case JVMTI_PRIMITIVE_TYPE_BYTE: return 1;
+            case JVMTI_PRIMITIVE_TYPE_CHAR:
+            case JVMTI_PRIMITIVE_TYPE_SHORT: return 2;
+            case JVMTI_PRIMITIVE_TYPE_INT:
+            case JVMTI_PRIMITIVE_TYPE_FLOAT: return 4;
+            default: return 8;
+        }
+    }
+
+    jint JNICALL OnArray(jlong, jlong size, jlong *, jint count, jvmtiPrimitiveType type, const void *elements, void *user_data) {
+        static_cast<DuplicateData *>(user_data)->Add(static_cast<uint8_t>(type), size, elements, count * ElementSize(type));
+        return JVMTI_VISIT_OBJECTS;
+    }
+
+    const char *KindName(uint8_t kind) {
+        switch (kind) {
+            case kString: return "String";
+            case JVMTI_PRIMITIVE_TYPE_BOOLEAN: return "boolean[]";
+            case JVMTI_PRIMITIVE_TYPE_BYTE: return "byte[]";
+            case JVMTI_PRIMITIVE_TYPE_CHAR: return "char[]";
+            case JVMTI_PRIMITIVE_TYPE_SHORT: return "short[]";
+            case JVMTI_PRIMITIVE_TYPE_INT: return "int[]";
+            case JVMTI_PRIMITIVE_TYPE_LONG: return "long[]";
+            case JVMTI_PRIMITIVE_TYPE_FLOAT: return "float[]";
+            case JVMTI_PRIMITIVE_TYPE_DOUBLE: return "double[]";
+            default: return "?";
+        }
+    }
+
+    // printable ASCII as is, other characters escaped; Strings and char[] are UTF-16
+    std::string Preview(const Entry &e, const std::vector<uint8_t> &arena) {
+        if (!e.preview) return "";
+        auto data = arena.data() + e.preview - 1;
+        bool wide = e.kind == kString || e.kind == JVMTI_PRIMITIVE_TYPE_CHAR;
+        if (!wide && e.kind != JVMTI_PRIMITIVE_TYPE_BYTE) {
+            std::string hex;
+            for (size_t i = 0; i < e.preview_length && i < 32; i++) hex += Format("%02x", data[i]);
+            return hex;
+        }
+        std::string out = "\"";
+        size_t step = wide ? 2 : 1;
+        for (size_t i = 0; i + step <= e.preview_length; i += step) {
+            uint32_t c = wide ? data[i] | (data[i + 1] << 8) : data[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            } else if (c >= 0x20 && c < 0x7f) {
+                out += static_cast<char>(c);
+            } else {
+                out += wide ? Format("\\u%04x", c) : Format("\\x%02x", c);
+            }
+        }
+        out += '"';
+        if (e.preview_length < e.length) out += "...";
+        return out;
+    }
+}
+
+// Bytes wasted by duplicated Strings and primitive arrays (every copy but one) and the top
+// duplicated values by wasted bytes.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDuplicateReport(JNIEnv *env, jclass, jint top) {
+    ScopedTagEnv ti{env};
+    if (!ti) return nullptr;
+    auto data = std::make_unique<DuplicateData>();
+    jvmtiHeapCallbacks callbacks{};
+    callbacks.string_primitive_value_callback = OnString;
+    callbacks.array_primitive_value_callback = OnArray;
+    auto start = NowNanos();
+    auto r = ti->IterateThroughHeap(0, nullptr, &callbacks, data.get());
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    auto elapsed = NowNanos() - start;
+
+    uint64_t wasted[2]{}, duplicated[2]{};
+    std::vector<const Entry *> rows;
+    for (auto &e: data->table) {
+        if (e.count < 2) continue;
+        auto is_array = e.kind != kString;
+        wasted[is_array] += (e.count - 1) * e.size;
+        duplicated[is_array] += e.count - 1;
+        rows.push_back(&e);
+    }
+    size_t limit = top > 0 ? top : 20;
+    auto by_waste = [](const Entry *a, const Entry *b) { return (a->count - 1) * a->size > (b->count - 1) * b->size; };
+    if (rows.size() > limit) {
+        std::partial_sort(rows.begin(), rows.begin() + limit, rows.end(), by_waste);
+        rows.resize(limit);
+    } else {
+        std::sort(rows.begin(), rows.end(), by_waste);
+    }
+
+    auto report = Format("strings: %llu objects, %llu bytes, %llu duplicates wasting %llu bytes\n"
+                         "arrays: %llu objects, %llu bytes, %llu duplicates wasting %llu bytes\n"
+                         "%zu distinct values, %llu untracked, scanned in %s\n"
+                         "    count  each bytes  wasted bytes  value",
+                         static_cast<unsigned long long>(data->objects[0]), static_cast<unsigned long long>(data->bytes[0]),
+                         static_cast<unsigned long long>(duplicated[0]), static_cast<unsigned long long>(wasted[0]),
+                         static_cast<unsigned long long>(data->objects[1]), static_cast<unsigned long long>(data->bytes[1]),
+                         static_cast<unsigned long long>(duplicated[1]), static_cast<unsigned long long>(wasted[1]),
+                         data->entries, static_cast<unsigned long long>(data->untracked), FormatNanos(elapsed).c_str());
+    for (auto e: rows) {
+        report += Format("\n%9u %11llu %13llu  %s(%u) ", e->count, static_cast<unsigned long long>(e->size),
+                         static_cast<unsigned long long>((e->count - 1) * e->size), KindName(e->kind),
+                         e->kind == kString ? e->length / 2 : e->length / static_cast<uint32_t>(ElementSize(static_cast<jvmtiPrimitiveType>(e->kind))));
+        report += Preview(*e, data->arena);
+    }
+    return env->NewStringUTF(report.c_str());
+}
@@ -0,0 +1,175 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+// Heap generations for leak hunting: MarkGeneration tags every untagged object with the next
+// generation id in one IterateThroughHeap pass (already tagged objects keep the generation
+// they were first seen in), so a later pass can tell which live objects are newer than a
+// generation. The tags live in a private environment kept until the generations are reset.
+// Tag layout: the generation in the low 16 bits, loaded classes additionally carry their
+// index in bits 16..39 (refreshed for every diff), kPicked marks objects being collected.
+namespace {
+    constexpr jlong kGenerationMask = 0xffff;
+    constexpr int kClassShift = 16;
+    constexpr jlong kPicked = 1LL << 40;
+
+    std::mutex g_generation_mutex;
+    jvmtiEnv *g_generation_env = nullptr;
+    jint g_generation = 0;
+
+    struct DiffState {
+        jint since;
+        jint next;
+        // rows indexed by class index, row 0 for classes loaded during the pass
+        std::vector<HistogramRow> rows;
+        // class indices whose newer instances are collected, empty for none
+        std::vector<bool> pick;
+        jlong picked = 0;
+        jlong max_picked = 0;
+    };
+
+    // Tags loaded classes with their index, keeping their generation. Returns the classes,
+    // which the caller releases with ReleaseClasses.
+    jvmtiError TagClasses(jvmtiEnv *ti, jint next, jint *count, jclass **classes) {
+        auto r = ti->GetLoadedClasses(count, classes);
+        if (r) return r;
+        for (jint i = 0; i < *count && !r; i++) {
+            jlong tag = 0;
+            ti->GetTag((*classes)[i], &tag);
+            auto generation = tag & kGenerationMask;
+            r = ti->SetTag((*classes)[i], static_cast<jlong>(i + 1) << kClassShift | (generation ? generation : next));
+        }
+        return r;
+    }
+
+    void ReleaseClasses(JNIEnv *env, jvmtiEnv *ti, jint count, jclass *classes) {
+        for (jint i = 0; i < count; i++) env->DeleteLocalRef(classes[i]);
+        ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+    }
+
+    // Objects allocated after the last mark are untagged, they belong to the next generation.
+    jint JNICALL OnDiffObject(jlong class_tag, jlong size, jlong *tag_ptr, jint, void *user_data) {
+        auto state = reinterpret_cast<DiffState *>(user_data);
+        if (*tag_ptr == 0) *tag_ptr = state->next;
+        if ((*tag_ptr & kGenerationMask) <= state->since) return JVMTI_VISIT_OBJECTS;
+        auto index = static_cast<size_t>(class_tag >> kClassShift);
+        if (index >= state->rows.size()) index = 0;
+        auto &row = state->rows[index];
+        row.count++;
+        row.bytes += size;
+        if (index < state->pick.size() && state->pick[index] && !(*tag_ptr >> kClassShift)
+            && state->picked < state->max_picked) {
+            *tag_ptr |= kPicked;
+            state->picked++;
+        }
+        return JVMTI_VISIT_OBJECTS;
+    }
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeMarkGeneration(JNIEnv *env, jclass) {
+    std::lock_guard<std::mutex> lk(g_generation_mutex);
+    if (g_generation == kGenerationMask) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "too many generations, reset them first");
+        return 0;
+    }
+    if (!g_generation_env) {
+        g_generation_env = NewTagEnv(env);
+        if (!g_generation_env) return 0;
+    }
+    auto generation = g_generation + 1;
+    auto start = NowNanos();
+    jvmtiHeapCallbacks callbacks{};
+    callbacks.heap_iteration_callback = [](jlong, jlong, jlong *tag_ptr, jint, void *user_data) -> jint {
+        *tag_ptr = *reinterpret_cast<jint *>(user_data);
+        return JVMTI_VISIT_OBJECTS;
+    };
+    auto r = g_generation_env->IterateThroughHeap(JVMTI_HEAP_FILTER_TAGGED, nullptr, &callbacks, &generation);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return 0;
+    }
+    g_generation = generation;
+    LOGD("marked generation %d in %llu ms", generation, static_cast<unsigned long long>((NowNanos() - start) / 1000000));
+    return generation;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeResetGenerations(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_generation_mutex);
+    if (g_generation_env) g_generation_env->DisposeEnvironment();
+    g_generation_env = nullptr;
+    g_generation = 0;
+}
+
+// Histogram of the live objects newer than generation since. With clazz, also returns up to
+// max of its newer instances (of subclasses too if child) in the Object[] out parameter.
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeGenerationDiff(JNIEnv *env, jclass, jint since, jclass clazz,
+                                                               jboolean child, jint max, jobjectArray out) {
+    std::lock_guard<std::mutex> lk(g_generation_mutex);
+    if (!g_generation_env) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "no generation marked");
+        return nullptr;
+    }
+    auto ti = g_generation_env;
+    DiffState state{since, g_generation + 1};
+    jint class_count;
+    jclass *classes;
+    auto r = TagClasses(ti, state.next, &class_count, &classes);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetLoadedClasses: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    state.rows.resize(class_count + 1);
+    if (clazz && max > 0) {
+        state.pick.resize(class_count + 1);
+        for (jint i = 0; i < class_count; i++) {
+            state.pick[i + 1] = child ? env->IsAssignableFrom(classes[i], clazz) : env->IsSameObject(classes[i], clazz);
+        }
+        state.max_picked = max;
+    }
+
+    auto start = NowNanos();
+    jvmtiHeapCallbacks callbacks{};
+    callbacks.heap_iteration_callback = OnDiffObject;
+    r = ti->IterateThroughHeap(0, nullptr, &callbacks, &state);
+    if (r) {
+        ReleaseClasses(env, ti, class_count, classes);
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    LOGD("generation diff since %d: %llu ms", since, static_cast<unsigned long long>((NowNanos() - start) / 1000000));
+
+    if (state.picked) {
+        std::vector<jlong> tags;
+        for (auto g = std::max(since + 1, 1); g <= state.next; g++) tags.push_back(kPicked | g);
+        jint count;
+        jobject *objects;
+        jlong *object_tags;
+        r = ti->GetObjectsWithTags(static_cast<jint>(tags.size()), tags.data(), &count, &objects, &object_tags);
+        if (!r) {
+            auto arr = env->NewObjectArray(count, env->FindClass("java/lang/Object"), nullptr);
+            for (jint i = 0; i < count; i++) {
+                ti->SetTag(objects[i], object_tags[i] & ~kPicked);
+                env->SetObjectArrayElement(arr, i, objects[i]);
+                env->DeleteLocalRef(objects[i]);
+            }
+            ti->Deallocate(reinterpret_cast<unsigned char *>(objects));
+            ti->Deallocate(reinterpret_cast<unsigned char *>(object_tags));
+            env->SetObjectArrayElement(out, 0, arr);
+        }
+    }
+
+    auto histogram = NewClassHistogram(env, ti, classes, state.rows);
+    ReleaseClasses(env, ti, class_count, classes);
+    return histogram;
+}
@@ -0,0 +1,166 @@
+#include "heap_graph.hpp"
+
+#include "logging.h"
+
+jvmtiError HeapGraph::Prepare(JNIEnv *env, jvmtiEnv *ti) {
+    jint class_count;
+    jclass *classes;
+    auto r = ti->GetLoadedClasses(&class_count, &classes);
+    if (r) return r;
+    nodes.resize(class_count + 1);
+    for (jint i = 0; i < class_count; i++) {
+        if (!r) r = ti->SetTag(classes[i], i + 1);
+        env->DeleteLocalRef(classes[i]);
+    }
+    ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+    class_count_ = static_cast<uint32_t>(class_count);
+    return r;
+}
+
+uint32_t HeapGraph::Tag(jvmtiEnv *ti, jobject obj) {
+    jlong tag = 0;
+    ti->GetTag(obj, &tag);
+    if (tag) return static_cast<uint32_t>(tag);
+    auto id = NewNode();
+    ti->SetTag(obj, id);
+    return id;
+}
+
+jint JNICALL HeapGraph::OnReference(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo *info, jlong class_tag,
+                                    jlong, jlong size, jlong *tag_ptr, jlong *referrer_tag_ptr, jint, void *user_data) {
+    auto graph = reinterpret_cast<HeapGraph *>(user_data);
+    if (*tag_ptr == 0) *tag_ptr = graph->NewNode();
+    auto id = static_cast<uint32_t>(*tag_ptr);
+    auto &node = graph->nodes[id];
+    if (node.size == 0) {
+        node.size = static_cast<uint32_t>(size);
+        node.klass = static_cast<uint32_t>(class_tag);
+    }
+    jint index = 0;
+    if (kind == JVMTI_HEAP_REFERENCE_FIELD || kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD) index = info->field.index;
+    else if (kind == JVMTI_HEAP_REFERENCE_ARRAY_ELEMENT) index = info->array.index;
+    else if (kind == JVMTI_HEAP_REFERENCE_STACK_LOCAL) index = info->stack_local.depth;
+    else if (kind == JVMTI_HEAP_REFERENCE_JNI_LOCAL) index = info->jni_local.depth;
+    if (!referrer_tag_ptr) {
+        graph->roots.push_back(id);
+        graph->root_labels.push_back(Label(kind, index));
+        return JVMTI_VISIT_OBJECTS;
+    }
+    if (*referrer_tag_ptr == 0) *referrer_tag_ptr = graph->NewNode();
+    auto referrer = static_cast<uint32_t>(*referrer_tag_ptr);
+    if (referrer != graph->current_) {
+        graph->current_ = referrer;
+        graph->nodes[referrer].first_edge = static_cast<uint32_t>(graph->edges.size());
+        graph->nodes[referrer].edge_count = 0;
+    }
+    graph->edges.push_back(id);
+    graph->labels.push_back(Label(kind, index));
+    graph->nodes[referrer].edge_count++;
+    return JVMTI_VISIT_OBJECTS;
+}
+
+jvmtiError HeapGraph::Walk(jvmtiEnv *ti, jobject initial_object) {
+    jvmtiHeapCallbacks callbacks{};
+    callbacks.heap_reference_callback = OnReference;
+    current_ = kNone;
+    auto r = ti->FollowReferences(0, nullptr, initial_object, &callbacks, this);
+    LOGD("heap graph: %zu nodes, %zu edges, %zu roots, %zu bytes", nodes.size(), edges.size(), roots.size(), MemoryUsage());
+    return r;
+}
+
+size_t HeapGraph::MemoryUsage() const {
+    return nodes.capacity() * sizeof(Node) + (edges.capacity() + labels.capacity()) * sizeof(uint32_t)
+           + (roots.capacity() + root_labels.capacity()) * sizeof(uint32_t);
+}
+
+jvmtiError HeapGraph::Objects(JNIEnv *env, jvmtiEnv *ti, const std::vector<uint32_t> &ids, std::vector<jobject> &objects) const {
+    objects.assign(ids.size(), nullptr);
+    if (ids.empty()) return JVMTI_ERROR_NONE;
+    std::vector<jlong> tags(ids.begin(), ids.end());
+    jint count;
+    jobject *results;
+    jlong *result_tags;
+    // a single call, ART scans the whole tag table once per call
+    auto r = ti->GetObjectsWithTags(static_cast<jint>(tags.size()), tags.data(), &count, &results, &result_tags);
+    if (r) return r;
+    for (jint i = 0; i < count; i++) {
+        bool used = false;
+        for (size_t j = 0; j < ids.size(); j++) {
+            if (ids[j] == static_cast<uint32_t>(result_tags[i]) && !objects[j]) {
+                objects[j] = used ? env->NewLocalRef(results[i]) : results[i];
+                used = true;
+            }
+        }
+        if (!used) env->DeleteLocalRef(results[i]);
+    }
+    ti->Deallocate(reinterpret_cast<unsigned char *>(results));
+    ti->Deallocate(reinterpret_cast<unsigned char *>(result_tags));
+    return JVMTI_ERROR_NONE;
+}
+
+static jint CountStaticFields(JNIEnv *env, jvmtiEnv *ti, jclass klass) {
+    jint count = 0, field_count;
+    jfieldID *fields;
+    if (ti->GetClassFields(klass, &field_count, &fields)) return 0;
+    for (jint i = 0; i < field_count; i++) {
+        jint modifiers = 0;
+        ti->GetFieldModifiers(klass, fields[i], &modifiers);
+        if (modifiers & 0x8 /* ACC_STATIC */) count++;
+    }
+    ti->Deallocate(reinterpret_cast<unsigned char *>(fields));
+    return count;
+}
+
+static void CountInterfaceStatics(JNIEnv *env, jvmtiEnv *ti, jclass klass, std::vector<jclass> &visited, jint &count) {
+    jint interface_count;
+    jclass *interfaces;
+    if (ti->GetImplementedInterfaces(klass, &interface_count, &interfaces)) return;
+    for (jint i = 0; i < interface_count; i++) {
+        bool seen = false;
+        for (auto v: visited) {
+            if (env->IsSameObject(v, interfaces[i])) {
+                seen = true;
+                break;
+            }
+        }
+        if (seen) {
+            env->DeleteLocalRef(interfaces[i]);
+            continue;
+        }
+        visited.push_back(interfaces[i]);
+        count += CountStaticFields(env, ti, interfaces[i]);
+        CountInterfaceStatics(env, ti, interfaces[i], visited, count);
+    }
+    ti->Deallocate(reinterpret_cast<unsigned char *>(interfaces));
+}
+
+bool ResolveFieldIndex(JNIEnv *env, jvmtiEnv *ti, jclass klass, jint index, jclass *declaring, jfieldID *field) {
+    // from java.lang.Object down to klass, interfaces have no superclass in JNI and ART does
+    // not count java.lang.Object for them either
+    std::vector<jclass> chain{reinterpret_cast<jclass>(env->NewLocalRef(klass))};
+    while (auto super = env->GetSuperclass(chain.back())) chain.push_back(super);
+    std::vector<jclass> visited;
+    jint interface_statics = 0;
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+        CountInterfaceStatics(env, ti, *it, visited, interface_statics);
+    }
+    for (auto v: visited) env->DeleteLocalRef(v);
+
+    bool found = false;
+    index -= interface_statics;
+    for (auto it = chain.rbegin(); it != chain.rend() && !found && index >= 0; it++) {
+        jint field_count;
+        jfieldID *fields;
+        if (ti->GetClassFields(*it, &field_count, &fields)) break;
+        // static fields come first, in the same order ART numbers them
+        if (index < field_count) {
+            *declaring = reinterpret_cast<jclass>(env->NewLocalRef(*it));
+            *field = fields[index];
+            found = true;
+        }
+        index -= field_count;
+        ti->Deallocate(reinterpret_cast<unsigned char *>(fields));
+    }
+    for (auto c: chain) env->DeleteLocalRef(c);
+    return found;
+}
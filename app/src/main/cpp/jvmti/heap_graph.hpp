@@ -0,0 +1,81 @@
+#pragma once
+
+#include "jvmti.h"
+
+#include <cstdint>
+#include <vector>
+
+// The object graph from one FollowReferences pass in compressed sparse row form, kept in
+// native memory. Nodes are numbered by the tags handed out on discovery: loaded classes are
+// 1..ClassCount(), objects follow. Node 0 is a virtual root referencing every GC root.
+// ART reports all references of an object together, so the out edges of a node are
+// appended as one contiguous row while walking.
+class HeapGraph {
+public:
+    static constexpr uint32_t kRoot = 0;
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    struct Node {
+        uint32_t first_edge = 0;
+        uint32_t edge_count = 0;
+        // shallow size in bytes, and node of the class
+        uint32_t size = 0;
+        uint32_t klass = 0;
+    };
+
+    // Edge labels pack the jvmtiHeapReferenceKind and the field or array index.
+    static uint32_t Label(jvmtiHeapReferenceKind kind, jint index) {
+        auto i = static_cast<uint32_t>(index < 0 ? 0 : index);
+        return static_cast<uint32_t>(kind) << 27 | (i < (1u << 27) ? i : (1u << 27) - 1);
+    }
+
+    static jvmtiHeapReferenceKind KindOf(uint32_t label) {
+        return static_cast<jvmtiHeapReferenceKind>(label >> 27);
+    }
+
+    static jint IndexOf(uint32_t label) {
+        return static_cast<jint>(label & ((1u << 27) - 1));
+    }
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> edges;
+    std::vector<uint32_t> labels;
+    // GC roots, the out edges of kRoot
+    std::vector<uint32_t> roots;
+    std::vector<uint32_t> root_labels;
+
+    // Tags every loaded class in ti, which must be a fresh tagging environment.
+    jvmtiError Prepare(JNIEnv *env, jvmtiEnv *ti);
+
+    uint32_t ClassCount() const { return class_count_; }
+
+    // Makes obj a node before the walk so the caller knows its id.
+    uint32_t Tag(jvmtiEnv *ti, jobject obj);
+
+    // Follows references from the GC roots, or only from initial_object if it is not null.
+    jvmtiError Walk(jvmtiEnv *ti, jobject initial_object);
+
+    size_t MemoryUsage() const;
+
+    // Local references to the objects of the given nodes (null for collected ones).
+    jvmtiError Objects(JNIEnv *env, jvmtiEnv *ti, const std::vector<uint32_t> &ids, std::vector<jobject> &objects) const;
+
+private:
+    uint32_t class_count_ = 0;
+    uint32_t current_ = kNone;
+
+    uint32_t NewNode() {
+        nodes.emplace_back();
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    static jint JNICALL OnReference(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo *info, jlong class_tag,
+                                    jlong referrer_class_tag, jlong size, jlong *tag_ptr, jlong *referrer_tag_ptr,
+                                    jint length, void *user_data);
+};
+
+// Resolves the field index of a FIELD or STATIC_FIELD heap reference from an object of klass
+// (or from klass itself for static fields) to the declaring class and the field, following
+// the numbering of ART: static fields of all implemented interfaces, then the fields of every
+// class from java.lang.Object down, static fields of a class before its instance fields.
+bool ResolveFieldIndex(JNIEnv *env, jvmtiEnv *ti, jclass klass, jint index, jclass *declaring, jfieldID *field);
@@ -0,0 +1,89 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <vector>
+#include <algorithm>
+
+jobject NewClassHistogram(JNIEnv *env, jvmtiEnv *ti, jclass *classes, const std::vector<HistogramRow> &rows) {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (rows[i].count) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return rows[a].bytes > rows[b].bytes;
+    });
+
+    auto size = static_cast<jsize>(order.size());
+    auto names = env->NewObjectArray(size, env->FindClass("java/lang/String"), nullptr);
+    std::vector<jlong> counts(size), bytes(size);
+    for (jsize i = 0; i < size; i++) {
+        auto index = order[i];
+        counts[i] = rows[index].count;
+        bytes[i] = rows[index].bytes;
+        std::string name = "<unknown>";
+        char *signature;
+        if (index > 0 && !ti->GetClassSignature(classes[index - 1], &signature, nullptr)) {
+            name = DescriptorToName(signature);
+            ti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+        }
+        auto str = env->NewStringUTF(name.c_str());
+        env->SetObjectArrayElement(names, i, str);
+        env->DeleteLocalRef(str);
+    }
+    LOGD("class histogram: %d classes with instances", size);
+
+    auto countArr = env->NewLongArray(size);
+    env->SetLongArrayRegion(countArr, 0, size, counts.data());
+    auto byteArr = env->NewLongArray(size);
+    env->SetLongArrayRegion(byteArr, 0, size, bytes.data());
+    auto histogramClass = env->FindClass("io/github/a13e300/tools/NativeUtils$ClassHistogram");
+    auto ctor = env->GetMethodID(histogramClass, "<init>", "([Ljava/lang/String;[J[J)V");
+    return env->NewObject(histogramClass, ctor, names, countArr, byteArr);
+}
+
+// Instance count and shallow size per class (like jmap -histo) from one IterateThroughHeap.
+// Every loaded class is tagged with its index in a private environment, so the heap callback
+// only bumps counters in a table indexed by class_tag and never calls back into JNI.
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeClassHistogram(JNIEnv *env, jclass) {
+    ScopedTagEnv ti{env};
+    if (!ti) return nullptr;
+
+    jint class_count;
+    jclass *classes;
+    auto r = ti->GetLoadedClasses(&class_count, &classes);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetLoadedClasses: " + to_string(r)).c_str());
+        return nullptr;
+    }
+
+    // row 0 collects objects of classes loaded after GetLoadedClasses
+    std::vector<HistogramRow> rows(class_count + 1);
+    for (jint i = 0; i < class_count && !r; i++) {
+        r = ti->SetTag(classes[i], i + 1);
+    }
+    if (!r) {
+        jvmtiHeapCallbacks callbacks{};
+        callbacks.heap_iteration_callback = [](jlong class_tag, jlong size, jlong *, jint, void *user_data) -> jint {
+            auto &row = reinterpret_cast<HistogramRow *>(user_data)[class_tag];
+            row.count++;
+            row.bytes += size;
+            return JVMTI_VISIT_OBJECTS;
+        };
+        r = ti->IterateThroughHeap(0, nullptr, &callbacks, rows.data());
+    }
+    if (r) {
+        for (jint i = 0; i < class_count; i++) env->DeleteLocalRef(classes[i]);
+        ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return nullptr;
+    }
+
+    auto histogram = NewClassHistogram(env, ti.get(), classes, rows);
+    for (jint i = 0; i < class_count; i++) env->DeleteLocalRef(classes[i]);
+    ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+    return histogram;
+}
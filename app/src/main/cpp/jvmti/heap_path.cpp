@@ -0,0 +1,190 @@
+#include "stethox_jvmti.hpp"
+#include "heap_graph.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <vector>
+#include <algorithm>
+
+// Shortest reference paths from the GC roots (or from a start object) to a target object or
+// to instances of a target class: the graph is captured by one FollowReferences pass and
+// searched breadth first with a parent table over node ids.
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeFindPaths(JNIEnv *env, jclass, jobject start, jobject target,
+                                                         jclass targetClass, jint maxDepth, jint maxResults) {
+    ScopedTagEnv ti{env};
+    if (!ti) return nullptr;
+    if (!target && !targetClass) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "no target");
+        return nullptr;
+    }
+
+    HeapGraph graph;
+    auto r = graph.Prepare(env, ti.get());
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("Prepare: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    auto start_id = start ? graph.Tag(ti.get(), start) : HeapGraph::kRoot;
+    auto target_id = target ? graph.Tag(ti.get(), target) : HeapGraph::kNone;
+    // classes are nodes 1..ClassCount()
+    std::vector<bool> target_classes;
+    if (targetClass) {
+        target_classes.resize(graph.ClassCount() + 1);
+        jint class_count;
+        jclass *classes;
+        r = ti->GetLoadedClasses(&class_count, &classes);
+        if (r) {
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetLoadedClasses: " + to_string(r)).c_str());
+            return nullptr;
+        }
+        for (jint i = 0; i < class_count; i++) {
+            jlong tag = 0;
+            if (env->IsAssignableFrom(classes[i], targetClass) && !ti->GetTag(classes[i], &tag) && tag > 0 && tag <= graph.ClassCount()) {
+                target_classes[tag] = true;
+            }
+            env->DeleteLocalRef(classes[i]);
+        }
+        ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+    }
+
+    auto begin = NowNanos();
+    r = graph.Walk(ti.get(), start);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("FollowReferences: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    auto walked = NowNanos();
+
+    auto n = graph.nodes.size();
+    std::vector<uint32_t> parent(n, HeapGraph::kNone), parent_label(n, 0), queue;
+    queue.reserve(1024);
+    if (start) {
+        parent[start_id] = start_id;
+        queue.push_back(start_id);
+    } else {
+        for (size_t i = 0; i < graph.roots.size(); i++) {
+            auto id = graph.roots[i];
+            if (parent[id] != HeapGraph::kNone) continue;
+            parent[id] = HeapGraph::kRoot;
+            parent_label[id] = graph.root_labels[i];
+            queue.push_back(id);
+        }
+    }
+    auto is_target = [&](uint32_t id) {
+        if (id == target_id) return true;
+        auto klass = graph.nodes[id].klass;
+        return !target_classes.empty() && klass < target_classes.size() && target_classes[klass];
+    };
+
+    std::vector<uint32_t> hits;
+    if (maxResults <= 0) maxResults = 1;
+    // roots may be targets themselves
+    for (auto id: queue) {
+        if (id != start_id && is_target(id) && hits.size() < static_cast<size_t>(maxResults)) hits.push_back(id);
+    }
+    size_t head = 0, level_end = queue.size();
+    jint depth = 0;
+    while (head < queue.size() && hits.size() < static_cast<size_t>(maxResults)) {
+        if (head == level_end) {
+            if (maxDepth > 0 && ++depth >= maxDepth) break;
+            level_end = queue.size();
+        }
+        auto id = queue[head++];
+        auto &node = graph.nodes[id];
+        for (uint32_t e = node.first_edge; e < node.first_edge + node.edge_count; e++) {
+            auto to = graph.edges[e];
+            if (parent[to] != HeapGraph::kNone) continue;
+            parent[to] = id;
+            parent_label[to] = graph.labels[e];
+            if (is_target(to)) {
+                hits.push_back(to);
+                if (hits.size() >= static_cast<size_t>(maxResults)) break;
+            }
+            queue.push_back(to);
+        }
+    }
+    LOGD("find paths: walk %llu ms, search %llu ms, %zu hits",
+         static_cast<unsigned long long>((walked - begin) / 1000000),
+         static_cast<unsigned long long>((NowNanos() - walked) / 1000000), hits.size());
+
+    // paths from the root (or start) to every hit
+    std::vector<std::vector<uint32_t>> paths;
+    std::vector<uint32_t> ids;
+    for (auto hit: hits) {
+        std::vector<uint32_t> path;
+        for (auto id = hit;; id = parent[id]) {
+            path.push_back(id);
+            if (id == start_id || parent[id] == HeapGraph::kRoot) break;
+        }
+        std::reverse(path.begin(), path.end());
+        ids.insert(ids.end(), path.begin(), path.end());
+        paths.push_back(std::move(path));
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    std::vector<jobject> objects;
+    r = graph.Objects(env, ti.get(), ids, objects);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetObjectsWithTags: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    auto object_of = [&](uint32_t id) {
+        return objects[std::lower_bound(ids.begin(), ids.end(), id) - ids.begin()];
+    };
+
+    auto path_class = env->FindClass("io/github/a13e300/tools/NativeUtils$HeapPath");
+    auto ctor = env->GetMethodID(path_class, "<init>", "([Ljava/lang/Object;[I[I[Ljava/lang/reflect/Field;)V");
+    auto object_class = env->FindClass("java/lang/Object");
+    auto field_class = env->FindClass("java/lang/reflect/Field");
+    auto result = env->NewObjectArray(static_cast<jsize>(paths.size()), path_class, nullptr);
+    for (size_t p = 0; p < paths.size(); p++) {
+        auto &path = paths[p];
+        auto size = static_cast<jsize>(path.size());
+        auto objs = env->NewObjectArray(size, object_class, nullptr);
+        auto fields = env->NewObjectArray(size, field_class, nullptr);
+        std::vector<jint> kinds(size), indices(size);
+        for (jsize i = 0; i < size; i++) {
+            auto id = path[i];
+            auto obj = object_of(id);
+            env->SetObjectArrayElement(objs, i, obj);
+            // the first element has the root kind, or 0 for the start object
+            if (id == start_id && start) continue;
+            auto label = parent_label[id];
+            kinds[i] = HeapGraph::KindOf(label);
+            indices[i] = HeapGraph::IndexOf(label);
+            auto referrer = i > 0 ? object_of(path[i - 1]) : nullptr;
+            auto kind = HeapGraph::KindOf(label);
+            if (referrer && (kind == JVMTI_HEAP_REFERENCE_FIELD || kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD)) {
+                bool is_static = kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD;
+                auto klass = is_static ? reinterpret_cast<jclass>(env->NewLocalRef(referrer)) : env->GetObjectClass(referrer);
+                jclass declaring;
+                jfieldID field;
+                if (ResolveFieldIndex(env, ti.get(), klass, indices[i], &declaring, &field)) {
+                    jint modifiers = 0;
+                    ti->GetFieldModifiers(declaring, field, &modifiers);
+                    auto reflected = env->ToReflectedField(declaring, field, (modifiers & 0x8) != 0);
+                    env->SetObjectArrayElement(fields, i, reflected);
+                    env->DeleteLocalRef(reflected);
+                    env->DeleteLocalRef(declaring);
+                }
+                env->DeleteLocalRef(klass);
+            }
+        }
+        auto kindArr = env->NewIntArray(size);
+        env->SetIntArrayRegion(kindArr, 0, size, kinds.data());
+        auto indexArr = env->NewIntArray(size);
+        env->SetIntArrayRegion(indexArr, 0, size, indices.data());
+        auto heap_path = env->NewObject(path_class, ctor, objs, kindArr, indexArr, fields);
+        env->SetObjectArrayElement(result, static_cast<jsize>(p), heap_path);
+        env->DeleteLocalRef(heap_path);
+        env->DeleteLocalRef(objs);
+        env->DeleteLocalRef(fields);
+        env->DeleteLocalRef(kindArr);
+        env->DeleteLocalRef(indexArr);
+    }
+    for (auto o: objects) env->DeleteLocalRef(o);
+    return result;
+}
@@ -0,0 +1,170 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define STETHOX_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define STETHOX_SSE2 1
+#endif
+
+// Heap string search: one IterateThroughHeap with only the primitive value callbacks, so
+// ART hands over the contents of every String, byte[] and char[] without creating a reference.
+// Contents are scanned for each pattern with a SIMD prefilter comparing the first and the
+// last byte of the pattern at 16 positions at once, only candidates are compared in full.
+// Matching objects are tagged for an ObjectCursor.
+namespace {
+    constexpr jint kSearchStrings = 1;
+    constexpr jint kSearchByteArrays = 2;
+    constexpr jint kSearchCharArrays = 4;
+
+    // Bit i set if position i of the block is a candidate (4 bits per byte with NEON).
+#if STETHOX_NEON
+    constexpr int kBitsPerByte = 4;
+
+    inline uint64_t CandidateMask(const uint8_t *a, const uint8_t *b, uint8x16_t first, uint8x16_t last) {
+        auto eq = vandq_u8(vceqq_u8(vld1q_u8(a), first), vceqq_u8(vld1q_u8(b), last));
+        // narrowing shift packs the 16 comparison bytes into 16 nibbles
+        return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+    }
+#elif STETHOX_SSE2
+    constexpr int kBitsPerByte = 1;
+
+    inline uint64_t CandidateMask(const uint8_t *a, const uint8_t *b, __m128i first, __m128i last) {
+        auto eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)), first),
+                                _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)), last));
+        return static_cast<uint32_t>(_mm_movemask_epi8(eq));
+    }
+#endif
+
+    // Whether pattern occurs in data at an offset that is a multiple of step (2 for UTF-16).
+    bool Contains(const uint8_t *data, size_t size, const std::string &pattern, size_t step) {
+        auto n = pattern.size();
+        if (n == 0 || n > size) return false;
+        auto p = reinterpret_cast<const uint8_t *>(pattern.data());
+        auto matches = [&](size_t i) {
+            return i % step == 0 && data[i + n - 1] == p[n - 1] && memcmp(data + i, p, n - 1) == 0;
+        };
+        size_t i = 0;
+#if STETHOX_NEON || STETHOX_SSE2
+#if STETHOX_NEON
+        auto first = vdupq_n_u8(p[0]);
+        auto last = vdupq_n_u8(p[n - 1]);
+#else
+        auto first = _mm_set1_epi8(static_cast<char>(p[0]));
+        auto last = _mm_set1_epi8(static_cast<char>(p[n - 1]));
+#endif
+        for (; i + n - 1 + 16 <= size; i += 16) {
+            auto mask = CandidateMask(data + i, data + i + n - 1, first, last);
+            while (mask) {
+                auto bit = __builtin_ctzll(mask);
+                if (matches(i + bit / kBitsPerByte)) return true;
+                // clears every bit of that byte
+                mask &= ~((kBitsPerByte == 1 ? 1ull : 0xfull) << bit);
+            }
+        }
+#endif
+        // tail, and the whole search without SIMD
+        while (i + n <= size) {
+            auto hit = static_cast<const uint8_t *>(memchr(data + i, p[0], size - n + 1 - i));
+            if (!hit) return false;
+            i = hit - data;
+            if (matches(i)) return true;
+            i++;
+        }
+        return false;
+    }
+
+    struct SearchData {
+        ObjectCursor *cursor;
+        jint kinds;
+        jlong max;
+        jlong count = 0;
+        // per pattern: modified UTF-8 for byte[], UTF-16 for String and char[]
+        std::vector<std::string> utf8;
+        std::vector<std::string> utf16;
+        uint64_t scanned_bytes = 0;
+
+        bool Match(const void *data, size_t size, bool wide) {
+            scanned_bytes += size;
+            auto bytes = static_cast<const uint8_t *>(data);
+            for (auto &pattern: wide ? utf16 : utf8) {
+                if (Contains(bytes, size, pattern, wide ? 2 : 1)) return true;
+            }
+            return false;
+        }
+
+        jint Tag(jlong *tag_ptr) {
+            if (*tag_ptr == 0) *tag_ptr = cursor->TagForIndex(count++);
+            return max > 0 && count >= max ? JVMTI_VISIT_ABORT : JVMTI_VISIT_OBJECTS;
+        }
+    };
+
+    jint JNICALL OnString(jlong, jlong, jlong *tag_ptr, const jchar *value, jint length, void *user_data) {
+        auto d = static_cast<SearchData *>(user_data);
+        if (!(d->kinds & kSearchStrings) || !d->Match(value, length * sizeof(jchar), true)) return JVMTI_VISIT_OBJECTS;
+        return d->Tag(tag_ptr);
+    }
+
+    jint JNICALL OnArray(jlong, jlong, jlong *tag_ptr, jint count, jvmtiPrimitiveType type, const void *elements, void *user_data) {
+        auto d = static_cast<SearchData *>(user_data);
+        bool match;
+        if (type == JVMTI_PRIMITIVE_TYPE_BYTE) {
+            match = (d->kinds & kSearchByteArrays) && d->Match(elements, count, false);
+        } else if (type == JVMTI_PRIMITIVE_TYPE_CHAR) {
+            match = (d->kinds & kSearchCharArrays) && d->Match(elements, count * sizeof(jchar), true);
+        } else {
+            return JVMTI_VISIT_OBJECTS;
+        }
+        return match ? d->Tag(tag_ptr) : JVMTI_VISIT_OBJECTS;
+    }
+}
+
+// Opens a cursor over the Strings, byte[] (as modified UTF-8) and char[] (selected by kinds)
+// containing any of the patterns, at most max objects if max > 0.
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeSearchHeap(JNIEnv *env, jclass, jobjectArray patterns, jint kinds, jlong max, jint pageSize) {
+    auto pattern_count = patterns ? env->GetArrayLength(patterns) : 0;
+    if (pattern_count == 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "no patterns");
+        return 0;
+    }
+    auto cursor = ObjectCursor::Create(env, pageSize);
+    if (!cursor) return 0;
+
+    SearchData data{cursor, kinds, max};
+    for (jsize i = 0; i < pattern_count; i++) {
+        auto pattern = static_cast<jstring>(env->GetObjectArrayElement(patterns, i));
+        if (!pattern) continue;
+        auto utf8 = env->GetStringUTFChars(pattern, nullptr);
+        data.utf8.emplace_back(utf8);
+        env->ReleaseStringUTFChars(pattern, utf8);
+        auto chars = env->GetStringChars(pattern, nullptr);
+        data.utf16.emplace_back(reinterpret_cast<const char *>(chars), env->GetStringLength(pattern) * sizeof(jchar));
+        env->ReleaseStringChars(pattern, chars);
+        env->DeleteLocalRef(pattern);
+    }
+
+    jvmtiHeapCallbacks callbacks{};
+    callbacks.string_primitive_value_callback = OnString;
+    callbacks.array_primitive_value_callback = OnArray;
+    auto start = NowNanos();
+    auto r = cursor->ti()->IterateThroughHeap(0, nullptr, &callbacks, &data);
+    if (r) {
+        delete cursor;
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return 0;
+    }
+    cursor->Commit(data.count);
+    LOGD("heap search: %lld matches in %llu bytes, %s", static_cast<long long>(data.count),
+         static_cast<unsigned long long>(data.scanned_bytes), FormatNanos(NowNanos() - start).c_str());
+    return cursor->Handle();
+}
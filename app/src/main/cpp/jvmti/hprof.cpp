@@ -0,0 +1,932 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Streaming HPROF (JAVA PROFILE 1.0.2, 4 byte ids) writer on top of FollowReferences.
+//
+// Objects get their HPROF id as JVMTI tag when they are first reported, arrays keep their
+// length in the upper 32 bits of the tag. ART reports all references and primitive values of
+// an object one after another, so only the object being visited is assembled in memory and
+// written out as soon as the next object starts. Records go through a double-buffered sink:
+// a native thread compresses and writes one buffer while the heap walk fills the other.
+// Apart from the tags (one per object), memory use depends on the number of classes and the
+// largest object. FollowReferences runs with all threads suspended, and the walk waits in
+// Swap when the writer falls behind, so the pause grows with the heap and the I/O speed.
+
+namespace {
+
+constexpr uint8_t kTagUtf8 = 0x01;
+constexpr uint8_t kTagLoadClass = 0x02;
+constexpr uint8_t kTagStackTrace = 0x05;
+constexpr uint8_t kTagHeapDumpSegment = 0x1c;
+constexpr uint8_t kTagHeapDumpEnd = 0x2c;
+
+constexpr uint8_t kRootUnknown = 0xff;
+constexpr uint8_t kRootJniGlobal = 0x01;
+constexpr uint8_t kRootJniLocal = 0x02;
+constexpr uint8_t kRootJavaFrame = 0x03;
+constexpr uint8_t kRootStickyClass = 0x05;
+constexpr uint8_t kRootMonitorUsed = 0x07;
+constexpr uint8_t kRootThreadObject = 0x08;
+constexpr uint8_t kClassDump = 0x20;
+constexpr uint8_t kInstanceDump = 0x21;
+constexpr uint8_t kObjectArrayDump = 0x22;
+constexpr uint8_t kPrimitiveArrayDump = 0x23;
+
+constexpr uint8_t kTypeObject = 2;
+// every object refers to this empty stack trace
+constexpr uint32_t kStackTraceSerial = 1;
+
+// hprof basic type of a JVM type descriptor character (also the jvmtiPrimitiveType values)
+uint8_t BasicType(char c) {
+    switch (c) {
+        case 'L': case '[': return kTypeObject;
+        case 'Z': return 4;
+        case 'C': return 5;
+        case 'F': return 6;
+        case 'D': return 7;
+        case 'B': return 8;
+        case 'S': return 9;
+        case 'I': return 10;
+        case 'J': return 11;
+        default: return 0;
+    }
+}
+
+uint32_t SizeOf(uint8_t type) {
+    switch (type) {
+        case 4: case 8: return 1;
+        case 5: case 9: return 2;
+        case 7: case 11: return 8;
+        default: return 4;
+    }
+}
+
+void PutU1(std::vector<uint8_t> &out, uint8_t v) {
+    out.push_back(v);
+}
+
+void PutU2(std::vector<uint8_t> &out, uint16_t v) {
+    uint8_t b[] = {static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v)};
+    out.insert(out.end(), b, b + 2);
+}
+
+void PutU4(std::vector<uint8_t> &out, uint32_t v) {
+    uint8_t b[] = {static_cast<uint8_t>(v >> 24), static_cast<uint8_t>(v >> 16),
+                   static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v)};
+    out.insert(out.end(), b, b + 4);
+}
+
+void PutU8(std::vector<uint8_t> &out, uint64_t v) {
+    PutU4(out, static_cast<uint32_t>(v >> 32));
+    PutU4(out, static_cast<uint32_t>(v));
+}
+
+// big endian value of the given size at p
+void StoreBE(uint8_t *p, uint64_t v, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) p[i] = static_cast<uint8_t>(v >> ((size - 1 - i) * 8));
+}
+
+uint64_t RawValue(jvalue value, uint8_t type) {
+    switch (type) {
+        case 4: return value.z;
+        case 8: return static_cast<uint8_t>(value.b);
+        case 5: return value.c;
+        case 9: return static_cast<uint16_t>(value.s);
+        case 10: return static_cast<uint32_t>(value.i);
+        case 6: {
+            uint32_t bits;
+            memcpy(&bits, &value.f, 4);
+            return bits;
+        }
+        case 7: {
+            uint64_t bits;
+            memcpy(&bits, &value.d, 8);
+            return bits;
+        }
+        default: return static_cast<uint64_t>(value.j);
+    }
+}
+
+// Ljava/lang/String; -> java.lang.String, [[I -> int[][], like the names ART writes
+std::string PrettyDescriptor(const char *descriptor) {
+    int dims = 0;
+    while (descriptor[dims] == '[') dims++;
+    std::string name;
+    switch (descriptor[dims]) {
+        case 'Z': name = "boolean"; break;
+        case 'B': name = "byte"; break;
+        case 'C': name = "char"; break;
+        case 'S': name = "short"; break;
+        case 'I': name = "int"; break;
+        case 'J': name = "long"; break;
+        case 'F': name = "float"; break;
+        case 'D': name = "double"; break;
+        case 'V': name = "void"; break;
+        default: name = DescriptorToName(descriptor + dims);
+    }
+    for (int i = 0; i < dims; i++) name += "[]";
+    return name;
+}
+
+// Double-buffered output split into files of about chunk_size bytes (path, path.1, path.2 ...).
+// With compression every file is a complete gzip member, so the concatenation of all files
+// is a valid gzip stream of the whole dump.
+class HprofSink {
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    std::string path_;
+    bool compress_;
+    uint64_t chunk_size_;
+
+    std::vector<uint8_t> buffers_[2];
+    int active_ = 0;
+    bool pending_ = false;
+    bool closing_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+
+    // owned by the writer thread
+    int fd_ = -1;
+    uint64_t file_bytes_ = 0;
+    z_stream zs_{};
+    std::vector<uint8_t> zout_;
+    std::atomic<bool> failed_{false};
+    std::string error_;
+
+public:
+    std::vector<std::string> files;
+
+    HprofSink(std::string path, bool compress, uint64_t chunk_size)
+            : path_(std::move(path)), compress_(compress), chunk_size_(chunk_size) {}
+
+    ~HprofSink() {
+        Close();
+    }
+
+    bool Open() {
+        if (compress_) {
+            // 15 + 16: gzip wrapper, level 1: the walk should not wait for the compressor
+            if (deflateInit2(&zs_, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                error_ = "deflateInit2 failed";
+                return false;
+            }
+            zout_.resize(kBufferSize);
+        }
+        if (!OpenFile()) return false;
+        buffers_[0].reserve(kBufferSize);
+        buffers_[1].reserve(kBufferSize);
+        thread_ = std::thread([this] { Run(); });
+        return true;
+    }
+
+    bool Failed() const { return failed_.load(std::memory_order_relaxed); }
+
+    const std::string &Error() const { return error_; }
+
+    void Write(const void *data, size_t size) {
+        auto p = static_cast<const uint8_t *>(data);
+        while (size > 0) {
+            auto &buffer = buffers_[active_];
+            auto n = std::min(size, kBufferSize - buffer.size());
+            buffer.insert(buffer.end(), p, p + n);
+            p += n;
+            size -= n;
+            if (buffer.size() == kBufferSize) Swap();
+        }
+    }
+
+    void Write(const std::vector<uint8_t> &data) {
+        Write(data.data(), data.size());
+    }
+
+    // Flushes everything and stops the writer thread, returns false on an I/O error.
+    bool Close() {
+        if (thread_.joinable()) {
+            Swap();
+            {
+                std::unique_lock lk{mutex_};
+                cv_.wait(lk, [this] { return !pending_; });
+                closing_ = true;
+            }
+            cv_.notify_all();
+            thread_.join();
+            FinishFile();
+        }
+        if (compress_) deflateEnd(&zs_);
+        compress_ = false;
+        return !Failed();
+    }
+
+private:
+    void Swap() {
+        std::unique_lock lk{mutex_};
+        cv_.wait(lk, [this] { return !pending_; });
+        pending_ = true;
+        active_ ^= 1;
+        lk.unlock();
+        cv_.notify_all();
+    }
+
+    void Run() {
+        for (;;) {
+            std::unique_lock lk{mutex_};
+            cv_.wait(lk, [this] { return pending_ || closing_; });
+            if (!pending_) return;
+            auto &buffer = buffers_[active_ ^ 1];
+            lk.unlock();
+            if (!Failed()) Output(buffer.data(), buffer.size());
+            buffer.clear();
+            lk.lock();
+            pending_ = false;
+            lk.unlock();
+            cv_.notify_all();
+        }
+    }
+
+    void Fail(const char *what) {
+        if (!Failed()) {
+            error_ = Format("%s %s: %s", what, files.empty() ? path_.c_str() : files.back().c_str(), strerror(errno));
+            failed_.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    bool OpenFile() {
+        auto path = files.empty() ? path_ : path_ + "." + std::to_string(files.size());
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        files.push_back(path);
+        file_bytes_ = 0;
+        if (fd_ < 0) {
+            Fail("open");
+            return false;
+        }
+        return true;
+    }
+
+    void WriteFully(const uint8_t *p, size_t size) {
+        while (size > 0) {
+            auto n = write(fd_, p, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                Fail("write");
+                return;
+            }
+            p += n;
+            size -= n;
+            file_bytes_ += n;
+        }
+    }
+
+    void Deflate(const uint8_t *data, size_t size, int flush) {
+        zs_.next_in = const_cast<uint8_t *>(data);
+        zs_.avail_in = static_cast<uInt>(size);
+        int ret;
+        do {
+            zs_.next_out = zout_.data();
+            zs_.avail_out = static_cast<uInt>(zout_.size());
+            ret = deflate(&zs_, flush);
+            WriteFully(zout_.data(), zout_.size() - zs_.avail_out);
+        } while (zs_.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+
+    void Output(const uint8_t *data, size_t size) {
+        // the next chunk is opened lazily, so there is no empty trailing file
+        if (fd_ < 0 && !OpenFile()) return;
+        if (compress_) Deflate(data, size, Z_NO_FLUSH);
+        else WriteFully(data, size);
+        if (chunk_size_ > 0 && file_bytes_ >= chunk_size_) FinishFile();
+    }
+
+    void FinishFile() {
+        if (fd_ < 0) return;
+        if (compress_) {
+            Deflate(nullptr, 0, Z_FINISH);
+            deflateReset(&zs_);
+        }
+        if (close(fd_) != 0) Fail("close");
+        fd_ = -1;
+    }
+};
+
+struct FieldInfo {
+    uint32_t name;
+    uint8_t type;
+};
+
+struct ClassInfo {
+    uint32_t id = 0;
+    uint32_t super = 0;
+    uint32_t loader = 0;
+    uint32_t name = 0;
+    bool is_interface = false;
+    bool is_string = false;
+    bool is_array = false;
+    bool is_object_array = false;
+    bool dumped = false;
+    std::vector<uint32_t> interfaces;
+    std::vector<FieldInfo> statics;
+    std::vector<FieldInfo> fields;
+
+    // JVMTI field index of the first static field of this class, and of the first instance
+    // field of the whole hierarchy (the number of static fields of all interfaces)
+    uint32_t static_base = 0;
+    uint32_t field_base = 0;
+    // byte offset in the instance dump per (field index - field_base), -1 for static fields
+    std::vector<int32_t> slots;
+    uint32_t instance_size = 0;
+    int32_t string_value_offset = -1;
+    std::vector<uint32_t> static_offsets;
+    uint32_t static_size = 0;
+
+    size_t FieldCount() const { return statics.size() + fields.size(); }
+};
+
+class HeapDumper {
+    static constexpr size_t kSegmentSize = 1 << 20;
+
+    HprofSink &sink_;
+    std::vector<ClassInfo> classes_;
+    std::unordered_map<std::string, uint32_t> strings_;
+    uint32_t class_class_ = 0;
+    uint32_t value_name_ = 0;
+    uint32_t next_id_;
+    std::vector<uint8_t> segment_;
+
+    enum Kind {
+        kNone, kInstance, kObjectArray, kClass
+    };
+    struct {
+        uint32_t id = 0;
+        Kind kind = kNone;
+        ClassInfo *klass = nullptr;
+        int64_t length = -1;
+        std::vector<uint8_t> values;
+    } current_;
+
+public:
+    uint64_t objects = 0;
+
+    HeapDumper(HprofSink &sink, jint class_count) : sink_(sink), next_id_(class_count + 1) {
+        classes_.resize(class_count);
+        segment_.reserve(kSegmentSize);
+    }
+
+    static uint32_t Id(jlong tag) {
+        return static_cast<uint32_t>(tag);
+    }
+
+    jlong NewTag(jint length) {
+        jlong tag = next_id_++;
+        if (length >= 0) tag |= static_cast<jlong>(length + 1) << 32;
+        return tag;
+    }
+
+    ClassInfo *FindClass(jlong class_tag) {
+        auto id = Id(class_tag);
+        return id > 0 && id <= classes_.size() ? &classes_[id - 1] : nullptr;
+    }
+
+    uint32_t Utf8(const std::string &s) {
+        auto [it, inserted] = strings_.try_emplace(s, static_cast<uint32_t>(strings_.size() + 1));
+        if (inserted) {
+            std::vector<uint8_t> record;
+            PutU1(record, kTagUtf8);
+            PutU4(record, 0);
+            PutU4(record, static_cast<uint32_t>(4 + s.size()));
+            PutU4(record, it->second);
+            record.insert(record.end(), s.begin(), s.end());
+            sink_.Write(record);
+        }
+        return it->second;
+    }
+
+    void Header() {
+        std::vector<uint8_t> record;
+        const char magic[] = "JAVA PROFILE 1.0.2";
+        record.insert(record.end(), magic, magic + sizeof(magic));
+        PutU4(record, 4);
+        timespec ts{};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        PutU8(record, static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000);
+        PutU1(record, kTagStackTrace);
+        PutU4(record, 0);
+        PutU4(record, 12);
+        PutU4(record, kStackTraceSerial);
+        PutU4(record, 0);
+        PutU4(record, 0);
+        sink_.Write(record);
+    }
+
+    // Collects names, hierarchy and fields of every loaded class, the classes are tagged
+    // with their index + 1 already. Writes the string and LOAD_CLASS records.
+    void AddClasses(JNIEnv *env, jvmtiEnv *ti, jclass *classes) {
+        for (size_t i = 0; i < classes_.size(); i++) {
+            auto &info = classes_[i];
+            auto klass = classes[i];
+            info.id = static_cast<uint32_t>(i + 1);
+            char *signature;
+            if (!ti->GetClassSignature(klass, &signature, nullptr)) {
+                info.name = Utf8(PrettyDescriptor(signature));
+                info.is_string = strcmp(signature, "Ljava/lang/String;") == 0;
+                if (info.is_string) value_name_ = Utf8("value");
+                if (strcmp(signature, "Ljava/lang/Class;") == 0) class_class_ = info.id;
+                info.is_array = signature[0] == '[';
+                info.is_object_array = info.is_array && (signature[1] == 'L' || signature[1] == '[');
+                ti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+            }
+            jboolean is_interface = JNI_FALSE;
+            ti->IsInterface(klass, &is_interface);
+            info.is_interface = is_interface;
+            if (auto super = env->GetSuperclass(klass); super) {
+                jlong tag = 0;
+                ti->GetTag(super, &tag);
+                info.super = Id(tag);
+                env->DeleteLocalRef(super);
+            }
+            jobject loader = nullptr;
+            if (!ti->GetClassLoader(klass, &loader) && loader) {
+                jlong tag = 0;
+                ti->GetTag(loader, &tag);
+                if (!tag) {
+                    tag = NewTag(-1);
+                    ti->SetTag(loader, tag);
+                }
+                info.loader = Id(tag);
+                env->DeleteLocalRef(loader);
+            }
+            jint interface_count;
+            jclass *interfaces;
+            if (!ti->GetImplementedInterfaces(klass, &interface_count, &interfaces)) {
+                for (jint j = 0; j < interface_count; j++) {
+                    jlong tag = 0;
+                    ti->GetTag(interfaces[j], &tag);
+                    if (tag) info.interfaces.push_back(Id(tag));
+                    env->DeleteLocalRef(interfaces[j]);
+                }
+                ti->Deallocate(reinterpret_cast<unsigned char *>(interfaces));
+            }
+            // static fields come before instance fields, in the order ART numbers them
+            jint field_count;
+            jfieldID *fields;
+            if (!ti->GetClassFields(klass, &field_count, &fields)) {
+                for (jint j = 0; j < field_count; j++) {
+                    char *name, *field_signature;
+                    jint modifiers = 0;
+                    if (ti->GetFieldName(klass, fields[j], &name, &field_signature, nullptr)) continue;
+                    ti->GetFieldModifiers(klass, fields[j], &modifiers);
+                    FieldInfo field{Utf8(name), BasicType(field_signature[0])};
+                    (modifiers & 0x8 /* ACC_STATIC */ ? info.statics : info.fields).push_back(field);
+                    ti->Deallocate(reinterpret_cast<unsigned char *>(name));
+                    ti->Deallocate(reinterpret_cast<unsigned char *>(field_signature));
+                }
+                ti->Deallocate(reinterpret_cast<unsigned char *>(fields));
+            }
+
+            std::vector<uint8_t> record;
+            PutU1(record, kTagLoadClass);
+            PutU4(record, 0);
+            PutU4(record, 16);
+            PutU4(record, info.id);
+            PutU4(record, info.id);
+            PutU4(record, kStackTraceSerial);
+            PutU4(record, info.name);
+            sink_.Write(record);
+        }
+        for (auto &info: classes_) Layout(info);
+    }
+
+    void Root(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo *info, uint32_t id) {
+        switch (kind) {
+            case JVMTI_HEAP_REFERENCE_JNI_GLOBAL:
+                PutU1(segment_, kRootJniGlobal);
+                PutU4(segment_, id);
+                PutU4(segment_, 0);
+                break;
+            case JVMTI_HEAP_REFERENCE_SYSTEM_CLASS:
+                PutU1(segment_, kRootStickyClass);
+                PutU4(segment_, id);
+                break;
+            case JVMTI_HEAP_REFERENCE_MONITOR:
+                PutU1(segment_, kRootMonitorUsed);
+                PutU4(segment_, id);
+                break;
+            case JVMTI_HEAP_REFERENCE_STACK_LOCAL:
+                PutU1(segment_, kRootJavaFrame);
+                PutU4(segment_, id);
+                PutU4(segment_, 0);
+                PutU4(segment_, static_cast<uint32_t>(info->stack_local.depth));
+                break;
+            case JVMTI_HEAP_REFERENCE_JNI_LOCAL:
+                PutU1(segment_, kRootJniLocal);
+                PutU4(segment_, id);
+                PutU4(segment_, 0);
+                PutU4(segment_, static_cast<uint32_t>(info->jni_local.depth));
+                break;
+            case JVMTI_HEAP_REFERENCE_THREAD:
+                PutU1(segment_, kRootThreadObject);
+                PutU4(segment_, id);
+                PutU4(segment_, 0);
+                PutU4(segment_, kStackTraceSerial);
+                break;
+            default:
+                PutU1(segment_, kRootUnknown);
+                PutU4(segment_, id);
+        }
+        MaybeFlushSegment();
+    }
+
+    // Makes the object with this tag the one being assembled.
+    void Enter(jlong tag, jlong class_tag) {
+        auto id = Id(tag);
+        if (id == current_.id) return;
+        Leave();
+        objects++;
+        current_.id = id;
+        current_.kind = kNone;
+        current_.length = tag >> 32 ? (tag >> 32) - 1 : -1;
+        auto klass = FindClass(class_tag);
+        if (!klass) return;
+        if (klass->id == class_class_) {
+            // a class object, the class dump carries its static fields
+            current_.klass = FindClass(tag);
+            if (!current_.klass || current_.klass->dumped) return;
+            current_.kind = kClass;
+            current_.values.assign(current_.klass->static_size, 0);
+        } else if (klass->is_array) {
+            // primitive arrays are written by PrimitiveArray
+            if (!klass->is_object_array) return;
+            current_.klass = klass;
+            current_.kind = kObjectArray;
+            current_.values.assign(current_.length > 0 ? current_.length * 4 : 0, 0);
+        } else {
+            current_.klass = klass;
+            current_.kind = kInstance;
+            current_.values.assign(klass->instance_size, 0);
+        }
+    }
+
+    void Field(jint index, uint64_t value, uint32_t size) {
+        if (current_.kind != kInstance) return;
+        auto slot = static_cast<size_t>(index) - current_.klass->field_base;
+        if (slot >= current_.klass->slots.size() || current_.klass->slots[slot] < 0) return;
+        StoreBE(&current_.values[current_.klass->slots[slot]], value, size);
+    }
+
+    void StaticField(jint index, uint64_t value, uint32_t size) {
+        if (current_.kind != kClass) return;
+        auto slot = static_cast<size_t>(index) - current_.klass->static_base;
+        if (slot >= current_.klass->static_offsets.size()) return;
+        StoreBE(&current_.values[current_.klass->static_offsets[slot]], value, size);
+    }
+
+    void Element(jint index, uint32_t id) {
+        if (current_.kind != kObjectArray) return;
+        auto offset = static_cast<size_t>(index) * 4;
+        // the length is unknown if the array was tagged before the walk
+        if (offset + 4 > current_.values.size()) current_.values.resize(offset + 4);
+        StoreBE(&current_.values[offset], id, 4);
+    }
+
+    // ART strings have no value array, write one like ART's own hprof does
+    void StringValue(const jchar *value, jint length) {
+        auto id = next_id_++;
+        PrimitiveArray(id, length, JVMTI_PRIMITIVE_TYPE_CHAR, value);
+        if (current_.kind == kInstance && current_.klass->string_value_offset >= 0) {
+            StoreBE(&current_.values[current_.klass->string_value_offset], id, 4);
+        }
+    }
+
+    void PrimitiveArray(uint32_t id, jint count, jvmtiPrimitiveType element_type, const void *elements) {
+        auto type = BasicType(static_cast<char>(element_type));
+        auto size = SizeOf(type);
+        auto body = static_cast<uint64_t>(count) * size;
+        std::vector<uint8_t> header;
+        PutU1(header, kPrimitiveArrayDump);
+        PutU4(header, id);
+        PutU4(header, kStackTraceSerial);
+        PutU4(header, static_cast<uint32_t>(count));
+        PutU1(header, type);
+        // large arrays go straight to the sink in their own segment instead of being copied
+        // into the current one
+        bool direct = body > kSegmentSize / 4;
+        if (direct) {
+            FlushSegment();
+            std::vector<uint8_t> segment_header;
+            PutU1(segment_header, kTagHeapDumpSegment);
+            PutU4(segment_header, 0);
+            PutU4(segment_header, static_cast<uint32_t>(header.size() + body));
+            sink_.Write(segment_header);
+            sink_.Write(header);
+        } else {
+            segment_.insert(segment_.end(), header.begin(), header.end());
+        }
+        auto p = static_cast<const uint8_t *>(elements);
+        if (size == 1) {
+            if (direct) sink_.Write(p, body);
+            else segment_.insert(segment_.end(), p, p + body);
+        } else {
+            uint8_t buffer[4096];
+            for (uint64_t done = 0; done < body;) {
+                auto n = std::min<uint64_t>(sizeof(buffer), body - done);
+                for (uint64_t i = 0; i < n; i += size) {
+                    uint64_t v = 0;
+                    memcpy(&v, p + done + i, size);
+                    StoreBE(buffer + i, v, size);
+                }
+                if (direct) sink_.Write(buffer, n);
+                else segment_.insert(segment_.end(), buffer, buffer + n);
+                done += n;
+            }
+        }
+        MaybeFlushSegment();
+    }
+
+    void Finish() {
+        Leave();
+        // classes which were not reached by the walk, without static values
+        for (auto &info: classes_) {
+            if (!info.dumped && info.id) ClassDump(info, nullptr);
+        }
+        FlushSegment();
+        std::vector<uint8_t> record;
+        PutU1(record, kTagHeapDumpEnd);
+        PutU4(record, 0);
+        PutU4(record, 0);
+        sink_.Write(record);
+    }
+
+private:
+    // Computes JVMTI field indices the way ART's FieldVisitor numbers them: static fields of
+    // all interfaces first, then static and instance fields of each class from
+    // java.lang.Object down. Interfaces do not count java.lang.Object.
+    void Layout(ClassInfo &info) {
+        std::unordered_set<uint32_t> visited;
+        uint32_t interface_statics = 0;
+        auto visit_interface = [&](auto &self, uint32_t id) -> void {
+            auto iface = FindClass(id);
+            if (!iface || !visited.insert(id).second) return;
+            interface_statics += iface->statics.size();
+            for (auto super: iface->interfaces) self(self, super);
+        };
+        std::vector<ClassInfo *> chain;
+        for (auto k = &info; k; k = FindClass(k->super)) {
+            chain.push_back(k);
+            if (chain.size() > 1024) break;
+        }
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+            for (auto id: (*it)->interfaces) visit_interface(visit_interface, id);
+        }
+        info.field_base = interface_statics;
+
+        // chain is ordered from this class up to java.lang.Object, indices count downwards
+        uint32_t total = 0;
+        for (auto k: chain) total += k->FieldCount();
+        info.static_base = interface_statics + total - info.FieldCount();
+        info.slots.assign(total, -1);
+        uint32_t offset = 0;
+        uint32_t first = total;
+        for (auto k: chain) {
+            first -= k->FieldCount();
+            for (size_t j = 0; j < k->fields.size(); j++) {
+                info.slots[first + k->statics.size() + j] = static_cast<int32_t>(offset);
+                offset += SizeOf(k->fields[j].type);
+            }
+            if (k == &info && info.is_string) {
+                info.string_value_offset = static_cast<int32_t>(offset);
+                offset += 4;
+            }
+        }
+        info.instance_size = offset;
+        uint32_t static_offset = 0;
+        for (auto &field: info.statics) {
+            info.static_offsets.push_back(static_offset);
+            static_offset += SizeOf(field.type);
+        }
+        info.static_size = static_offset;
+    }
+
+    void Leave() {
+        switch (current_.kind) {
+            case kInstance:
+                PutU1(segment_, kInstanceDump);
+                PutU4(segment_, current_.id);
+                PutU4(segment_, kStackTraceSerial);
+                PutU4(segment_, current_.klass->id);
+                PutU4(segment_, static_cast<uint32_t>(current_.values.size()));
+                segment_.insert(segment_.end(), current_.values.begin(), current_.values.end());
+                break;
+            case kObjectArray:
+                PutU1(segment_, kObjectArrayDump);
+                PutU4(segment_, current_.id);
+                PutU4(segment_, kStackTraceSerial);
+                PutU4(segment_, static_cast<uint32_t>(current_.values.size() / 4));
+                PutU4(segment_, current_.klass->id);
+                segment_.insert(segment_.end(), current_.values.begin(), current_.values.end());
+                break;
+            case kClass:
+                ClassDump(*current_.klass, current_.values.data());
+                break;
+            case kNone:
+                break;
+        }
+        current_.id = 0;
+        current_.kind = kNone;
+        MaybeFlushSegment();
+    }
+
+    void ClassDump(ClassInfo &info, const uint8_t *static_values) {
+        info.dumped = true;
+        PutU1(segment_, kClassDump);
+        PutU4(segment_, info.id);
+        PutU4(segment_, kStackTraceSerial);
+        PutU4(segment_, info.super);
+        PutU4(segment_, info.loader);
+        // signers, protection domain, reserved
+        for (int i = 0; i < 4; i++) PutU4(segment_, 0);
+        PutU4(segment_, info.instance_size);
+        PutU2(segment_, 0);
+        PutU2(segment_, static_cast<uint16_t>(info.statics.size()));
+        for (size_t i = 0; i < info.statics.size(); i++) {
+            auto &field = info.statics[i];
+            auto size = SizeOf(field.type);
+            PutU4(segment_, field.name);
+            PutU1(segment_, field.type);
+            if (static_values) {
+                auto p = static_values + info.static_offsets[i];
+                segment_.insert(segment_.end(), p, p + size);
+            } else {
+                segment_.insert(segment_.end(), size, 0);
+            }
+        }
+        PutU2(segment_, static_cast<uint16_t>(info.fields.size() + (info.is_string ? 1 : 0)));
+        for (auto &field: info.fields) {
+            PutU4(segment_, field.name);
+            PutU1(segment_, field.type);
+        }
+        if (info.is_string) {
+            PutU4(segment_, value_name_);
+            PutU1(segment_, kTypeObject);
+        }
+    }
+
+    void MaybeFlushSegment() {
+        if (segment_.size() >= kSegmentSize) FlushSegment();
+    }
+
+    void FlushSegment() {
+        if (segment_.empty()) return;
+        std::vector<uint8_t> header;
+        PutU1(header, kTagHeapDumpSegment);
+        PutU4(header, 0);
+        PutU4(header, static_cast<uint32_t>(segment_.size()));
+        sink_.Write(header);
+        sink_.Write(segment_);
+        segment_.clear();
+    }
+};
+
+jint JNICALL OnReference(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo *info, jlong, jlong referrer_class_tag,
+                         jlong, jlong *tag_ptr, jlong *referrer_tag_ptr, jint length, void *user_data) {
+    auto dumper = reinterpret_cast<HeapDumper *>(user_data);
+    if (*tag_ptr == 0) *tag_ptr = dumper->NewTag(length);
+    auto id = HeapDumper::Id(*tag_ptr);
+    if (!referrer_tag_ptr) {
+        dumper->Root(kind, info, id);
+        return JVMTI_VISIT_OBJECTS;
+    }
+    if (*referrer_tag_ptr == 0) *referrer_tag_ptr = dumper->NewTag(-1);
+    dumper->Enter(*referrer_tag_ptr, referrer_class_tag);
+    switch (kind) {
+        case JVMTI_HEAP_REFERENCE_FIELD:
+            dumper->Field(info->field.index, id, 4);
+            break;
+        case JVMTI_HEAP_REFERENCE_STATIC_FIELD:
+            dumper->StaticField(info->field.index, id, 4);
+            break;
+        case JVMTI_HEAP_REFERENCE_ARRAY_ELEMENT:
+            dumper->Element(info->array.index, id);
+            break;
+        default:
+            // class, loader, superclass etc. are part of the class dump already
+            break;
+    }
+    return JVMTI_VISIT_OBJECTS;
+}
+
+jint JNICALL OnPrimitiveField(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo *info, jlong object_class_tag,
+                              jlong *object_tag_ptr, jvalue value, jvmtiPrimitiveType value_type, void *user_data) {
+    auto dumper = reinterpret_cast<HeapDumper *>(user_data);
+    if (*object_tag_ptr == 0) *object_tag_ptr = dumper->NewTag(-1);
+    dumper->Enter(*object_tag_ptr, object_class_tag);
+    auto type = BasicType(static_cast<char>(value_type));
+    if (kind == JVMTI_HEAP_REFERENCE_FIELD) {
+        dumper->Field(info->field.index, RawValue(value, type), SizeOf(type));
+    } else if (kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD) {
+        dumper->StaticField(info->field.index, RawValue(value, type), SizeOf(type));
+    }
+    return 0;
+}
+
+jint JNICALL OnPrimitiveArray(jlong class_tag, jlong, jlong *tag_ptr, jint element_count, jvmtiPrimitiveType element_type,
+                              const void *elements, void *user_data) {
+    auto dumper = reinterpret_cast<HeapDumper *>(user_data);
+    if (*tag_ptr == 0) *tag_ptr = dumper->NewTag(element_count);
+    dumper->Enter(*tag_ptr, class_tag);
+    dumper->PrimitiveArray(HeapDumper::Id(*tag_ptr), element_count, element_type, elements);
+    return 0;
+}
+
+jint JNICALL OnString(jlong class_tag, jlong, jlong *tag_ptr, const jchar *value, jint value_length, void *user_data) {
+    auto dumper = reinterpret_cast<HeapDumper *>(user_data);
+    if (*tag_ptr == 0) *tag_ptr = dumper->NewTag(-1);
+    dumper->Enter(*tag_ptr, class_tag);
+    dumper->StringValue(value, value_length);
+    return 0;
+}
+
+}
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDumpHeap(JNIEnv *env, jclass, jstring path, jboolean compress, jlong chunkSize) {
+    // tags are the object ids, a private environment keeps them apart from other tag users
+    // and drops them all when the dump is done
+    ScopedTagEnv ti{env};
+    if (!ti) return nullptr;
+
+    auto chars = env->GetStringUTFChars(path, nullptr);
+    HprofSink sink{chars, compress == JNI_TRUE, static_cast<uint64_t>(chunkSize > 0 ? chunkSize : 0)};
+    env->ReleaseStringUTFChars(path, chars);
+    if (!sink.Open()) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), sink.Error().c_str());
+        return nullptr;
+    }
+
+    jint class_count;
+    jclass *classes;
+    auto r = ti->GetLoadedClasses(&class_count, &classes);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetLoadedClasses: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    auto start = NowNanos();
+    HeapDumper dumper{sink, class_count};
+    for (jint i = 0; i < class_count && !r; i++) {
+        r = ti->SetTag(classes[i], i + 1);
+    }
+    if (!r) {
+        dumper.Header();
+        dumper.AddClasses(env, ti.get(), classes);
+    }
+    for (jint i = 0; i < class_count; i++) env->DeleteLocalRef(classes[i]);
+    ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("SetTag: " + to_string(r)).c_str());
+        return nullptr;
+    }
+
+    jvmtiHeapCallbacks callbacks{};
+    callbacks.heap_reference_callback = OnReference;
+    callbacks.primitive_field_callback = OnPrimitiveField;
+    callbacks.array_primitive_value_callback = OnPrimitiveArray;
+    callbacks.string_primitive_value_callback = OnString;
+    r = ti->FollowReferences(0, nullptr, nullptr, &callbacks, &dumper);
+    if (r) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("FollowReferences: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    dumper.Finish();
+    if (!sink.Close()) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), sink.Error().c_str());
+        return nullptr;
+    }
+    LOGD("heap dump: %llu objects in %zu files, %llu ms", static_cast<unsigned long long>(dumper.objects),
+         sink.files.size(), static_cast<unsigned long long>((NowNanos() - start) / 1000000));
+
+    auto arr = env->NewObjectArray(static_cast<jsize>(sink.files.size()), env->FindClass("java/lang/String"), nullptr);
+    for (size_t i = 0; i < sink.files.size(); i++) {
+        auto str = env->NewStringUTF(sink.files[i].c_str());
+        env->SetObjectArrayElement(arr, static_cast<jsize>(i), str);
+        env->DeleteLocalRef(str);
+    }
+    return arr;
+}
@@ -0,0 +1,290 @@
+#include "method_cache.hpp"
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+    constexpr size_t kChunkSize = 64 * 1024;
+
+    MethodCache *g_method_cache = nullptr;
+}
+
+jint MethodInfo::Line(jlocation location) const {
+    if (!line_count) return -1;
+    jint line = lines[0].line_number;
+    for (uint32_t i = 0; i < line_count; i++) {
+        if (lines[i].start_location <= location) line = lines[i].line_number;
+        else break;
+    }
+    return line;
+}
+
+void *MethodCache::Arena::Allocate(size_t size, size_t align) {
+    auto offset = (used_ + align - 1) & ~(align - 1);
+    if (chunks_.empty() || offset + size > capacity_) {
+        capacity_ = size > kChunkSize ? size : kChunkSize;
+        chunks_.push_back(static_cast<char *>(malloc(capacity_)));
+        total_ += capacity_;
+        offset = 0;
+    }
+    used_ = offset + size;
+    return chunks_.back() + offset;
+}
+
+const char *MethodCache::Arena::Copy(std::string_view s) {
+    auto p = static_cast<char *>(Allocate(s.size() + 1, 1));
+    memcpy(p, s.data(), s.size());
+    p[s.size()] = 0;
+    return p;
+}
+
+const char *MethodCache::Arena::Intern(std::string_view s) {
+    auto it = strings_.find(s);
+    if (it != strings_.end()) return it->second;
+    auto p = Copy(s);
+    strings_.emplace(std::string_view(p, s.size()), p);
+    return p;
+}
+
+MethodCache *MethodCache::Get(JNIEnv *env) {
+    static std::mutex create_lock;
+    std::lock_guard<std::mutex> lk(create_lock);
+    if (g_method_cache) return g_method_cache;
+    jvmtiCapabilities cap{};
+    cap.can_tag_objects = true;
+    cap.can_generate_object_free_events = true;
+    cap.can_get_line_numbers = true;
+    auto ti = NewEnv(env, cap);
+    if (!ti) return nullptr;
+    jvmtiEventCallbacks callbacks{};
+    callbacks.ObjectFree = OnObjectFree;
+    callbacks.ClassPrepare = OnClassPrepare;
+    auto r = ti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, nullptr);
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, nullptr);
+    if (r) {
+        ti->DisposeEnvironment();
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("enable ObjectFree / ClassPrepare: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    auto cache = new MethodCache();
+    cache->ti_ = ti;
+    g_method_cache = cache;
+    return cache;
+}
+
+void JNICALL MethodCache::OnObjectFree(jvmtiEnv *, jlong tag) {
+    auto cache = g_method_cache;
+    if (!cache) return;
+    auto freed = new Freed{tag, cache->freed_.load(std::memory_order_relaxed)};
+    while (!cache->freed_.compare_exchange_weak(freed->next, freed, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void JNICALL MethodCache::OnClassPrepare(jvmtiEnv *ti, JNIEnv *, jthread, jclass klass) {
+    auto cache = g_method_cache;
+    if (!cache || !cache->dead_count_.load(std::memory_order_relaxed)) return;
+    jint count;
+    jmethodID *methods;
+    if (ti->GetClassMethods(klass, &count, &methods)) return;
+    {
+        std::unique_lock<std::shared_mutex> lk(cache->lock_);
+        for (jint i = 0; i < count; i++) cache->dead_.erase(methods[i]);
+        cache->dead_count_.store(cache->dead_.size(), std::memory_order_relaxed);
+    }
+    ti->Deallocate(reinterpret_cast<unsigned char *>(methods));
+}
+
+void MethodCache::DropFreed() {
+    auto freed = freed_.exchange(nullptr, std::memory_order_acquire);
+    while (freed) {
+        auto tag = static_cast<size_t>(freed->tag);
+        if (tag < classes_.size()) {
+            for (auto method: classes_[tag].methods) {
+                methods_.erase(method);
+                dead_.insert(method);
+            }
+            dead_count_.store(dead_.size(), std::memory_order_relaxed);
+            classes_[tag].methods.clear();
+            classes_[tag].methods.shrink_to_fit();
+        }
+        auto next = freed->next;
+        delete freed;
+        freed = next;
+    }
+}
+
+bool MethodCache::Lookup(JNIEnv *env, jmethodID method, MethodInfo *info) {
+    if (!freed_.load(std::memory_order_relaxed)) {
+        std::shared_lock<std::shared_mutex> lk(lock_);
+        auto it = methods_.find(method);
+        if (it != methods_.end()) {
+            *info = it->second;
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        if (dead_count_.load(std::memory_order_relaxed) && dead_.count(method)) return false;
+    } else {
+        std::unique_lock<std::shared_mutex> lk(lock_);
+        DropFreed();
+        if (dead_.count(method)) return false;
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    // the JVMTI calls are made without the lock, a racing miss of the same method is harmless
+    char *name = nullptr, *signature = nullptr, *class_signature = nullptr;
+    jclass klass = nullptr;
+    jint line_count = 0;
+    jvmtiLineNumberEntry *lines = nullptr;
+    jlong tag = 0;
+    auto r = ti_->GetMethodName(method, &name, &signature, nullptr);
+    if (!r) r = ti_->GetMethodDeclaringClass(method, &klass);
+    if (!r) r = ti_->GetTag(klass, &tag);
+    if (!r && !tag) r = ti_->GetClassSignature(klass, &class_signature, nullptr);
+    if (!r && ti_->GetLineNumberTable(method, &line_count, &lines)) line_count = 0;
+
+    bool ok = !r;
+    if (ok) {
+        std::unique_lock<std::shared_mutex> lk(lock_);
+        DropFreed();
+        auto it = methods_.find(method);
+        if (it != methods_.end()) {
+            *info = it->second;
+        } else {
+            // another miss may have registered the class meanwhile
+            ti_->GetTag(klass, &tag);
+            if (!tag) {
+                if (!class_signature) ti_->GetClassSignature(klass, &class_signature, nullptr);
+                tag = static_cast<jlong>(classes_.size());
+                auto &record = classes_.emplace_back();
+                auto descriptor = class_signature ? class_signature : "<unknown>";
+                record.descriptor = arena_.Intern(descriptor);
+                record.name = arena_.Intern(DescriptorToName(descriptor));
+                ti_->SetTag(klass, tag);
+            }
+            auto &record = classes_[tag];
+            // already listed if it was dropped by Clear
+            if (std::find(record.methods.begin(), record.methods.end(), method) == record.methods.end()) {
+                record.methods.push_back(method);
+            }
+            MethodInfo &entry = methods_[method];
+            entry.class_descriptor = record.descriptor;
+            entry.class_name = record.name;
+            entry.name = arena_.Intern(name);
+            entry.signature = arena_.Intern(signature);
+            entry.line_count = static_cast<uint32_t>(line_count);
+            entry.lines = nullptr;
+            if (line_count) {
+                auto copy = static_cast<jvmtiLineNumberEntry *>(
+                        arena_.Allocate(sizeof(jvmtiLineNumberEntry) * line_count, alignof(jvmtiLineNumberEntry)));
+                memcpy(copy, lines, sizeof(jvmtiLineNumberEntry) * line_count);
+                entry.lines = copy;
+            }
+            *info = entry;
+        }
+    }
+    if (name) ti_->Deallocate(reinterpret_cast<unsigned char *>(name));
+    if (signature) ti_->Deallocate(reinterpret_cast<unsigned char *>(signature));
+    if (class_signature) ti_->Deallocate(reinterpret_cast<unsigned char *>(class_signature));
+    if (lines) ti_->Deallocate(reinterpret_cast<unsigned char *>(lines));
+    if (klass) env->DeleteLocalRef(klass);
+    return ok;
+}
+
+void MethodCache::Clear() {
+    std::unique_lock<std::shared_mutex> lk(lock_);
+    DropFreed();
+    // the methods of the classes are kept, they become tombstones when a class is unloaded
+    methods_.clear();
+}
+
+MethodCache::Stats MethodCache::GetStats() {
+    std::shared_lock<std::shared_mutex> lk(lock_);
+    return {methods_.size(), classes_.size() - 1, arena_.Bytes(), hits_.load(), misses_.load()};
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeClearMethodCache(JNIEnv *env, jclass) {
+    if (auto cache = MethodCache::Get(env)) cache->Clear();
+}
+
+// Symbolizes a synthetic stream of frames (the methods of the loaded classes, repeated)
+// once with plain JVMTI calls per frame, then through the cache from empty and again warm.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeBenchmarkMethodCache(JNIEnv *env, jclass, jint frames) {
+    auto cache = MethodCache::Get(env);
+    if (!cache) return nullptr;
+    jvmtiCapabilities cap{};
+    cap.can_get_line_numbers = true;
+    auto ti = NewEnv(env, cap);
+    if (!ti) return nullptr;
+    std::vector<jmethodID> methods;
+    jint class_count;
+    jclass *classes;
+    if (!ti->GetLoadedClasses(&class_count, &classes)) {
+        for (jint i = 0; i < class_count; i++) {
+            jint method_count;
+            jmethodID *class_methods;
+            if (methods.size() < 65536 && !ti->GetClassMethods(classes[i], &method_count, &class_methods)) {
+                methods.insert(methods.end(), class_methods, class_methods + method_count);
+                ti->Deallocate(reinterpret_cast<unsigned char *>(class_methods));
+            }
+            env->DeleteLocalRef(classes[i]);
+        }
+        ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+    }
+    if (methods.empty() || frames <= 0) {
+        ti->DisposeEnvironment();
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "no methods to symbolize");
+        return nullptr;
+    }
+    std::vector<jmethodID> stream(frames);
+    for (jint i = 0; i < frames; i++) stream[i] = methods[(static_cast<uint64_t>(i) * 7919) % methods.size()];
+
+    // the same calls as a cache miss
+    auto start = NowNanos();
+    for (auto method: stream) {
+        char *name, *signature, *class_signature;
+        jclass klass;
+        jint line_count;
+        jvmtiLineNumberEntry *lines;
+        if (ti->GetMethodName(method, &name, &signature, nullptr)) continue;
+        if (!ti->GetMethodDeclaringClass(method, &klass)) {
+            if (!ti->GetClassSignature(klass, &class_signature, nullptr)) {
+                DescriptorToName(class_signature);
+                ti->Deallocate(reinterpret_cast<unsigned char *>(class_signature));
+            }
+            env->DeleteLocalRef(klass);
+        }
+        if (!ti->GetLineNumberTable(method, &line_count, &lines)) ti->Deallocate(reinterpret_cast<unsigned char *>(lines));
+        ti->Deallocate(reinterpret_cast<unsigned char *>(name));
+        ti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+    }
+    auto raw = NowNanos() - start;
+    ti->DisposeEnvironment();
+
+    cache->Clear();
+    MethodInfo info;
+    uint64_t passes[2];
+    for (auto &pass: passes) {
+        start = NowNanos();
+        for (auto method: stream) {
+            cache->Lookup(env, method, &info);
+        }
+        pass = NowNanos() - start;
+    }
+    auto stats = cache->GetStats();
+    auto per_frame = [frames](uint64_t ns) { return static_cast<double>(ns) / frames; };
+    return env->NewStringUTF(Format("%d frames of %zu methods: jvmti %.1f ns/frame, cold cache %.1f ns/frame, warm cache %.1f ns/frame\n"
+                                    "cache: %zu methods, %zu classes, %zu arena bytes, %llu hits, %llu misses",
+                                    frames, methods.size(), per_frame(raw), per_frame(passes[0]), per_frame(passes[1]),
+                                    stats.methods, stats.classes, stats.arena_bytes,
+                                    static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses)).c_str());
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "jvmti.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Symbols of a method. The strings and the line table live in the arena of the cache and
+// stay valid for the lifetime of the process, even after the entry is invalidated.
+struct MethodInfo {
+    // Lcom/example/Foo; and com.example.Foo
+    const char *class_descriptor;
+    const char *class_name;
+    const char *name;
+    const char *signature;
+    const jvmtiLineNumberEntry *lines;
+    uint32_t line_count;
+
+    // line of location, -1 without a line table
+    jint Line(jlocation location) const;
+};
+
+// Process wide jmethodID -> MethodInfo cache, so stack features pay the JVMTI calls (and
+// their allocations) once per method instead of once per frame. Class descriptors are
+// interned, all strings are bump allocated from an append-only arena.
+// Declaring classes are tagged in a private environment: when a class is unloaded, the
+// ObjectFree event of its tag queues it and its methods are dropped before the next lookup
+// and kept as tombstones, so a stale jmethodID still held by a stack trie fails the lookup
+// instead of being passed to JVMTI. ART may reuse the jmethodIDs, ClassPrepare revives the
+// methods of new classes. A method never looked up before its class was unloaded cannot be
+// told apart and still goes to JVMTI. RedefineClasses by another agent keeps the jmethodIDs
+// but can change line tables, Clear drops every entry for that case.
+class MethodCache {
+public:
+    // Throws and returns null if JVMTI is unavailable.
+    static MethodCache *Get(JNIEnv *env);
+
+    // false if the method is invalid (e.g. of an unloaded class)
+    bool Lookup(JNIEnv *env, jmethodID method, MethodInfo *info);
+
+    void Clear();
+
+    struct Stats {
+        size_t methods;
+        size_t classes;
+        size_t arena_bytes;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    Stats GetStats();
+
+private:
+    class Arena {
+        std::vector<char *> chunks_;
+        size_t used_ = 0;
+        size_t capacity_ = 0;
+        size_t total_ = 0;
+        std::unordered_map<std::string_view, const char *> strings_;
+
+    public:
+        void *Allocate(size_t size, size_t align);
+
+        // deduplicated copy of s
+        const char *Intern(std::string_view s);
+
+        const char *Copy(std::string_view s);
+
+        size_t Bytes() const { return total_; }
+    };
+
+    struct ClassRecord {
+        const char *descriptor = nullptr;
+        const char *name = nullptr;
+        std::vector<jmethodID> methods;
+    };
+
+    struct Freed {
+        jlong tag;
+        Freed *next;
+    };
+
+    jvmtiEnv *ti_ = nullptr;
+    std::shared_mutex lock_;
+    std::unordered_map<jmethodID, MethodInfo> methods_;
+    // methods of unloaded classes
+    std::unordered_set<jmethodID> dead_;
+    std::atomic<size_t> dead_count_{0};
+    // index is the tag of the class, 0 is unused
+    std::vector<ClassRecord> classes_{1};
+    Arena arena_;
+    // pushed by ObjectFree, which must not block on lock_ as it runs inside the GC
+    std::atomic<Freed *> freed_{nullptr};
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+
+    static void JNICALL OnObjectFree(jvmtiEnv *ti, jlong tag);
+
+    static void JNICALL OnClassPrepare(jvmtiEnv *ti, JNIEnv *env, jthread thread, jclass klass);
+
+    // with lock_ held exclusively
+    void DropFreed();
+};
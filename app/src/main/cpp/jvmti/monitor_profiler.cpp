@@ -0,0 +1,304 @@
+#include "stethox_jvmti.hpp"
+#include "stack_trie.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <mutex>
+#include <vector>
+
+// Monitor contention profiler. MonitorContendedEnter only fires when a thread has to block
+// on a monitor, so nothing is paid on uncontended locking. The blocked time (until
+// MonitorContendedEntered) is added to the class of the monitor and to the acquiring stack,
+// and optionally to the stack of the owner at the time the thread started to block.
+// Object.wait can be recorded as well. Memory is bounded: classes beyond kMaxClasses are
+// counted as "<other>" and stacks stop being interned once a trie reaches kMaxNodes, their
+// time is then kept on the class label.
+namespace {
+    constexpr jint kMaxFrames = 64;
+    constexpr size_t kMaxClasses = 1024;
+    constexpr size_t kMaxNodes = 1 << 16;
+
+    enum Kind {
+        kBlocked,
+        kOwner,
+        kWait,
+        kKinds,
+    };
+
+    struct ClassEntry {
+        std::string name;
+        // label nodes of the class in each trie
+        uint32_t labels[kKinds];
+        uint64_t blocked_ns = 0;
+        uint64_t blocked_count = 0;
+        uint64_t wait_ns = 0;
+        uint64_t wait_count = 0;
+    };
+
+    // what a thread is blocked or waiting on, between the paired events
+    struct Pending {
+        uint64_t start_ns = 0;
+        uint32_t klass = 0;
+        uint32_t node = 0;
+        uint32_t owner_node = 0;
+    };
+
+    std::mutex g_monitor_mutex;
+    jvmtiEnv *g_monitor_env = nullptr;
+    jint g_monitor_depth = kMaxFrames;
+    bool g_monitor_owners = false;
+
+    // guards g_classes, g_tries and the counters
+    std::mutex g_monitor_data_mutex;
+    // index is the tag of the class in g_monitor_env, 0 is "<other>"
+    std::vector<ClassEntry> g_classes;
+    StackTrie g_tries[kKinds];
+    uint64_t g_dropped_stacks = 0;
+
+    thread_local Pending t_blocked;
+    thread_local Pending t_wait;
+
+    void ResetData() {
+        g_classes.clear();
+        for (auto &trie: g_tries) trie.Clear();
+        auto &other = g_classes.emplace_back();
+        other.name = "<other>";
+        for (int k = 0; k < kKinds; k++) other.labels[k] = g_tries[k].LabelChild(0, other.name);
+        g_dropped_stacks = 0;
+    }
+
+    // with g_monitor_data_mutex held
+    uint32_t ClassOf(jvmtiEnv *ti, JNIEnv *env, jobject object) {
+        auto klass = env->GetObjectClass(object);
+        jlong tag = 0;
+        ti->GetTag(klass, &tag);
+        if (!tag && g_classes.size() < kMaxClasses) {
+            char *signature;
+            if (!ti->GetClassSignature(klass, &signature, nullptr)) {
+                tag = static_cast<jlong>(g_classes.size());
+                auto &entry = g_classes.emplace_back();
+                entry.name = DescriptorToName(signature);
+                for (int k = 0; k < kKinds; k++) entry.labels[k] = g_tries[k].LabelChild(0, entry.name);
+                ti->Deallocate(reinterpret_cast<unsigned char *>(signature));
+                ti->SetTag(klass, tag);
+            }
+        }
+        env->DeleteLocalRef(klass);
+        return static_cast<uint32_t>(tag < static_cast<jlong>(g_classes.size()) ? tag : 0);
+    }
+
+    // with g_monitor_data_mutex held
+    uint32_t InternStack(Kind kind, uint32_t klass, const jvmtiFrameInfo *frames, jint count) {
+        auto &trie = g_tries[kind];
+        auto label = g_classes[klass].labels[kind];
+        if (trie.nodes.size() + count > kMaxNodes) {
+            g_dropped_stacks++;
+            return label;
+        }
+        return trie.Intern(frames, count, label);
+    }
+
+    void JNICALL OnContendedEnter(jvmtiEnv *ti, JNIEnv *env, jthread, jobject object) {
+        jvmtiFrameInfo frames[kMaxFrames], owner_frames[kMaxFrames];
+        jint count = 0, owner_count = 0;
+        if (ti->GetStackTrace(nullptr, 0, g_monitor_depth, frames, &count)) count = 0;
+        if (g_monitor_owners && env->PushLocalFrame(16) == JNI_OK) {
+            jvmtiMonitorUsage usage{};
+            if (!ti->GetObjectMonitorUsage(object, &usage)) {
+                if (usage.owner && ti->GetStackTrace(usage.owner, 0, g_monitor_depth, owner_frames, &owner_count)) owner_count = 0;
+                ti->Deallocate(reinterpret_cast<unsigned char *>(usage.waiters));
+                ti->Deallocate(reinterpret_cast<unsigned char *>(usage.notify_waiters));
+            }
+            // also drops the thread references of the usage
+            env->PopLocalFrame(nullptr);
+        }
+        std::lock_guard<std::mutex> lk(g_monitor_data_mutex);
+        auto klass = ClassOf(ti, env, object);
+        t_blocked.klass = klass;
+        t_blocked.node = InternStack(kBlocked, klass, frames, count);
+        t_blocked.owner_node = g_monitor_owners ? InternStack(kOwner, klass, owner_frames, owner_count) : 0;
+        t_blocked.start_ns = NowNanos();
+    }
+
+    void JNICALL OnContendedEntered(jvmtiEnv *, JNIEnv *, jthread, jobject) {
+        if (!t_blocked.start_ns) return;
+        auto blocked = NowNanos() - t_blocked.start_ns;
+        t_blocked.start_ns = 0;
+        std::lock_guard<std::mutex> lk(g_monitor_data_mutex);
+        // the data was reset while the thread was blocked
+        if (t_blocked.klass >= g_classes.size() || t_blocked.node >= g_tries[kBlocked].nodes.size()) return;
+        auto &entry = g_classes[t_blocked.klass];
+        entry.blocked_ns += blocked;
+        entry.blocked_count++;
+        auto &node = g_tries[kBlocked].nodes[t_blocked.node];
+        node.count++;
+        node.weight += blocked;
+        if (t_blocked.owner_node && t_blocked.owner_node < g_tries[kOwner].nodes.size()) {
+            auto &owner = g_tries[kOwner].nodes[t_blocked.owner_node];
+            owner.count++;
+            owner.weight += blocked;
+        }
+    }
+
+    void JNICALL OnMonitorWait(jvmtiEnv *ti, JNIEnv *env, jthread, jobject object, jlong) {
+        jvmtiFrameInfo frames[kMaxFrames];
+        jint count = 0;
+        if (ti->GetStackTrace(nullptr, 0, g_monitor_depth, frames, &count)) count = 0;
+        std::lock_guard<std::mutex> lk(g_monitor_data_mutex);
+        auto klass = ClassOf(ti, env, object);
+        t_wait.klass = klass;
+        t_wait.node = InternStack(kWait, klass, frames, count);
+        t_wait.start_ns = NowNanos();
+    }
+
+    void JNICALL OnMonitorWaited(jvmtiEnv *, JNIEnv *, jthread, jobject, jboolean) {
+        if (!t_wait.start_ns) return;
+        auto waited = NowNanos() - t_wait.start_ns;
+        t_wait.start_ns = 0;
+        std::lock_guard<std::mutex> lk(g_monitor_data_mutex);
+        if (t_wait.klass >= g_classes.size() || t_wait.node >= g_tries[kWait].nodes.size()) return;
+        auto &entry = g_classes[t_wait.klass];
+        entry.wait_ns += waited;
+        entry.wait_count++;
+        auto &node = g_tries[kWait].nodes[t_wait.node];
+        node.count++;
+        node.weight += waited;
+    }
+
+    // the heaviest stack below a class label, innermost frame first
+    std::string HeaviestStack(const StackTrie &trie, uint32_t label, FrameNames &names, int max_frames) {
+        auto best = trie.Heaviest(label, true);
+        std::string out;
+        int frames = 0;
+        for (auto id = best; id && id != label && frames < max_frames; id = trie.nodes[id].parent, frames++) {
+            out += "\n        at ";
+            out += names.Name(trie.nodes[id].method, trie.nodes[id].location);
+        }
+        if (best) out = Format("\n      %.3f ms:", static_cast<double>(trie.nodes[best].weight) / 1e6) + out;
+        return out;
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStartMonitorProfiling(JNIEnv *env, jclass, jint maxDepth, jboolean owners, jboolean waits) {
+    std::lock_guard<std::mutex> lk(g_monitor_mutex);
+    if (g_monitor_env) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "monitor profiling is running");
+        return;
+    }
+    jvmtiCapabilities cap{};
+    cap.can_tag_objects = true;
+    cap.can_generate_monitor_events = true;
+    cap.can_get_monitor_info = owners;
+    auto ti = NewEnv(env, cap);
+    if (!ti) return;
+    {
+        std::lock_guard<std::mutex> data_lk(g_monitor_data_mutex);
+        ResetData();
+    }
+    g_monitor_depth = maxDepth > 0 && maxDepth < kMaxFrames ? maxDepth : kMaxFrames;
+    g_monitor_owners = owners;
+
+    jvmtiEventCallbacks callbacks{};
+    callbacks.MonitorContendedEnter = OnContendedEnter;
+    callbacks.MonitorContendedEntered = OnContendedEntered;
+    callbacks.MonitorWait = OnMonitorWait;
+    callbacks.MonitorWaited = OnMonitorWaited;
+    auto r = ti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, nullptr);
+    if (!r) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, nullptr);
+    if (!r && waits) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAIT, nullptr);
+    if (!r && waits) r = ti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAITED, nullptr);
+    if (r) {
+        ti->DisposeEnvironment();
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("enable monitor events: " + to_string(r)).c_str());
+        return;
+    }
+    g_monitor_env = ti;
+    LOGD("monitor profiling started");
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStopMonitorProfiling(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_monitor_mutex);
+    if (!g_monitor_env) return;
+    g_monitor_env->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, nullptr);
+    g_monitor_env->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, nullptr);
+    g_monitor_env->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_WAIT, nullptr);
+    g_monitor_env->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_MONITOR_WAITED, nullptr);
+    g_monitor_env->DisposeEnvironment();
+    g_monitor_env = nullptr;
+    LOGD("monitor profiling stopped");
+}
+
+// The top monitor classes by blocked time with their counters and the heaviest acquiring,
+// owner and wait stacks. Works while profiling and after stopping.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeMonitorContentionReport(JNIEnv *env, jclass, jint top, jint maxFrames, jboolean lines) {
+    std::vector<ClassEntry> classes;
+    StackTrie tries[kKinds];
+    uint64_t dropped;
+    {
+        std::lock_guard<std::mutex> lk(g_monitor_data_mutex);
+        classes = g_classes;
+        for (int k = 0; k < kKinds; k++) tries[k] = g_tries[k];
+        dropped = g_dropped_stacks;
+    }
+    std::vector<size_t> order;
+    for (size_t i = 0; i < classes.size(); i++) {
+        if (classes[i].blocked_count || classes[i].wait_count) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (classes[a].blocked_ns != classes[b].blocked_ns) return classes[a].blocked_ns > classes[b].blocked_ns;
+        return classes[a].wait_ns > classes[b].wait_ns;
+    });
+    if (top > 0 && order.size() > static_cast<size_t>(top)) order.resize(top);
+
+    FrameNames names{env, static_cast<bool>(lines)};
+    auto frames = maxFrames > 0 ? maxFrames : 8;
+    auto out = Format("%zu monitor classes, %llu stacks dropped", classes.size() - 1, static_cast<unsigned long long>(dropped));
+    for (auto i: order) {
+        auto &entry = classes[i];
+        out += Format("\n%s: blocked %.3f ms in %llu contentions, waited %.3f ms in %llu waits", entry.name.c_str(),
+                      static_cast<double>(entry.blocked_ns) / 1e6, static_cast<unsigned long long>(entry.blocked_count),
+                      static_cast<double>(entry.wait_ns) / 1e6, static_cast<unsigned long long>(entry.wait_count));
+        static const char *kTitles[kKinds] = {"acquiring", "owner", "waiting"};
+        for (int k = 0; k < kKinds; k++) {
+            auto stack = HeaviestStack(tries[k], entry.labels[k], names, frames);
+            if (!stack.empty()) out += Format("\n    %s", kTitles[k]) + stack;
+        }
+    }
+    return env->NewStringUTF(out.c_str());
+}
+
+// Writes the acquiring (kind 0), owner (1) or wait (2) stacks as collapsed stacks below the
+// monitor class, weighted by nanoseconds. Returns the number of stacks.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeDumpMonitorContention(JNIEnv *env, jclass, jstring path, jint kind, jboolean lines) {
+    if (kind < 0 || kind >= kKinds) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "invalid kind");
+        return 0;
+    }
+    StackTrie trie;
+    {
+        std::lock_guard<std::mutex> lk(g_monitor_data_mutex);
+        trie = g_tries[kind];
+    }
+    FrameNames names{env, static_cast<bool>(lines)};
+    std::unordered_map<std::string, uint64_t> stacks;
+    CollapseStacks(trie, names, true, stacks);
+    auto file = env->GetStringUTFChars(path, nullptr);
+    auto ok = WriteCollapsed(file, stacks);
+    if (!ok) {
+        env->ThrowNew(env->FindClass("java/io/IOException"), Format("write %s: %s", file, strerror(errno)).c_str());
+    }
+    env->ReleaseStringUTFChars(path, file);
+    return ok ? static_cast<jint>(stacks.size()) : 0;
+}
@@ -0,0 +1,103 @@
+#include "stethox_jvmti.hpp"
+
+#include "logging.h"
+
+jvmtiEnv *NewEnv(JNIEnv *env, const jvmtiCapabilities &cap) {
+    if (!gJvmtiEnv) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), "no jvmti env");
+        return nullptr;
+    }
+    JavaVM *vm;
+    env->GetJavaVM(&vm);
+    // see Agent_OnAttach
+    constexpr jint kArtTiVersion = JVMTI_VERSION_1_2 | 0x40000000;
+    jvmtiEnv *ti = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void **>(&ti), kArtTiVersion) != JNI_OK || !ti) {
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), "failed to create jvmti env");
+        return nullptr;
+    }
+    if (auto r = ti->AddCapabilities(&cap); r) {
+        ti->DisposeEnvironment();
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("AddCapabilities: " + to_string(r)).c_str());
+        return nullptr;
+    }
+    return ti;
+}
+
+jvmtiEnv *NewTagEnv(JNIEnv *env) {
+    jvmtiCapabilities cap{};
+    cap.can_tag_objects = true;
+    return NewEnv(env, cap);
+}
+
+ObjectCursor *ObjectCursor::Create(JNIEnv *env, jint page_size) {
+    if (page_size <= 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "page size must be positive");
+        return nullptr;
+    }
+    auto ti = NewTagEnv(env);
+    if (!ti) return nullptr;
+    auto cursor = new ObjectCursor(page_size);
+    cursor->ti_ = ti;
+    return cursor;
+}
+
+ObjectCursor::~ObjectCursor() {
+    if (ti_) ti_->DisposeEnvironment();
+}
+
+jvmtiError ObjectCursor::Add(jobject obj) {
+    jlong tag = 0;
+    auto r = ti_->GetTag(obj, &tag);
+    if (r || tag != 0) return r;
+    r = ti_->SetTag(obj, TagForIndex(count_));
+    if (!r) count_++;
+    return r;
+}
+
+jobjectArray ObjectCursor::Next(JNIEnv *env) {
+    auto last_page = TagForIndex(count_ - 1);
+    while (count_ > 0 && next_page_ <= last_page) {
+        jlong tag = next_page_++;
+        jint count;
+        jobject *objects;
+        auto r = ti_->GetObjectsWithTags(1, &tag, &count, &objects, nullptr);
+        if (r) {
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetObjectsWithTags: " + to_string(r)).c_str());
+            return nullptr;
+        }
+        // every object of the page may have been collected
+        if (count == 0) {
+            ti_->Deallocate(reinterpret_cast<unsigned char*>(objects));
+            continue;
+        }
+        auto arr = env->NewObjectArray(count, env->FindClass("java/lang/Object"), nullptr);
+        for (jint i = 0; i < count; i++) {
+            env->SetObjectArrayElement(arr, i, objects[i]);
+            // keeps the tag table small for the following pages
+            ti_->SetTag(objects[i], 0);
+            env->DeleteLocalRef(objects[i]);
+        }
+        ti_->Deallocate(reinterpret_cast<unsigned char*>(objects));
+        return arr;
+    }
+    return nullptr;
+}
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeCursorNext(JNIEnv *env, jclass, jlong handle) {
+    return ObjectCursor::From(handle)->Next(env);
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeCursorCount(JNIEnv *, jclass, jlong handle) {
+    return ObjectCursor::From(handle)->Count();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeCursorClose(JNIEnv *, jclass, jlong handle) {
+    delete ObjectCursor::From(handle);
+}
@@ -0,0 +1,117 @@
+#include "stack_trie.hpp"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdio>
+
+uint32_t StackTrie::Child(uint32_t parent, jmethodID method, jlocation location) {
+    for (auto i = nodes[parent].first_child; i; i = nodes[i].next_sibling) {
+        if (nodes[i].method == method && nodes[i].location == location) return i;
+    }
+    auto id = static_cast<uint32_t>(nodes.size());
+    auto &node = nodes.emplace_back();
+    node.method = method;
+    node.location = location;
+    node.parent = parent;
+    node.next_sibling = nodes[parent].first_child;
+    nodes[parent].first_child = id;
+    return id;
+}
+
+uint32_t StackTrie::Intern(const jvmtiFrameInfo *frames, jint count, uint32_t node) {
+    for (auto i = count - 1; i >= 0; i--) node = Child(node, frames[i].method, frames[i].location);
+    return node;
+}
+
+uint32_t StackTrie::LabelChild(uint32_t parent, const std::string &label) {
+    auto [it, inserted] = label_ids_.try_emplace(label, static_cast<uint32_t>(labels.size()));
+    if (inserted) labels.push_back(label);
+    return Child(parent, nullptr, it->second);
+}
+
+uint32_t StackTrie::Heaviest(uint32_t node, bool weight) const {
+    uint32_t best = 0;
+    uint64_t best_value = 0;
+    std::vector<uint32_t> stack{node};
+    while (!stack.empty()) {
+        auto &n = nodes[stack.back()];
+        auto id = stack.back();
+        stack.pop_back();
+        auto value = weight ? n.weight : n.count;
+        if (n.method && value > best_value) {
+            best = id;
+            best_value = value;
+        }
+        for (auto c = n.first_child; c; c = nodes[c].next_sibling) stack.push_back(c);
+    }
+    return best;
+}
+
+void StackTrie::Clear() {
+    nodes.assign(1, Node{});
+    labels.clear();
+    label_ids_.clear();
+}
+
+FrameNames::FrameNames(JNIEnv *env, bool lines) : env_(env), cache_(MethodCache::Get(env)), lines_(lines) {
+    // the profile is still written with unknown frames
+    if (!cache_) env->ExceptionClear();
+}
+
+const std::pair<std::string, MethodInfo> &FrameNames::Get(jmethodID method) {
+    auto [it, inserted] = methods_.try_emplace(method);
+    auto &m = it->second;
+    if (!inserted) return m;
+    if (cache_ && cache_->Lookup(env_, method, &m.second)) {
+        m.first = std::string(m.second.class_name) + "." + m.second.name;
+    } else {
+        m.first = "<unknown>";
+        m.second = MethodInfo{};
+    }
+    return m;
+}
+
+jint FrameNames::Line(jmethodID method, jlocation location) {
+    return lines_ ? Get(method).second.Line(location) : -1;
+}
+
+std::string FrameNames::Name(jmethodID method, jlocation location) {
+    auto &m = Get(method);
+    if (!lines_) return m.first;
+    auto line = m.second.Line(location);
+    if (line < 0) return Format("%s@%lld", m.first.c_str(), static_cast<long long>(location));
+    return m.first + ":" + std::to_string(line);
+}
+
+void CollapseStacks(const StackTrie &trie, FrameNames &names, bool weight, std::unordered_map<std::string, uint64_t> &out) {
+    // depth first, keeping the name of every node on the current path
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    std::string path;
+    for (auto c = trie.nodes[0].first_child; c; c = trie.nodes[c].next_sibling) stack.emplace_back(c, 0);
+    while (!stack.empty()) {
+        auto [id, length] = stack.back();
+        stack.pop_back();
+        auto &node = trie.nodes[id];
+        path.resize(length);
+        if (length) path += ';';
+        if (node.method) path += names.Name(node.method, node.location);
+        else path += "[" + trie.labels[node.location] + "]";
+        auto value = weight ? node.weight : node.count;
+        if (value) out[path] += value;
+        for (auto c = node.first_child; c; c = trie.nodes[c].next_sibling) stack.emplace_back(c, path.size());
+    }
+}
+
+bool WriteCollapsed(const char *path, const std::unordered_map<std::string, uint64_t> &stacks) {
+    auto file = fopen(path, "we");
+    if (!file) return false;
+    std::vector<const std::pair<const std::string, uint64_t> *> sorted;
+    sorted.reserve(stacks.size());
+    for (auto &entry: stacks) sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) { return a->second > b->second; });
+    for (auto entry: sorted) {
+        fprintf(file, "%s %llu\n", entry->first.c_str(), static_cast<unsigned long long>(entry->second));
+    }
+    return fclose(file) == 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "jvmti.h"
+#include "method_cache.hpp"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Stacks interned as paths of a trie keyed by jmethodID and location, from the outermost
+// frame down, so a sample costs one node per new frame and a counter bump otherwise. Nodes
+// without a method are labels (e.g. the allocated class) whose location indexes labels.
+class StackTrie {
+public:
+    struct Node {
+        jmethodID method = nullptr;
+        jlocation location = 0;
+        uint32_t parent = 0;
+        uint32_t first_child = 0;
+        uint32_t next_sibling = 0;
+        uint64_t count = 0;
+        uint64_t weight = 0;
+    };
+
+    std::vector<Node> nodes{1};
+    std::vector<std::string> labels;
+
+    // frames as returned by GetStackTrace, innermost first
+    uint32_t Intern(const jvmtiFrameInfo *frames, jint count, uint32_t node = 0);
+
+    uint32_t Child(uint32_t parent, jmethodID method, jlocation location);
+
+    uint32_t LabelChild(uint32_t parent, const std::string &label);
+
+    // the method node below node with the largest weight (or count), 0 if there is none
+    uint32_t Heaviest(uint32_t node, bool weight) const;
+
+    void Clear();
+
+private:
+    std::unordered_map<std::string, uint32_t> label_ids_;
+};
+
+// Frame names for output from the MethodCache: "pkg.Class.method" plus ":line" (or "@bci"
+// without a line number table) if lines is set. Methods of unloaded classes which were looked
+// up in the MethodCache before (see its tombstones) are "<unknown>".
+class FrameNames {
+    JNIEnv *env_;
+    MethodCache *cache_;
+    bool lines_;
+    std::unordered_map<jmethodID, std::pair<std::string, MethodInfo>> methods_;
+
+    const std::pair<std::string, MethodInfo> &Get(jmethodID method);
+
+public:
+    FrameNames(JNIEnv *env, bool lines);
+
+    std::string Name(jmethodID method, jlocation location);
+
+    // "pkg.Class.method"
+    const std::string &MethodName(jmethodID method) { return Get(method).first; }
+
+    // line of location in method, -1 if unknown or without lines
+    jint Line(jmethodID method, jlocation location);
+};
+
+// Adds every stack of the trie to out as a collapsed line ("outer;...;inner") with its count,
+// or with its weight if weight is set. Stacks with the same names are merged.
+void CollapseStacks(const StackTrie &trie, FrameNames &names, bool weight, std::unordered_map<std::string, uint64_t> &out);
+
+// Writes collapsed stacks (as consumed by flamegraph.pl and speedscope), one per line,
+// heaviest first. Returns false if the file cannot be written.
+bool WriteCollapsed(const char *path, const std::unordered_map<std::string, uint64_t> &stacks);
@@ -1,20 +1,14 @@
-#include "jvmti.h"
+#include "stethox_jvmti.hpp"
 
 #include "logging.h"
+#include "utils.h"
 
 #include <vector>
-#include <mutex>
+#include <map>
+#include <string_view>
+#include <unordered_map>
 
-static jvmtiEnv *gJvmtiEnv = nullptr;
-
-std::string Format(const char* fmt, ...) {
-    va_list ap;
-    char buf[1024];
-    va_start(ap, fmt);
-    vsnprintf(buf, 1024, fmt, ap);
-    va_end(ap);
-    return buf;
-}
+jvmtiEnv *gJvmtiEnv = nullptr;
 
 std::string to_string(jvmtiError e) {
     const char* name;
@@ -96,7 +90,11 @@ Agent_OnAttach(JavaVM* vm, char *options, void *reserved) {
 }
 
 static jvmtiError getAssignableClasses(JNIEnv* env, jclass targetClazz, jobject class_loader, std::vector<jclass> &target_classes) {
-    jvmtiError r = JVMTI_ERROR_NONE;
+    jvmtiError r = FindSubtypes(env, targetClazz, class_loader, target_classes);
+    if (!r) return r;
+    // the scan below works whatever went wrong with the index
+    if (r != JVMTI_ERROR_NOT_AVAILABLE) LOGE("FindSubtypes %s", to_string(r).c_str());
+    r = JVMTI_ERROR_NONE;
     jint count;
     jclass* classes;
     if (class_loader) {
@@ -122,17 +120,13 @@ static jvmtiError getAssignableClasses(JNIEnv* env, jclass targetClazz, jobject
     return r;
 }
 
-static std::mutex g_mutex;
-
 extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_a13e300_tools_NativeUtils_nativeGetObjects(JNIEnv *env, jclass, jclass targetClazz, jboolean child) {
-    if (!gJvmtiEnv) {
-        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), "no jvmti env");
-        return nullptr;
-    }
-
-    std::lock_guard lk{g_mutex};
+    // every query tags in its own environment, so concurrent queries need no lock and
+    // all tags are dropped together when it is disposed, including on the error paths
+    ScopedTagEnv ti{env};
+    if (!ti) return nullptr;
 
     jvmtiError r;
     std::vector<jclass> target_classes;
@@ -146,9 +140,10 @@ Java_io_github_a13e300_tools_NativeUtils_nativeGetObjects(JNIEnv *env, jclass, j
         target_classes.emplace_back(targetClazz);
     }
 
+    constexpr jlong kClassTag = 1, kObjectTag = 2;
     LOGD("target classes %zu", target_classes.size());
     for (auto clarr: target_classes) {
-        r = gJvmtiEnv->SetTag(clarr, 0xfffe);
+        r = ti->SetTag(clarr, kClassTag);
         if (r) {
             LOGE("SetTag %s", to_string(r).c_str());
             env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("SetTag: " + to_string(r)).c_str());
@@ -158,21 +153,21 @@ Java_io_github_a13e300_tools_NativeUtils_nativeGetObjects(JNIEnv *env, jclass, j
 
     jvmtiHeapCallbacks callbacks {};
     callbacks.heap_iteration_callback = [](jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) -> jint {
-        if (class_tag == 0xfffe) *tag_ptr = 0xffff;
+        if (class_tag == kClassTag) *tag_ptr = kObjectTag;
         return JVMTI_VISIT_OBJECTS;
     };
 
-    r = gJvmtiEnv->IterateThroughHeap(0, nullptr, &callbacks, nullptr);
+    r = ti->IterateThroughHeap(0, nullptr, &callbacks, nullptr);
     if (r) {
         LOGE("IterateThroughHeap: %d", r);
         env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
         return nullptr;
     }
 
-    jlong the_tag = 0xffff;
+    jlong the_tag = kObjectTag;
     jint count;
     jobject* objects;
-    r = gJvmtiEnv->GetObjectsWithTags(1, &the_tag, &count, &objects, nullptr);
+    r = ti->GetObjectsWithTags(1, &the_tag, &count, &objects, nullptr);
     if (r) {
         LOGE("GetObjectsWithTags: %d", r);
         env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetObjectsWithTags: " + to_string(r)).c_str());
@@ -183,22 +178,186 @@ Java_io_github_a13e300_tools_NativeUtils_nativeGetObjects(JNIEnv *env, jclass, j
     auto arr = env->NewObjectArray(count, env->FindClass("java/lang/Object"), nullptr);
     for (int i = 0; i < count; i++) {
         env->SetObjectArrayElement(arr, i, objects[i]);
-        gJvmtiEnv->SetTag(objects[i], 0);
+        env->DeleteLocalRef(objects[i]);
     }
-    gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char*>(objects));
+    ti->Deallocate(reinterpret_cast<unsigned char*>(objects));
+    return arr;
+}
 
-    for (auto clarr: target_classes) {
-        r = gJvmtiEnv->SetTag(clarr, 0);
+// Instances of several classes from a single heap walk, grouped per requested class.
+// Loaded classes are tagged with the id of the set of requested classes they belong to
+// (with subclasses a class may belong to several), objects then copy that id negated.
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeGetObjectsOfClasses(JNIEnv *env, jclass, jobjectArray targetClasses, jboolean child) {
+    ScopedTagEnv ti{env};
+    if (!ti) return nullptr;
+
+    auto n = env->GetArrayLength(targetClasses);
+    std::vector<jclass> targets(n);
+    for (jsize i = 0; i < n; i++) {
+        targets[i] = (jclass) env->GetObjectArrayElement(targetClasses, i);
+        if (!targets[i]) {
+            env->ThrowNew(env->FindClass("java/lang/NullPointerException"), Format("class %d is null", i).c_str());
+            return nullptr;
+        }
+    }
+
+    jvmtiError r;
+    jint class_count = 0;
+    jclass *classes = nullptr;
+    if (child) {
+        r = ti->GetLoadedClasses(&class_count, &classes);
         if (r) {
-            LOGE("SetTag %s", to_string(r).c_str());
-            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("SetTag: " + to_string(r)).c_str());
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("GetLoadedClasses: " + to_string(r)).c_str());
             return nullptr;
         }
     }
+    auto candidates = child ? std::vector<jclass>(classes, classes + class_count) : targets;
+
+    // the owners of tag t are owners[t - 1]
+    std::map<std::vector<jsize>, jlong> tags;
+    std::vector<std::vector<jsize>> owners;
+    std::vector<std::pair<jclass, jlong>> tagged_classes;
+    r = JVMTI_ERROR_NONE;
+    for (auto c: candidates) {
+        // a class requested twice
+        if (jlong tag; !ti->GetTag(c, &tag) && tag) continue;
+        std::vector<jsize> owner;
+        for (jsize i = 0; i < n; i++) {
+            if (child ? env->IsAssignableFrom(c, targets[i]) : env->IsSameObject(c, targets[i])) owner.push_back(i);
+        }
+        if (owner.empty()) continue;
+        auto [it, inserted] = tags.try_emplace(owner, static_cast<jlong>(tags.size() + 1));
+        if (inserted) owners.push_back(std::move(owner));
+        tagged_classes.emplace_back(c, it->second);
+        if ((r = ti->SetTag(c, it->second))) break;
+    }
 
+    struct {
+        // class objects are tagged already, remember the tag of their class instead
+        jlong class_class_tag = 0;
+    } data;
+    if (!r) {
+        jvmtiHeapCallbacks callbacks{};
+        callbacks.heap_iteration_callback = [](jlong class_tag, jlong size, jlong *tag_ptr, jint length, void *user_data) -> jint {
+            if (class_tag > 0) {
+                if (*tag_ptr > 0) reinterpret_cast<decltype(data) *>(user_data)->class_class_tag = class_tag;
+                else *tag_ptr = -class_tag;
+            }
+            return JVMTI_VISIT_OBJECTS;
+        };
+        // a single exact class lets ART skip every other object
+        auto filter = n == 1 && !child ? targets[0] : nullptr;
+        r = ti->IterateThroughHeap(0, filter, &callbacks, &data);
+    }
+    if (r) {
+        for (jint i = 0; i < class_count; i++) env->DeleteLocalRef(classes[i]);
+        if (classes) ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return nullptr;
+    }
+
+    // one tag per GetObjectsWithTags call, ART scans the whole tag table for every tag
+    std::vector<std::pair<jint, jobject *>> results(owners.size());
+    std::vector<jsize> sizes(n);
+    for (size_t t = 0; t < owners.size(); t++) {
+        jlong tag = -static_cast<jlong>(t + 1);
+        r = ti->GetObjectsWithTags(1, &tag, &results[t].first, &results[t].second, nullptr);
+        if (r) {
+            results[t] = {0, nullptr};
+            LOGE("GetObjectsWithTags: %s", to_string(r).c_str());
+            continue;
+        }
+        for (auto i: owners[t]) sizes[i] += results[t].first;
+    }
+    if (data.class_class_tag) {
+        for (auto i: owners[data.class_class_tag - 1]) sizes[i] += static_cast<jsize>(tagged_classes.size());
+    }
+
+    auto object_class = env->FindClass("java/lang/Object");
+    std::vector<jobjectArray> groups(n);
+    std::vector<jsize> filled(n);
+    for (jsize i = 0; i < n; i++) groups[i] = env->NewObjectArray(sizes[i], object_class, nullptr);
+    for (size_t t = 0; t < owners.size(); t++) {
+        for (jint j = 0; j < results[t].first; j++) {
+            for (auto i: owners[t]) env->SetObjectArrayElement(groups[i], filled[i]++, results[t].second[j]);
+            env->DeleteLocalRef(results[t].second[j]);
+        }
+        if (results[t].second) ti->Deallocate(reinterpret_cast<unsigned char *>(results[t].second));
+    }
+    if (data.class_class_tag) {
+        for (auto &[c, tag]: tagged_classes) {
+            for (auto i: owners[data.class_class_tag - 1]) env->SetObjectArrayElement(groups[i], filled[i]++, c);
+        }
+    }
+    for (jint i = 0; i < class_count; i++) env->DeleteLocalRef(classes[i]);
+    if (classes) ti->Deallocate(reinterpret_cast<unsigned char *>(classes));
+
+    auto arr = env->NewObjectArray(n, env->FindClass("[Ljava/lang/Object;"), nullptr);
+    for (jsize i = 0; i < n; i++) {
+        env->SetObjectArrayElement(arr, i, groups[i]);
+        env->DeleteLocalRef(groups[i]);
+    }
     return arr;
 }
 
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeOpenObjectCursor(JNIEnv *env, jclass, jclass targetClazz, jboolean child, jint pageSize) {
+    auto cursor = ObjectCursor::Create(env, pageSize);
+    if (!cursor) return 0;
+
+    jvmtiError r;
+    std::vector<jclass> target_classes;
+    if (child) {
+        r = getAssignableClasses(env, targetClazz, nullptr, target_classes);
+        if (r) {
+            delete cursor;
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("getAssignableClasses: " + to_string(r)).c_str());
+            return 0;
+        }
+    } else {
+        target_classes.emplace_back(targetClazz);
+    }
+
+    // the cursor env is private, so no lock and no fixed tags are needed
+    constexpr jlong kClassTag = -1;
+    auto ti = cursor->ti();
+    for (auto clarr: target_classes) {
+        r = ti->SetTag(clarr, kClassTag);
+        if (r) {
+            delete cursor;
+            env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("SetTag: " + to_string(r)).c_str());
+            return 0;
+        }
+    }
+
+    struct {
+        ObjectCursor *cursor;
+        jlong count;
+    } data{cursor, 0};
+    jvmtiHeapCallbacks callbacks {};
+    callbacks.heap_iteration_callback = [](jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) -> jint {
+        auto d = reinterpret_cast<decltype(data)*>(user_data);
+        if (class_tag == kClassTag) *tag_ptr = d->cursor->TagForIndex(d->count++);
+        return JVMTI_VISIT_OBJECTS;
+    };
+
+    r = ti->IterateThroughHeap(0, nullptr, &callbacks, &data);
+    if (r) {
+        delete cursor;
+        env->ThrowNew(env->FindClass("java/lang/RuntimeException"), ("IterateThroughHeap: " + to_string(r)).c_str());
+        return 0;
+    }
+    cursor->Commit(data.count);
+    for (auto clarr: target_classes) {
+        ti->SetTag(clarr, 0);
+    }
+    LOGD("object cursor with %lld objects", data.count);
+    return cursor->Handle();
+}
+
 extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_a13e300_tools_NativeUtils_nativeGetAssignableClasses(JNIEnv *env, jclass,
@@ -208,8 +367,6 @@ Java_io_github_a13e300_tools_NativeUtils_nativeGetAssignableClasses(JNIEnv *env,
         return nullptr;
     }
 
-    std::lock_guard lk{g_mutex};
-
     std::vector<jclass> target_classes;
     auto r = getAssignableClasses(env, targetClazz, loader, target_classes);
     if (r) {
@@ -338,24 +495,99 @@ Java_io_github_a13e300_tools_NativeUtils_dumpThread(JNIEnv *env, jclass clazz) {
 #define THROWS(s) env->ThrowNew(env->FindClass("java/lang/RuntimeException"), (s).c_str())
 #define THROWR(s) THROWS(s ": " + std::to_string(r))
 
+namespace {
+    // Reads a primitive local as raw bits: sub-int types and int sign extended, float and
+    // double by their bit pattern, so every primitive fits in one jlong.
+    jvmtiError GetLocalBits(jint depth, char type, jint slot, jlong *bits) {
+        jvmtiError r;
+        switch (type) {
+            case 'Z': case 'B': case 'C': case 'S': case 'I': {
+                jint val;
+                r = gJvmtiEnv->GetLocalInt(nullptr, depth, slot, &val);
+                *bits = val;
+                break;
+            }
+            case 'J':
+                r = gJvmtiEnv->GetLocalLong(nullptr, depth, slot, bits);
+                break;
+            case 'F': {
+                jfloat val;
+                r = gJvmtiEnv->GetLocalFloat(nullptr, depth, slot, &val);
+                jint raw;
+                memcpy(&raw, &val, sizeof(raw));
+                *bits = raw;
+                break;
+            }
+            case 'D': {
+                jdouble val;
+                r = gJvmtiEnv->GetLocalDouble(nullptr, depth, slot, &val);
+                memcpy(bits, &val, sizeof(*bits));
+                break;
+            }
+            default:
+                r = JVMTI_ERROR_TYPE_MISMATCH;
+        }
+        return r;
+    }
+
+    bool IsObjectType(const char *signature) {
+        return signature[0] == '[' || signature[0] == 'L';
+    }
+
+    // Variables of a local variable table which are live at location. The table is freed by
+    // FreeLocalVariables, the entries point into it.
+    std::vector<jvmtiLocalVariableEntry *> LiveVariables(jvmtiLocalVariableEntry *table, jint count, jlocation location) {
+        std::vector<jvmtiLocalVariableEntry *> live;
+        for (jint i = 0; i < count; i++) {
+            auto &v = table[i];
+            if (location >= v.start_location && location < v.start_location + v.length && v.signature && v.signature[0]) {
+                live.push_back(&v);
+            }
+        }
+        return live;
+    }
+
+    void FreeLocalVariables(jvmtiLocalVariableEntry *table, jint count) {
+        for (jint i = 0; i < count; i++) {
+            gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(table[i].name));
+            gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(table[i].signature));
+            gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(table[i].generic_signature));
+        }
+        gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(table));
+    }
+
+    bool HasThis(jmethodID method) {
+        jint modifiers;
+        return !gJvmtiEnv->GetMethodModifiers(method, &modifiers) && !(modifiers & (0x8 /* ACC_STATIC */ | 0x100 /* ACC_NATIVE */));
+    }
+}
+
 extern "C"
 JNIEXPORT jobjectArray JNICALL
 Java_io_github_a13e300_tools_NativeUtils_getFrameVarsNative(JNIEnv *env, jclass clazz, jint nframe) {
+    static jclass class_frame_var = nullptr;
+    static jfieldID field_name, field_sig, field_slot, field_lvalue, field_zvalue, field_bvalue, field_cvalue,
+            field_svalue, field_ivalue, field_jvalue, field_fvalue, field_dvalue;
+    static jmethodID cstr;
+    if (!class_frame_var) {
+        auto frame_var = env->FindClass("io/github/a13e300/tools/NativeUtils$FrameVar");
+        field_name = env->GetFieldID(frame_var, "name", "Ljava/lang/String;");
+        field_sig = env->GetFieldID(frame_var, "sig", "Ljava/lang/String;");
+        field_slot = env->GetFieldID(frame_var, "slot", "I");
+        field_lvalue = env->GetFieldID(frame_var, "lvalue", "Ljava/lang/Object;");
+        field_zvalue = env->GetFieldID(frame_var, "zvalue", "Z");
+        field_bvalue = env->GetFieldID(frame_var, "bvalue", "B");
+        field_cvalue = env->GetFieldID(frame_var, "cvalue", "C");
+        field_svalue = env->GetFieldID(frame_var, "svalue", "S");
+        field_ivalue = env->GetFieldID(frame_var, "ivalue", "I");
+        field_jvalue = env->GetFieldID(frame_var, "jvalue", "J");
+        field_fvalue = env->GetFieldID(frame_var, "fvalue", "F");
+        field_dvalue = env->GetFieldID(frame_var, "dvalue", "D");
+        cstr = env->GetMethodID(frame_var, "<init>", "()V");
+        if (env->ExceptionCheck()) return nullptr;
+        class_frame_var = reinterpret_cast<jclass>(env->NewGlobalRef(frame_var));
+    }
     jvmtiError r;
-    jclass class_frame_var = env->FindClass("io/github/a13e300/tools/NativeUtils$FrameVar");
-    jfieldID field_name = env->GetFieldID(class_frame_var, "name", "Ljava/lang/String;");
-    jfieldID field_sig = env->GetFieldID(class_frame_var, "sig", "Ljava/lang/String;");
-    jfieldID field_slot = env->GetFieldID(class_frame_var, "slot", "I");
-    jfieldID field_lvalue = env->GetFieldID(class_frame_var, "lvalue", "Ljava/lang/Object;");
-    jfieldID field_zvalue = env->GetFieldID(class_frame_var, "zvalue", "Z");
-    jfieldID field_bvalue = env->GetFieldID(class_frame_var, "bvalue", "B");
-    jfieldID field_cvalue = env->GetFieldID(class_frame_var, "cvalue", "C");
-    jfieldID field_svalue = env->GetFieldID(class_frame_var, "svalue", "S");
-    jfieldID field_ivalue = env->GetFieldID(class_frame_var, "ivalue", "I");
-    jfieldID field_jvalue = env->GetFieldID(class_frame_var, "jvalue", "J");
-    jfieldID field_fvalue = env->GetFieldID(class_frame_var, "fvalue", "F");
-    jfieldID field_dvalue = env->GetFieldID(class_frame_var, "dvalue", "D");
-    jmethodID cstr = env->GetMethodID(class_frame_var, "<init>", "()V");
     std::vector<jobject> results;
 
     jint frame_count;
@@ -410,102 +642,53 @@ Java_io_github_a13e300_tools_NativeUtils_getFrameVarsNative(JNIEnv *env, jclass
         LOGE("GetLocalVariableTable %s", to_string(r).c_str());
     } else {
         LOGD("local variable count: %d", local_variable_count);
-        for (jint j = 0; j < local_variable_count; j++) {
-            auto &v = local_variables[j];
-            if (frame.location >= v.start_location &&
-                frame.location < v.start_location + v.length) {
-                LOGD("var %d start %lld length %d name %s signature %s generic %s slot %d",
-                     j, v.start_location, v.length, v.name, v.signature, v.generic_signature, v.slot
-                );
-                auto obj = env->NewObject(class_frame_var, cstr);
-                env->SetObjectField(obj, field_name, env->NewStringUTF(v.name));
-                env->SetObjectField(obj, field_sig, env->NewStringUTF(v.signature));
-                env->SetIntField(obj, field_slot, v.slot);
-
-                if (v.signature && v.signature[0]) {
-                    if (v.signature[0] == '[' || v.signature[0] == 'L') {
-                        jobject val;
-                        r = gJvmtiEnv->GetLocalObject(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalObject: %s", to_string(r).c_str());
-                        } else {
-                            env->SetObjectField(obj, field_lvalue, val);
-                        }
-                    } else if (v.signature[0] == 'Z') {
-                        jint val;
-                        r = gJvmtiEnv->GetLocalInt(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalInt: %s", to_string(r).c_str());
-                        } else {
-                            env->SetBooleanField(obj, field_zvalue, val);
-                        }
-                    } else if (v.signature[0] == 'B') {
-                        jint val;
-                        r = gJvmtiEnv->GetLocalInt(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalInt: %s", to_string(r).c_str());
-                        } else {
-                            env->SetByteField(obj, field_bvalue, val);
-                        }
-                    } else if (v.signature[0] == 'C') {
-                        jint val;
-                        r = gJvmtiEnv->GetLocalInt(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalInt: %s", to_string(r).c_str());
-                        } else {
-                            env->SetCharField(obj, field_cvalue, val);
-                        }
-                    } else if (v.signature[0] == 'S') {
-                        jint val;
-                        r = gJvmtiEnv->GetLocalInt(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalInt: %s", to_string(r).c_str());
-                        } else {
-                            env->SetShortField(obj, field_svalue, val);
-                        }
-                    } else if (v.signature[0] == 'I') {
-                        jint val;
-                        r = gJvmtiEnv->GetLocalInt(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalInt: %s", to_string(r).c_str());
-                        } else {
-                            env->SetIntField(obj, field_ivalue, val);
-                        }
-                    } else if (v.signature[0] == 'J') {
-                        jlong val;
-                        r = gJvmtiEnv->GetLocalLong(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalObject: %s", to_string(r).c_str());
-                        } else {
-                            env->SetLongField(obj, field_jvalue, val);
-                        }
-                    } else if (v.signature[0] == 'F') {
-                        jfloat val;
-                        r = gJvmtiEnv->GetLocalFloat(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalObject: %s", to_string(r).c_str());
-                        } else {
-                            env->SetFloatField(obj, field_fvalue, val);
-                        }
-                    } else if (v.signature[0] == 'D') {
-                        jdouble val;
-                        r = gJvmtiEnv->GetLocalDouble(nullptr, nframe, v.slot, &val);
-                        if (r) {
-                            LOGD("GetLocalObject: %s", to_string(r).c_str());
-                        } else {
-                            env->SetDoubleField(obj, field_dvalue, val);
-                        }
-                    }
+        for (auto v: LiveVariables(local_variables, local_variable_count, frame.location)) {
+            LOGD("var start %lld length %d name %s signature %s generic %s slot %d",
+                 v->start_location, v->length, v->name, v->signature, v->generic_signature, v->slot
+            );
+            jobject val = nullptr;
+            jlong bits = 0;
+            if (IsObjectType(v->signature)) {
+                r = gJvmtiEnv->GetLocalObject(nullptr, nframe, v->slot, &val);
+            } else {
+                r = GetLocalBits(nframe, v->signature[0], v->slot, &bits);
+            }
+            if (r) {
+                LOGD("get local %s: %s", v->name, to_string(r).c_str());
+                continue;
+            }
+            auto obj = env->NewObject(class_frame_var, cstr);
+            env->SetObjectField(obj, field_name, env->NewStringUTF(v->name));
+            env->SetObjectField(obj, field_sig, env->NewStringUTF(v->signature));
+            env->SetIntField(obj, field_slot, v->slot);
+            switch (v->signature[0]) {
+                case 'Z': env->SetBooleanField(obj, field_zvalue, bits != 0); break;
+                case 'B': env->SetByteField(obj, field_bvalue, static_cast<jbyte>(bits)); break;
+                case 'C': env->SetCharField(obj, field_cvalue, static_cast<jchar>(bits)); break;
+                case 'S': env->SetShortField(obj, field_svalue, static_cast<jshort>(bits)); break;
+                case 'I': env->SetIntField(obj, field_ivalue, static_cast<jint>(bits)); break;
+                case 'J': env->SetLongField(obj, field_jvalue, bits); break;
+                case 'F': {
+                    auto raw = static_cast<jint>(bits);
+                    jfloat f;
+                    memcpy(&f, &raw, sizeof(f));
+                    env->SetFloatField(obj, field_fvalue, f);
+                    break;
                 }
-                if (r) {
-                    env->DeleteLocalRef(obj);
-                } else {
-                    results.push_back(obj);
+                case 'D': {
+                    jdouble d;
+                    memcpy(&d, &bits, sizeof(d));
+                    env->SetDoubleField(obj, field_dvalue, d);
+                    break;
                 }
+                default:
+                    env->SetObjectField(obj, field_lvalue, val);
+                    env->DeleteLocalRef(val);
             }
+            results.push_back(obj);
         }
 
-        gJvmtiEnv->Deallocate((unsigned char *) local_variables);
+        FreeLocalVariables(local_variables, local_variable_count);
     }
 
     auto arr = env->NewObjectArray((int) results.size(), class_frame_var, nullptr);
@@ -515,3 +698,141 @@ Java_io_github_a13e300_tools_NativeUtils_getFrameVarsNative(JNIEnv *env, jclass
 
     return arr;
 }
+
+// Live locals of count frames starting at from (all remaining frames if count <= 0) in one
+// call, packed into a NativeUtils$FrameSnapshot: parallel name / signature / slot arrays,
+// primitive values as raw bits in one long[] and references in one Object[], instead of a
+// Java object and a dozen Set*Field calls per variable. All local references live in one
+// local frame sized up front, so none are deleted one by one.
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeGetFrameSnapshot(JNIEnv *env, jclass, jint from, jint count) {
+    static jclass class_snapshot = nullptr;
+    static jmethodID snapshot_init;
+    if (!class_snapshot) {
+        auto snapshot = env->FindClass("io/github/a13e300/tools/NativeUtils$FrameSnapshot");
+        snapshot_init = env->GetMethodID(snapshot, "<init>",
+                                         "([I[Ljava/lang/reflect/Member;[I[Ljava/lang/String;[Ljava/lang/String;[I[J[Ljava/lang/Object;)V");
+        if (env->ExceptionCheck()) return nullptr;
+        class_snapshot = reinterpret_cast<jclass>(env->NewGlobalRef(snapshot));
+    }
+    jint frame_count;
+    auto r = gJvmtiEnv->GetFrameCount(nullptr, &frame_count);
+    if (r) {
+        THROWR("GetFrameCount");
+        return nullptr;
+    }
+    if (from < 0) from += frame_count;
+    if (from < 0 || from >= frame_count) {
+        THROW("invalid frame");
+        return nullptr;
+    }
+    if (count <= 0 || count > frame_count - from) count = frame_count - from;
+    std::vector<jvmtiFrameInfo> frames(count);
+    r = gJvmtiEnv->GetStackTrace(nullptr, from, count, frames.data(), &count);
+    if (r) {
+        THROWR("GetStackTrace");
+        return nullptr;
+    }
+
+    struct Frame {
+        jint table_count = 0;
+        jvmtiLocalVariableEntry *table = nullptr;
+        std::vector<jvmtiLocalVariableEntry *> live;
+        bool has_this;
+    };
+    std::vector<Frame> locals(count);
+    std::vector<jint> depths(count), offsets(count + 1), slots;
+    size_t total = 0;
+    for (jint i = 0; i < count; i++) {
+        auto &frame = locals[i];
+        depths[i] = from + i;
+        offsets[i] = static_cast<jint>(total);
+        frame.has_this = HasThis(frames[i].method);
+        if (!gJvmtiEnv->GetLocalVariableTable(frames[i].method, &frame.table_count, &frame.table)) {
+            frame.live = LiveVariables(frame.table, frame.table_count, frames[i].location);
+        }
+        total += frame.has_this + frame.live.size();
+    }
+    offsets[count] = static_cast<jint>(total);
+
+    auto size = static_cast<jsize>(total);
+    // at most a name, a signature and a value per variable and a method per frame
+    jobject result = nullptr;
+    if (env->PushLocalFrame(3 * size + count + 16) == JNI_OK) {
+        auto string_class = env->FindClass("java/lang/String");
+        auto methods = env->NewObjectArray(count, env->FindClass("java/lang/reflect/Member"), nullptr);
+        auto names = env->NewObjectArray(size, string_class, nullptr);
+        auto sigs = env->NewObjectArray(size, string_class, nullptr);
+        auto objects = env->NewObjectArray(size, env->FindClass("java/lang/Object"), nullptr);
+        std::vector<jlong> values(size);
+        slots.resize(size);
+        std::unordered_map<std::string_view, jstring> strings;
+        auto intern = [&](const char *s) {
+            auto &str = strings[s];
+            if (!str) str = env->NewStringUTF(s);
+            return str;
+        };
+
+        for (jint i = 0; i < count && !env->ExceptionCheck(); i++) {
+            auto &frame = locals[i];
+            auto depth = depths[i];
+            char *method_name;
+            jclass declaring;
+            if (!gJvmtiEnv->GetMethodName(frames[i].method, &method_name, nullptr, nullptr)) {
+                if (strcmp(method_name, "<clinit>") != 0 && !gJvmtiEnv->GetMethodDeclaringClass(frames[i].method, &declaring)) {
+                    jint modifiers = 0;
+                    gJvmtiEnv->GetMethodModifiers(frames[i].method, &modifiers);
+                    auto member = env->ToReflectedMethod(declaring, frames[i].method, (modifiers & 0x8 /* ACC_STATIC */) != 0);
+                    env->SetObjectArrayElement(methods, i, member);
+                    env->DeleteLocalRef(declaring);
+                }
+                gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(method_name));
+            }
+
+            auto index = offsets[i];
+            if (frame.has_this) {
+                env->SetObjectArrayElement(names, index, intern("this"));
+                env->SetObjectArrayElement(sigs, index, intern("this"));
+                jobject thiz = nullptr;
+                if (!gJvmtiEnv->GetLocalInstance(nullptr, depth, &thiz) && thiz) {
+                    env->SetObjectArrayElement(objects, index, thiz);
+                }
+                index++;
+            }
+            for (auto v: frame.live) {
+                env->SetObjectArrayElement(names, index, intern(v->name));
+                env->SetObjectArrayElement(sigs, index, intern(v->signature));
+                slots[index] = v->slot;
+                if (IsObjectType(v->signature)) {
+                    jobject val = nullptr;
+                    r = gJvmtiEnv->GetLocalObject(nullptr, depth, v->slot, &val);
+                    if (!r && val) env->SetObjectArrayElement(objects, index, val);
+                } else {
+                    r = GetLocalBits(depth, v->signature[0], v->slot, &values[index]);
+                }
+                if (r) LOGD("get local %s at %d: %s", v->name, depth, to_string(r).c_str());
+                index++;
+            }
+        }
+
+        if (!env->ExceptionCheck()) {
+            auto depth_arr = env->NewIntArray(count);
+            env->SetIntArrayRegion(depth_arr, 0, count, depths.data());
+            auto offset_arr = env->NewIntArray(count + 1);
+            env->SetIntArrayRegion(offset_arr, 0, count + 1, offsets.data());
+            auto slot_arr = env->NewIntArray(size);
+            env->SetIntArrayRegion(slot_arr, 0, size, slots.data());
+            auto value_arr = env->NewLongArray(size);
+            env->SetLongArrayRegion(value_arr, 0, size, values.data());
+            result = env->NewObject(class_snapshot, snapshot_init, depth_arr, methods, offset_arr, names, sigs, slot_arr,
+                                    value_arr, objects);
+        }
+        result = env->PopLocalFrame(result);
+    }
+
+    for (auto &frame: locals) {
+        if (frame.table) FreeLocalVariables(frame.table, frame.table_count);
+    }
+    return result;
+}
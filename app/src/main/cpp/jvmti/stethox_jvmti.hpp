@@ -0,0 +1,94 @@
+#pragma once
+
+#include "jvmti.h"
+
+#include <string>
+#include <vector>
+
+// null until the agent is attached by NativeUtils.ensureJvmTi
+extern jvmtiEnv *gJvmtiEnv;
+
+std::string to_string(jvmtiError e);
+
+// Creates a jvmtiEnv with the given capabilities. Event callbacks are per environment too,
+// so every profiler owns one and disposing it turns its events off and gives its capabilities
+// back (ART deoptimizes or instruments for some of them). Throws and returns null on failure.
+jvmtiEnv *NewEnv(JNIEnv *env, const jvmtiCapabilities &cap);
+
+// Creates a jvmtiEnv that can tag objects. Tags are per environment, so a query tagging
+// in its own environment neither collides with other queries nor needs to clear its tags
+// one by one: disposing the environment drops them all. Throws and returns null on failure.
+jvmtiEnv *NewTagEnv(JNIEnv *env);
+
+// Appends local references to target and its loaded subtypes (of loader's classes if not
+// null) from the class hierarchy index. JVMTI_ERROR_NOT_AVAILABLE for array classes or
+// without an index, the caller then has to scan the loaded classes itself.
+jvmtiError FindSubtypes(JNIEnv *env, jclass target, jobject loader, std::vector<jclass> &out);
+
+struct HistogramRow {
+    jlong count = 0;
+    jlong bytes = 0;
+};
+
+// Builds a NativeUtils$ClassHistogram sorted by size, rows[i + 1] counts the instances of
+// classes[i] and rows[0] those of unknown classes.
+jobject NewClassHistogram(JNIEnv *env, jvmtiEnv *ti, jclass *classes, const std::vector<HistogramRow> &rows);
+
+class ScopedTagEnv {
+    jvmtiEnv *ti_;
+public:
+    explicit ScopedTagEnv(JNIEnv *env) : ti_(NewTagEnv(env)) {}
+
+    ~ScopedTagEnv() {
+        if (ti_) ti_->DisposeEnvironment();
+    }
+
+    ScopedTagEnv(const ScopedTagEnv &) = delete;
+
+    ScopedTagEnv &operator=(const ScopedTagEnv &) = delete;
+
+    jvmtiEnv *operator->() const { return ti_; }
+
+    jvmtiEnv *get() const { return ti_; }
+
+    explicit operator bool() const { return ti_ != nullptr; }
+};
+
+// Holds a set of objects by tagging them in a private jvmtiEnv, so the set costs neither
+// local nor global references and does not interfere with other tag users. Objects are
+// tagged with their page number and handed out page by page, disposing the environment
+// drops every remaining tag at once.
+class ObjectCursor {
+    jvmtiEnv *ti_ = nullptr;
+    jint page_size_;
+    jlong count_ = 0;
+    jlong next_page_ = 1;
+
+    explicit ObjectCursor(jint page_size) : page_size_(page_size) {}
+
+public:
+    // Throws and returns null if JVMTI is unavailable.
+    static ObjectCursor *Create(JNIEnv *env, jint page_size);
+
+    ~ObjectCursor();
+
+    jvmtiEnv *ti() const { return ti_; }
+
+    // Tags of objects added through IterateThroughHeap must be assigned with TagForIndex,
+    // Commit then records how many were tagged.
+    jlong TagForIndex(jlong index) const { return index / page_size_ + 1; }
+
+    void Commit(jlong count) { count_ = count; }
+
+    // Adds an object unless it is already in the set.
+    jvmtiError Add(jobject obj);
+
+    jlong Count() const { return count_; }
+
+    // Next page of objects which are still alive, or null when exhausted.
+    jobjectArray Next(JNIEnv *env);
+
+    static ObjectCursor *From(jlong handle) { return reinterpret_cast<ObjectCursor*>(handle); }
+
+    jlong Handle() { return reinterpret_cast<jlong>(this); }
+};
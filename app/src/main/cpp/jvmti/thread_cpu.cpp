@@ -0,0 +1,337 @@
+#include "stethox_jvmti.hpp"
+#include "stack_trie.hpp"
+
+#include "logging.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Per-thread CPU accounting. A native thread (not attached to the VM) reads utime + stime of
+// every task in /proc/self/task at a fixed rate, with a stack buffer per file and no
+// allocation, and adds the deltas to a fixed table keyed by tid. Exited threads leave the
+// table after the pass which no longer finds them, only the ones with the most CPU time are
+// kept aside. Java names and stacks are only resolved when a report is asked for, by
+// matching the names of the JVMTI threads with the comm of the tasks.
+namespace {
+    constexpr size_t kMaxThreads = 1024;
+    constexpr size_t kMaxExited = 64;
+
+    struct CpuSlot {
+        pid_t tid = 0;
+        char name[16]{};
+        uint64_t last_ticks = 0;
+        // ticks since the sampler started and in the last interval
+        uint64_t total = 0;
+        uint64_t recent = 0;
+        bool alive = false;
+    };
+
+    // utime + stime and comm of a task, false if it is gone
+    bool ReadTaskStat(int task_dir, const char *tid, char (&name)[16], uint64_t *ticks) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/stat", tid);
+        int fd = openat(task_dir, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        char buf[512];
+        auto n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) return false;
+        buf[n] = 0;
+        // comm may contain spaces and parentheses, it ends at the last ')'
+        auto open = strchr(buf, '(');
+        auto end = strrchr(buf, ')');
+        if (!open || !end || end < open) return false;
+        auto length = std::min<size_t>(end - open - 1, sizeof(name) - 1);
+        memcpy(name, open + 1, length);
+        name[length] = 0;
+        // fields after comm start at 3 (state), utime and stime are 14 and 15
+        auto p = end + 1;
+        for (int field = 3; field < 14 && p; field++) p = strchr(p + 1, ' ');
+        if (!p) return false;
+        char *next;
+        auto utime = strtoull(p + 1, &next, 10);
+        auto stime = strtoull(next, nullptr, 10);
+        *ticks = utime + stime;
+        return true;
+    }
+
+    class ThreadCpuSampler {
+        std::thread thread_;
+        std::mutex wait_lock_;
+        std::condition_variable wake_;
+        bool stop_ = false;
+        uint64_t interval_ms_;
+        bool first_pass_ = true;
+
+        static size_t Home(pid_t tid) {
+            return ((static_cast<uint64_t>(tid) * 0x9e3779b97f4a7c15ull) >> 54) % kMaxThreads;
+        }
+
+        CpuSlot *Find(pid_t tid) {
+            auto start = Home(tid);
+            for (size_t i = 0; i < kMaxThreads; i++) {
+                auto &slot = slots[(start + i) % kMaxThreads];
+                if (slot.tid == tid) return &slot;
+                if (slot.tid == 0) {
+                    slot.tid = tid;
+                    return &slot;
+                }
+            }
+            return nullptr;
+        }
+
+        // backward shift deletion, the probe sequences of the other tids stay intact
+        void Erase(size_t i) {
+            auto j = (i + 1) % kMaxThreads;
+            for (size_t n = 1; n < kMaxThreads && slots[j].tid; n++, j = (j + 1) % kMaxThreads) {
+                // slots[j] can move to i unless its home lies in (i, j]
+                auto home = Home(slots[j].tid);
+                if (i < j ? home <= i || home > j : home <= i && home > j) {
+                    slots[i] = slots[j];
+                    i = j;
+                }
+            }
+            slots[i] = CpuSlot{};
+        }
+
+        void Retire(size_t i) {
+            auto &slot = slots[i];
+            exited_threads++;
+            exited_ticks += slot.total;
+            auto min = std::min_element(std::begin(exited), std::end(exited), [](auto &a, auto &b) { return a.total < b.total; });
+            if (slot.total > min->total) *min = slot;
+            Erase(i);
+        }
+
+        void Sample(DIR *dir) {
+            rewinddir(dir);
+            auto now = NowNanos();
+            std::lock_guard<std::mutex> lk(lock);
+            for (auto &slot: slots) {
+                slot.alive = false;
+                slot.recent = 0;
+            }
+            while (auto entry = readdir(dir)) {
+                if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+                char name[16];
+                uint64_t ticks;
+                if (!ReadTaskStat(dirfd(dir), entry->d_name, name, &ticks)) continue;
+                auto slot = Find(atoi(entry->d_name));
+                if (!slot) {
+                    dropped++;
+                    continue;
+                }
+                memcpy(slot->name, name, sizeof(name));
+                slot->alive = true;
+                // threads already running when the sampler started only count from now on,
+                // a smaller value means the tid was reused by a new thread
+                if (!first_pass_ || slot->last_ticks) {
+                    auto delta = ticks >= slot->last_ticks ? ticks - slot->last_ticks : ticks;
+                    slot->total += delta;
+                    slot->recent = delta;
+                }
+                slot->last_ticks = ticks;
+            }
+            for (size_t i = 0; i < kMaxThreads; i++) {
+                // the erase may shift another exited thread into i
+                while (slots[i].tid && !slots[i].alive) Retire(i);
+            }
+            first_pass_ = false;
+            recent_ns = now - last_ns;
+            last_ns = now;
+        }
+
+        void Run() {
+            auto dir = opendir("/proc/self/task");
+            if (!dir) {
+                LOGE("thread cpu sampler: open /proc/self/task: %s", strerror(errno));
+                return;
+            }
+            std::unique_lock<std::mutex> wait_lk(wait_lock_);
+            while (!stop_) {
+                wait_lk.unlock();
+                Sample(dir);
+                wait_lk.lock();
+                wake_.wait_for(wait_lk, std::chrono::milliseconds(interval_ms_), [this] { return stop_; });
+            }
+            closedir(dir);
+        }
+
+    public:
+        // guards everything below
+        std::mutex lock;
+        CpuSlot slots[kMaxThreads];
+        // the exited threads with the most CPU time
+        CpuSlot exited[kMaxExited];
+        uint64_t exited_threads = 0;
+        uint64_t exited_ticks = 0;
+        uint64_t dropped = 0;
+        uint64_t start_ns;
+        uint64_t last_ns;
+        uint64_t recent_ns = 0;
+
+        explicit ThreadCpuSampler(uint64_t interval_ms) : interval_ms_(interval_ms), start_ns(NowNanos()), last_ns(start_ns) {
+            thread_ = std::thread([this] { Run(); });
+        }
+
+        ~ThreadCpuSampler() {
+            Stop();
+        }
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> lk(wait_lock_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            if (thread_.joinable()) thread_.join();
+        }
+    };
+
+    std::mutex g_thread_cpu_mutex;
+    // the last sampler is kept after stopping so it can still be reported
+    ThreadCpuSampler *g_thread_cpu = nullptr;
+    bool g_thread_cpu_running = false;
+
+    // The comm ART gives the thread of a Java thread (art::SetThreadName): names of at least
+    // 15 chars with a '.' and no '@' keep their last 15 chars, others their first 15.
+    std::string NativeThreadName(const std::string &name) {
+        if (name.size() < 15 || name.find('@') != std::string::npos || name.find('.') == std::string::npos) {
+            return name.substr(0, 15);
+        }
+        return name.substr(name.size() - 15);
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStartThreadCpuSampler(JNIEnv *env, jclass, jlong intervalMs) {
+    std::lock_guard<std::mutex> lk(g_thread_cpu_mutex);
+    if (g_thread_cpu_running) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "thread cpu sampler is running");
+        return;
+    }
+    delete g_thread_cpu;
+    g_thread_cpu = new ThreadCpuSampler(intervalMs > 0 ? intervalMs : 1000);
+    g_thread_cpu_running = true;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeStopThreadCpuSampler(JNIEnv *, jclass) {
+    std::lock_guard<std::mutex> lk(g_thread_cpu_mutex);
+    if (!g_thread_cpu_running) return;
+    g_thread_cpu->Stop();
+    g_thread_cpu_running = false;
+}
+
+// The top threads by CPU time since the sampler started, as a share of one core overall
+// and in the last interval, with the stacks of the Java threads among them.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeThreadCpuReport(JNIEnv *env, jclass, jint top, jint maxFrames, jboolean lines) {
+    std::lock_guard<std::mutex> lk(g_thread_cpu_mutex);
+    if (!g_thread_cpu) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "thread cpu sampler was never started");
+        return nullptr;
+    }
+    auto sampler = g_thread_cpu;
+    std::vector<CpuSlot> slots;
+    // comm -> tid of the live tasks, 0 if several share it
+    std::unordered_map<std::string, pid_t> comms;
+    uint64_t elapsed_ns, recent_ns, dropped, exited_threads, exited_ticks;
+    {
+        std::lock_guard<std::mutex> sampler_lk(sampler->lock);
+        for (auto &slot: sampler->slots) {
+            if (slot.tid && slot.total) slots.push_back(slot);
+            if (slot.tid && slot.alive) {
+                auto [it, inserted] = comms.try_emplace(slot.name, slot.tid);
+                if (!inserted) it->second = 0;
+            }
+        }
+        for (auto &slot: sampler->exited) {
+            if (slot.tid && slot.total) slots.push_back(slot);
+        }
+        exited_threads = sampler->exited_threads;
+        exited_ticks = sampler->exited_ticks;
+        elapsed_ns = sampler->last_ns - sampler->start_ns;
+        recent_ns = sampler->recent_ns;
+        dropped = sampler->dropped;
+    }
+    std::sort(slots.begin(), slots.end(), [](auto &a, auto &b) { return a.total > b.total; });
+    if (top > 0 && slots.size() > static_cast<size_t>(top)) slots.resize(top);
+
+    // tid -> Java thread, by name; names shared by several threads are left unmatched, as
+    // are threads renamed by another thread, whose comm does not follow
+    struct JavaThread {
+        jthread thread;
+        std::string name;
+    };
+    std::unordered_map<pid_t, JavaThread> java_threads;
+    std::vector<pid_t> ambiguous;
+    jint thread_count = 0;
+    jthread *threads = nullptr;
+    if (!gJvmtiEnv->GetAllThreads(&thread_count, &threads)) {
+        for (jint i = 0; i < thread_count; i++) {
+            jvmtiThreadInfo info{};
+            if (gJvmtiEnv->GetThreadInfo(threads[i], &info)) continue;
+            std::string name = info.name ? info.name : "";
+            gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(info.name));
+            env->DeleteLocalRef(info.thread_group);
+            env->DeleteLocalRef(info.context_class_loader);
+            pid_t tid = 0;
+            if (name == "main") {
+                // its comm is the process name
+                tid = getpid();
+            } else if (auto it = comms.find(NativeThreadName(name)); it != comms.end()) {
+                tid = it->second;
+            }
+            if (tid && !java_threads.try_emplace(tid, JavaThread{threads[i], name}).second) ambiguous.push_back(tid);
+        }
+        for (auto tid: ambiguous) java_threads.erase(tid);
+    }
+
+    double ticks_per_second = static_cast<double>(sysconf(_SC_CLK_TCK));
+    auto share = [&](uint64_t ticks, uint64_t ns) {
+        return ns ? static_cast<double>(ticks) / ticks_per_second / (static_cast<double>(ns) / 1e9) * 100 : 0.0;
+    };
+    FrameNames names{env, static_cast<bool>(lines)};
+    auto depth = maxFrames > 0 ? maxFrames : 8;
+    std::vector<jvmtiFrameInfo> frames(depth);
+    auto report = Format("threads by cpu over %s (%% of one core, last interval in brackets)", FormatNanos(elapsed_ns).c_str());
+    auto cpu_time = [&](uint64_t ticks) {
+        return FormatNanos(static_cast<uint64_t>(static_cast<double>(ticks) / ticks_per_second * 1e9));
+    };
+    if (exited_threads) {
+        report += Format(", %llu exited threads used %s", static_cast<unsigned long long>(exited_threads), cpu_time(exited_ticks).c_str());
+    }
+    if (dropped) report += Format(", %llu samples of threads beyond the table dropped", static_cast<unsigned long long>(dropped));
+    for (auto &slot: slots) {
+        // the tid of an exited thread may have been reused
+        auto it = slot.alive ? java_threads.find(slot.tid) : java_threads.end();
+        std::string name = it != java_threads.end() ? it->second.name : slot.name;
+        report += Format("\n%6.1f%% [%5.1f%%] %8s  %s (tid %d)%s", share(slot.total, elapsed_ns), share(slot.recent, recent_ns),
+                         cpu_time(slot.total).c_str(),
+                         name.c_str(), slot.tid, slot.alive ? "" : " exited");
+        jint count;
+        if (it != java_threads.end() && !gJvmtiEnv->GetStackTrace(it->second.thread, 0, depth, frames.data(), &count)) {
+            for (jint i = 0; i < count; i++) report += "\n        at " + names.Name(frames[i].method, frames[i].location);
+        }
+    }
+    for (jint i = 0; i < thread_count; i++) env->DeleteLocalRef(threads[i]);
+    if (threads) gJvmtiEnv->Deallocate(reinterpret_cast<unsigned char *>(threads));
+    return env->NewStringUTF(report.c_str());
+}
@@ -1,6 +1,11 @@
 #include "reflection.hpp"
 
 #include "logging.h"
+#include "utils.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
 
 
 namespace Reflection {
@@ -8,6 +13,10 @@ namespace Reflection {
     // L, V
     jmethodID valueOfMethods[8];
     jmethodID valueMethods[8];
+    jfieldID valueFields[8];
+    // Number.xxxValue(), indexed like valueMethods (no char and boolean)
+    jclass numberClass;
+    jmethodID numberValueMethods[8];
     jclass primitiveClasses[8];
     jmethodID invocationTargetExceptionConstructor;
     jclass invocationTargetExceptionClass;
@@ -74,51 +83,158 @@ namespace Reflection {
         FIND_VALUE_METHOD(7, Double, D, double)
 #undef FIND_VALUE_METHOD
 
+#define FIND_VALUE_FIELD(idx, clazz, type) \
+        valueFields[idx] = env->GetFieldID(primitiveClasses[idx], "value", #type); \
+        CHECK_JNI(!valueFields[idx] || env->ExceptionCheck(), "field %s.value not found", #clazz)
+
+        FIND_VALUE_FIELD(0, Integer, I)
+        FIND_VALUE_FIELD(1, Long, J)
+        FIND_VALUE_FIELD(2, Short, S)
+        FIND_VALUE_FIELD(3, Byte, B)
+        FIND_VALUE_FIELD(4, Character, C)
+        FIND_VALUE_FIELD(5, Boolean, Z)
+        FIND_VALUE_FIELD(6, Float, F)
+        FIND_VALUE_FIELD(7, Double, D)
+#undef FIND_VALUE_FIELD
+
+        auto class_Number = env->FindClass("java/lang/Number");
+        CHECK_JNI(!class_Number || env->ExceptionCheck(), "class java.lang.Number not found")
+        numberClass = reinterpret_cast<jclass>(env->NewGlobalRef(class_Number));
+
+#define FIND_NUMBER_METHOD(idx, type, prefix) \
+        numberValueMethods[idx] = env->GetMethodID(numberClass, #prefix "Value", "()" #type); \
+        CHECK_JNI(!numberValueMethods[idx] || env->ExceptionCheck(), "method Number.%sValue() not found", #prefix)
+
+        FIND_NUMBER_METHOD(0, I, int)
+        FIND_NUMBER_METHOD(1, J, long)
+        FIND_NUMBER_METHOD(2, S, short)
+        FIND_NUMBER_METHOD(3, B, byte)
+        FIND_NUMBER_METHOD(6, F, float)
+        FIND_NUMBER_METHOD(7, D, double)
+#undef FIND_NUMBER_METHOD
+
 #undef CHECK_JNI
         return JNI_VERSION_1_4;
     }
 
-    jobject invokeNonVirtualMethod(JNIEnv *env, jobject method, jclass clazz, jbyteArray types, jobject thiz, jobjectArray argArr) {
-        auto mid = env->FromReflectedMethod(method);
-        auto len = env->GetArrayLength(types);
-        auto typeIds = env->GetByteArrayElements(types, nullptr);
+    // Boxes valueOf must return the same instance for (JLS 5.1.7): -128..127 for the integral
+    // types, '\0'..'\x7f' for char and both booleans. Filled on first use with the instances
+    // of the Java caches, so identity matches boxing in Java.
+    constexpr int kBoxCacheSize = 256;
+    std::atomic<jobject> boxCache[6][kBoxCacheSize];
 
-        jvalue argValues[len - 1];
+    // slot of v in boxCache[typeId], -1 if it is not cached
+    int boxSlot(int typeId, const jvalue &v) {
+        switch (typeId) {
+            case 0: return v.i >= -128 && v.i < 128 ? v.i + 128 : -1;
+            case 1: return v.j >= -128 && v.j < 128 ? static_cast<int>(v.j) + 128 : -1;
+            case 2: return v.s >= -128 && v.s < 128 ? v.s + 128 : -1;
+            case 3: return v.b + 128;
+            case 4: return v.c < 128 ? v.c : -1;
+            case 5: return v.z ? 1 : 0;
+            default: return -1;
+        }
+    }
+
+    // Reads the value field if arg is the box of typeId (box classes are final). Other
+    // numbers are converted through Number.xxxValue() as before, a Character is widened to
+    // int, long, float and double as Method.invoke does. Throws for anything else.
+    bool unbox(JNIEnv *env, int typeId, jobject arg, jvalue &value) {
+        if (env->IsInstanceOf(arg, primitiveClasses[typeId])) {
+            auto field = valueFields[typeId];
+            switch (typeId) {
+                case 0: value.i = env->GetIntField(arg, field); break;
+                case 1: value.j = env->GetLongField(arg, field); break;
+                case 2: value.s = env->GetShortField(arg, field); break;
+                case 3: value.b = env->GetByteField(arg, field); break;
+                case 4: value.c = env->GetCharField(arg, field); break;
+                case 5: value.z = env->GetBooleanField(arg, field); break;
+                case 6: value.f = env->GetFloatField(arg, field); break;
+                case 7: value.d = env->GetDoubleField(arg, field); break;
+            }
+            return true;
+        }
+        // e.g. the Double of every JS number passed from Rhino
+        if (typeId != 5 && env->IsInstanceOf(arg, numberClass)) {
+            switch (typeId) {
+                case 0: value.i = env->CallIntMethod(arg, numberValueMethods[0]); break;
+                case 1: value.j = env->CallLongMethod(arg, numberValueMethods[1]); break;
+                case 2: value.s = env->CallShortMethod(arg, numberValueMethods[2]); break;
+                case 3: value.b = env->CallByteMethod(arg, numberValueMethods[3]); break;
+                case 4: value.c = static_cast<jchar>(env->CallIntMethod(arg, numberValueMethods[0])); break;
+                case 6: value.f = env->CallFloatMethod(arg, numberValueMethods[6]); break;
+                case 7: value.d = env->CallDoubleMethod(arg, numberValueMethods[7]); break;
+            }
+            return !env->ExceptionCheck();
+        }
+        if (env->IsInstanceOf(arg, primitiveClasses[4])) {
+            auto c = env->GetCharField(arg, valueFields[4]);
+            switch (typeId) {
+                case 0: value.i = c; return true;
+                case 1: value.j = c; return true;
+                case 6: value.f = c; return true;
+                case 7: value.d = c; return true;
+            }
+        }
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "argument type mismatch");
+        return false;
+    }
+
+    // valueOf without calling it: cached boxes come from boxCache, others are allocated and
+    // their value field set, as valueOf does for them.
+    jobject box(JNIEnv *env, int typeId, const jvalue &value) {
+        if (auto slot = boxSlot(typeId, value); slot >= 0) {
+            auto &cached = boxCache[typeId][slot];
+            auto obj = cached.load(std::memory_order_acquire);
+            if (!obj) {
+                auto local = env->CallStaticObjectMethodA(primitiveClasses[typeId], valueOfMethods[typeId], &value);
+                if (!local) return nullptr;
+                auto global = env->NewGlobalRef(local);
+                env->DeleteLocalRef(local);
+                if (cached.compare_exchange_strong(obj, global, std::memory_order_acq_rel)) {
+                    obj = global;
+                } else {
+                    env->DeleteGlobalRef(global);
+                }
+            }
+            return env->NewLocalRef(obj);
+        }
+        auto obj = env->AllocObject(primitiveClasses[typeId]);
+        if (!obj) return nullptr;
+        auto field = valueFields[typeId];
+        switch (typeId) {
+            case 0: env->SetIntField(obj, field, value.i); break;
+            case 1: env->SetLongField(obj, field, value.j); break;
+            case 2: env->SetShortField(obj, field, value.s); break;
+            case 3: env->SetByteField(obj, field, value.b); break;
+            case 4: env->SetCharField(obj, field, value.c); break;
+            case 6: env->SetFloatField(obj, field, value.f); break;
+            case 7: env->SetDoubleField(obj, field, value.d); break;
+        }
+        return obj;
+    }
+
+    // Unboxes args by typeIds[1..], calls method and boxes the result by typeIds[0]. Exceptions
+    // thrown by the method are wrapped into an InvocationTargetException.
+    jobject invokeNonVirtual(JNIEnv *env, jmethodID mid, jclass clazz, const jbyte *typeIds, jsize len, jobject thiz, jobjectArray argArr) {
+        jvalue argValues[len > 1 ? len - 1 : 1];
         for (int i = 1; i < len; i++) {
             auto arg = env->GetObjectArrayElement(argArr, i - 1);
             auto typeId = typeIds[i];
-            switch (typeId) {
-                case 0:
-                    argValues[i].i = env->CallIntMethod(arg, valueMethods[0]);
-                    break;
-                case 1:
-                    argValues[i].j = env->CallLongMethod(arg, valueMethods[1]);
-                    break;
-                case 2:
-                    argValues[i].s = env->CallShortMethod(arg, valueMethods[2]);
-                    break;
-                case 3:
-                    argValues[i].b = env->CallByteMethod(arg, valueMethods[3]);
-                    break;
-                case 4:
-                    argValues[i].c = env->CallCharMethod(arg, valueMethods[4]);
-                    break;
-                case 5:
-                    argValues[i].z = env->CallBooleanMethod(arg, valueMethods[5]);
-                    break;
-                case 6:
-                    argValues[i].f = env->CallFloatMethod(arg, valueMethods[6]);
-                    break;
-                case 7:
-                    argValues[i].d = env->CallDoubleMethod(arg, valueMethods[7]);
-                    break;
-                default:
-                    argValues[i].l = arg;
-                    break;
+            if (typeId < 8 && arg == nullptr) {
+                env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "null for primitive argument");
+                return nullptr;
             }
+            auto &value = argValues[i - 1];
+            if (typeId >= 8) {
+                value.l = arg;
+                continue;
+            }
+            auto ok = unbox(env, typeId, arg, value);
+            env->DeleteLocalRef(arg);
+            if (!ok) return nullptr;
         }
         auto retTypeId = typeIds[0];
-        env->ReleaseByteArrayElements(types, typeIds, JNI_ABORT);
 
         jvalue retVal;
 
@@ -151,7 +267,7 @@ namespace Reflection {
                 retVal.l = env->CallNonvirtualObjectMethodA(thiz, clazz, mid, argValues);
                 break;
             case 9:
-                env->CallNonvirtualIntMethodA(thiz, clazz, mid, argValues);
+                env->CallNonvirtualVoidMethodA(thiz, clazz, mid, argValues);
                 break;
         }
 
@@ -165,7 +281,7 @@ namespace Reflection {
         jobject ret;
 
         if (retTypeId >= 0 && retTypeId < 8) {
-            ret = env->CallStaticObjectMethodA(primitiveClasses[retTypeId], valueOfMethods[retTypeId], &retVal);
+            ret = box(env, retTypeId, retVal);
         } else if (retTypeId == 8) {
             ret = retVal.l;
         } else {
@@ -174,6 +290,53 @@ namespace Reflection {
 
         return ret;
     }
+
+    jobject invokeNonVirtualMethod(JNIEnv *env, jobject method, jclass clazz, jbyteArray types, jobject thiz, jobjectArray argArr) {
+        auto mid = env->FromReflectedMethod(method);
+        auto len = env->GetArrayLength(types);
+        jbyte typeIds[len];
+        env->GetByteArrayRegion(types, 0, len, typeIds);
+        return invokeNonVirtual(env, mid, clazz, typeIds, len, thiz, argArr);
+    }
+
+    // Everything invokeNonVirtualMethod resolves per call, resolved once by prepare.
+    struct NonVirtualInvoker {
+        jmethodID method;
+        jclass clazz;
+        std::vector<jbyte> types;
+
+        jlong Handle() { return reinterpret_cast<jlong>(this); }
+    };
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativePrepareNonVirtual(JNIEnv *env, jclass, jobject method, jclass clazz, jbyteArray types) {
+    auto invoker = new Reflection::NonVirtualInvoker{env->FromReflectedMethod(method),
+                                                     reinterpret_cast<jclass>(env->NewGlobalRef(clazz)),
+                                                     std::vector<jbyte>(env->GetArrayLength(types))};
+    env->GetByteArrayRegion(types, 0, static_cast<jsize>(invoker->types.size()), invoker->types.data());
+    return invoker->Handle();
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeInvokePrepared(JNIEnv *env, jclass, jobject, jlong handle, jobject thiz, jobjectArray argArr) {
+    auto invoker = reinterpret_cast<Reflection::NonVirtualInvoker *>(handle);
+    auto argc = static_cast<jsize>(invoker->types.size()) - 1;
+    if ((argArr ? env->GetArrayLength(argArr) : 0) != argc) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), ("expected " + std::to_string(argc) + " arguments").c_str());
+        return nullptr;
+    }
+    return Reflection::invokeNonVirtual(env, invoker->method, invoker->clazz, invoker->types.data(), argc + 1, thiz, argArr);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeClosePrepared(JNIEnv *env, jclass, jlong handle) {
+    auto invoker = reinterpret_cast<Reflection::NonVirtualInvoker *>(handle);
+    env->DeleteGlobalRef(invoker->clazz);
+    delete invoker;
 }
 
 extern "C"
@@ -187,6 +350,72 @@ Java_io_github_a13e300_tools_NativeUtils_invokeNonVirtualInternal(
     return Reflection::invokeNonVirtualMethod(env, method, clazz, types, thiz, argArr);
 }
 
+// Times the marshalling steps of a non-virtual invoke with args of types: unboxing the
+// primitive args through xxxValue() and through the value field, boxing through valueOf and
+// through box (half of the values cached). Whole invokes are timed by the Java caller.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_io_github_a13e300_tools_NativeUtils_nativeBenchmarkInvoke(JNIEnv *env, jclass, jbyteArray types, jobjectArray argArr, jint iterations) {
+    using namespace Reflection;
+    if (iterations <= 0) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "iterations <= 0");
+        return nullptr;
+    }
+    auto len = env->GetArrayLength(types);
+    std::vector<jbyte> typeIds(len);
+    env->GetByteArrayRegion(types, 0, len, typeIds.data());
+    std::vector<std::pair<int, jobject>> primitives;
+    for (jsize i = 1; i < len; i++) {
+        if (typeIds[i] < 8) primitives.emplace_back(typeIds[i], env->GetObjectArrayElement(argArr, i - 1));
+    }
+
+    jvalue value;
+    auto start = NowNanos();
+    for (jint n = 0; n < iterations; n++) {
+        for (auto &[typeId, arg]: primitives) {
+            switch (typeId) {
+                case 0: value.i = env->CallIntMethod(arg, valueMethods[0]); break;
+                case 1: value.j = env->CallLongMethod(arg, valueMethods[1]); break;
+                case 2: value.s = env->CallShortMethod(arg, valueMethods[2]); break;
+                case 3: value.b = env->CallByteMethod(arg, valueMethods[3]); break;
+                case 4: value.c = env->CallCharMethod(arg, valueMethods[4]); break;
+                case 5: value.z = env->CallBooleanMethod(arg, valueMethods[5]); break;
+                case 6: value.f = env->CallFloatMethod(arg, valueMethods[6]); break;
+                case 7: value.d = env->CallDoubleMethod(arg, valueMethods[7]); break;
+            }
+        }
+    }
+    auto unboxCall = NowNanos() - start;
+    start = NowNanos();
+    for (jint n = 0; n < iterations; n++) {
+        for (auto &[typeId, arg]: primitives) unbox(env, typeId, arg, value);
+    }
+    auto unboxField = NowNanos() - start;
+
+    start = NowNanos();
+    for (jint n = 0; n < iterations; n++) {
+        value.i = n % 512 - 256;
+        env->DeleteLocalRef(env->CallStaticObjectMethodA(primitiveClasses[0], valueOfMethods[0], &value));
+    }
+    auto boxCall = NowNanos() - start;
+    start = NowNanos();
+    for (jint n = 0; n < iterations; n++) {
+        value.i = n % 512 - 256;
+        env->DeleteLocalRef(box(env, 0, value));
+    }
+    auto boxCached = NowNanos() - start;
+
+    for (auto &[typeId, arg]: primitives) env->DeleteLocalRef(arg);
+    if (env->ExceptionCheck()) return nullptr;
+
+    auto per = [iterations](uint64_t ns, size_t ops) { return static_cast<double>(ns) / iterations / (ops ? ops : 1); };
+    return env->NewStringUTF(Format("%d iterations, %zu primitive args\n"
+                                    "unbox: xxxValue() %.1f ns/arg, value field %.1f ns/arg\n"
+                                    "box: valueOf %.1f ns, cached/allocated %.1f ns",
+                                    iterations, primitives.size(), per(unboxCall, primitives.size()), per(unboxField, primitives.size()),
+                                    per(boxCall, 1), per(boxCached, 1)).c_str());
+}
+
 extern "C"
 JNIEXPORT jobject JNICALL
 Java_io_github_a13e300_tools_NativeUtils_getCLInit(JNIEnv *env, jclass, jclass target) {
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Single-producer single-consumer ring of trivially copyable events.
+// Push never blocks: when the ring is full the event is dropped and counted.
+template<typename T, size_t kCapacity>
+class SpscRing {
+    static_assert((kCapacity & (kCapacity - 1)) == 0, "capacity must be a power of 2");
+
+    T events_[kCapacity];
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::atomic<uint64_t> dropped_{0};
+
+public:
+    bool Push(const T &event) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == kCapacity) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        events_[tail & (kCapacity - 1)] = event;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Copies at most max events to out and returns the number copied.
+    size_t Drain(T *out, size_t max) {
+        auto head = head_.load(std::memory_order_relaxed);
+        auto tail = tail_.load(std::memory_order_acquire);
+        size_t n = 0;
+        for (; head != tail && n < max; head++, n++) {
+            out[n] = events_[head & (kCapacity - 1)];
+        }
+        head_.store(head, std::memory_order_release);
+        return n;
+    }
+
+    uint64_t TakeDropped() {
+        return dropped_.exchange(0, std::memory_order_relaxed);
+    }
+
+    bool Empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+};
@@ -54,8 +54,12 @@ struct OatFile {
     const std::string location_;
 };
 
+const char *ReadOatPath(jlong addr) {
+    return reinterpret_cast<OatFile*>(addr)->location_.c_str();
+}
+
 extern "C"
 JNIEXPORT jstring JNICALL
 Java_io_github_a13e300_tools_NativeUtils_nativeReadOatPath(JNIEnv *env, jclass , jlong addr) {
-    return env->NewStringUTF(reinterpret_cast<OatFile*>(addr)->location_.c_str());
+    return env->NewStringUTF(ReadOatPath(addr));
 }
@@ -1,6 +1,10 @@
 #include <sys/mman.h>
 #include <cerrno>
 #include <unistd.h>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
 #include "utils.h"
 
 // https://stackoverflow.com/a/68051325
@@ -12,4 +16,33 @@ bool is_pointer_valid(void *p) {
     /* call msync, if it returns non-zero, return false */
     int ret = msync(base, page_size, MS_ASYNC) != -1;
     return ret ? ret : errno != ENOMEM;
-}
\ No newline at end of file
+}
+std::string Format(const char* fmt, ...) {
+    va_list ap;
+    char buf[1024];
+    va_start(ap, fmt);
+    vsnprintf(buf, 1024, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+uint64_t NowNanos() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+std::string FormatNanos(uint64_t ns) {
+    if (ns >= 1000000000ull) return Format("%.2fs", ns / 1e9);
+    if (ns >= 1000000ull) return Format("%.2fms", ns / 1e6);
+    return Format("%.1fus", ns / 1e3);
+}
+
+std::string DescriptorToName(const char *descriptor) {
+    std::string name = descriptor;
+    if (name.size() > 2 && name.front() == 'L' && name.back() == ';') {
+        name = name.substr(1, name.size() - 2);
+    }
+    std::replace(name.begin(), name.end(), '/', '.');
+    return name;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <string>
 #include <sys/system_properties.h>
 
 inline auto GetAndroidApiLevel() {
@@ -15,3 +17,13 @@ inline auto GetAndroidApiLevel() {
 }
 
 bool is_pointer_valid(void *p);
+
+std::string Format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+uint64_t NowNanos();
+
+// 1.50s, 2.25ms or 12.0us
+std::string FormatNanos(uint64_t ns);
+
+// Lcom/example/Foo; -> com.example.Foo, arrays keep the Class.getName() form
+std::string DescriptorToName(const char *descriptor);
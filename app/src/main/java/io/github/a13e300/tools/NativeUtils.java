@@ -5,11 +5,17 @@ import android.os.Build;
 import android.os.Debug;
 import android.util.Log;
 
+import java.io.Closeable;
+import java.io.IOException;
 import java.lang.reflect.Array;
+import java.lang.reflect.Field;
 import java.lang.reflect.InvocationTargetException;
 import java.lang.reflect.Member;
 import java.lang.reflect.Method;
 import java.lang.reflect.Modifier;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.Locale;
 
 import dalvik.annotation.optimization.FastNative;
 import dalvik.system.BaseDexClassLoader;
@@ -35,6 +41,18 @@ public class NativeUtils {
 
     public static native void monitorClasses(boolean enabled);
 
+    /**
+     * Take at most max recorded class prepare events (oldest first), formatted as lines.
+     */
+    public static native String[] drainClassEvents(int max);
+
+    /**
+     * Enabling resets the previous profile.
+     */
+    public static native void profileClassLoading(boolean enabled);
+
+    public static native String getClassLoadProfile(int top);
+
     private static native int nativeSetJavaDebug(boolean allow, int orig);
     private static native boolean nativeSetJdwp(boolean allow, boolean orig);
 
@@ -69,8 +87,117 @@ public class NativeUtils {
         return nativeGetAssignableClasses(clazz, loader);
     }
 
+    /**
+     * Instances of several classes found in a single heap walk.
+     * @return instances of classes[i] (and of its subclasses if child) at index i
+     */
+    public static Object[][] getObjectsOfClasses(Class<?>[] classes, boolean child) {
+        ensureJvmTi();
+        return nativeGetObjectsOfClasses(classes, child);
+    }
+
     private static native Object[] nativeGetObjects(Class<?> clazz, boolean child);
 
+    private static native Object[][] nativeGetObjectsOfClasses(Class<?>[] classes, boolean child);
+
+    /**
+     * A result set held natively (as JVMTI tags of a private environment) and pulled page by page,
+     * so large results neither overflow the local reference table nor live twice in memory.
+     * Objects collected after the cursor was opened are skipped.
+     */
+    public static final class ObjectCursor implements Closeable {
+        private long mHandle;
+
+        private ObjectCursor(long handle) {
+            mHandle = handle;
+        }
+
+        /**
+         * @return the next page (at most pageSize objects), or null if there is no more objects.
+         */
+        public synchronized Object[] next() {
+            if (mHandle == 0) throw new IllegalStateException("cursor is closed");
+            return nativeCursorNext(mHandle);
+        }
+
+        /**
+         * @return number of objects when the cursor was opened
+         */
+        public synchronized long count() {
+            if (mHandle == 0) throw new IllegalStateException("cursor is closed");
+            return nativeCursorCount(mHandle);
+        }
+
+        @Override
+        public synchronized void close() {
+            if (mHandle == 0) return;
+            nativeCursorClose(mHandle);
+            mHandle = 0;
+        }
+
+        @Override
+        protected void finalize() throws Throwable {
+            close();
+            super.finalize();
+        }
+    }
+
+    public static ObjectCursor openObjectCursor(Class<?> clazz, boolean child, int pageSize) {
+        ensureJvmTi();
+        return new ObjectCursor(nativeOpenObjectCursor(clazz, child, pageSize));
+    }
+
+    public static ObjectCursor openClassLoaderCursor(int pageSize) {
+        ensureJvmTi();
+        return new ObjectCursor(nativeOpenClassLoaderCursor(pageSize));
+    }
+
+    public static ObjectCursor openGlobalRefCursor(Class<?> clazz, int pageSize) {
+        ensureJvmTi();
+        return new ObjectCursor(nativeOpenGlobalRefCursor(clazz, pageSize));
+    }
+
+    public static final int SEARCH_STRINGS = 1;
+    public static final int SEARCH_BYTE_ARRAYS = 2;
+    public static final int SEARCH_CHAR_ARRAYS = 4;
+
+    /**
+     * Opens a cursor over the objects whose contents contain any of the patterns, in one heap pass.
+     * @param kinds which objects to search, a combination of {@link #SEARCH_STRINGS},
+     *              {@link #SEARCH_BYTE_ARRAYS} (searched as UTF-8) and {@link #SEARCH_CHAR_ARRAYS}
+     * @param max stop after max matches, 0 for no limit
+     */
+    public static ObjectCursor searchHeap(String[] patterns, int kinds, long max, int pageSize) {
+        ensureJvmTi();
+        return new ObjectCursor(nativeSearchHeap(patterns, kinds, max, pageSize));
+    }
+
+    private static native long nativeSearchHeap(String[] patterns, int kinds, long max, int pageSize);
+
+    /**
+     * Finds duplicated Strings and primitive arrays in one heap pass: the bytes wasted by the
+     * copies and the top duplicated values by wasted bytes.
+     * @param top number of values to list, 0 for 20
+     */
+    public static String duplicates(int top) {
+        ensureJvmTi();
+        return nativeDuplicateReport(top);
+    }
+
+    private static native String nativeDuplicateReport(int top);
+
+    private static native long nativeOpenObjectCursor(Class<?> clazz, boolean child, int pageSize);
+
+    private static native long nativeOpenClassLoaderCursor(int pageSize);
+
+    private static native long nativeOpenGlobalRefCursor(Class<?> clazz, int pageSize);
+
+    private static native Object[] nativeCursorNext(long handle);
+
+    private static native long nativeCursorCount(long handle);
+
+    private static native void nativeCursorClose(long handle);
+
     private static native Class<?>[] nativeGetAssignableClasses(Class<?> clazz, ClassLoader loader);
 
     private static native void dumpThread();
@@ -100,8 +227,724 @@ public class NativeUtils {
         return getFrameVarsNative(nframe);
     }
 
+    /**
+     * Live locals of several frames. The variables of frame i are
+     * [offsets[i], offsets[i + 1]), "this" comes first with the signature "this".
+     */
+    public static final class FrameSnapshot {
+        public final int[] depths;
+        /** null for class initializers */
+        public final Member[] methods;
+        public final int[] offsets;
+        public final String[] names;
+        public final String[] sigs;
+        public final int[] slots;
+        /** primitive values as raw bits, see {@link #value} */
+        public final long[] values;
+        public final Object[] objects;
+
+        FrameSnapshot(int[] depths, Member[] methods, int[] offsets, String[] names, String[] sigs, int[] slots, long[] values, Object[] objects) {
+            this.depths = depths;
+            this.methods = methods;
+            this.offsets = offsets;
+            this.names = names;
+            this.sigs = sigs;
+            this.slots = slots;
+            this.values = values;
+            this.objects = objects;
+        }
+
+        /**
+         * Value of variable i, primitives boxed.
+         */
+        public Object value(int i) {
+            switch (sigs[i].charAt(0)) {
+                case 'Z': return values[i] != 0;
+                case 'B': return (byte) values[i];
+                case 'C': return (char) values[i];
+                case 'S': return (short) values[i];
+                case 'I': return (int) values[i];
+                case 'J': return values[i];
+                case 'F': return Float.intBitsToFloat((int) values[i]);
+                case 'D': return Double.longBitsToDouble(values[i]);
+                default: return objects[i];
+            }
+        }
+
+        /**
+         * Index of variable name in frame i, -1 if it is not live.
+         */
+        public int find(int frame, String name) {
+            for (int i = offsets[frame]; i < offsets[frame + 1]; i++) {
+                if (names[i].equals(name)) return i;
+            }
+            return -1;
+        }
+
+        @Override
+        public String toString() {
+            var sb = new StringBuilder();
+            for (int f = 0; f < depths.length; f++) {
+                if (f > 0) sb.append('\n');
+                sb.append('#').append(depths[f]).append(' ').append(methods[f]);
+                for (int i = offsets[f]; i < offsets[f + 1]; i++) {
+                    sb.append("\n    ").append(sigs[i]).append(' ').append(names[i]).append(" = ").append(value(i));
+                }
+            }
+            return sb.toString();
+        }
+    }
+
+    private static native FrameSnapshot nativeGetFrameSnapshot(int from, int count);
+
+    /**
+     * Live locals of count frames starting at from (negative counts from the bottom of the
+     * stack, like {@link #getFrameVars}) in one native call, count <= 0 for all remaining frames.
+     */
+    public static FrameSnapshot getFrameSnapshot(int from, int count) {
+        ensureJvmTi();
+        return nativeGetFrameSnapshot(from, count);
+    }
+
     public static native Object[] getGlobalRefs(Class<?> clazz);
 
+    /**
+     * Number of JNI global and weak global references per class, sorted by total count.
+     * Use {@link #diff} on two censuses to find leaking references.
+     */
+    public static final class GlobalRefCensus {
+        private static final String[] ROOT_TYPES = {
+                "Unknown", "JNIGlobal", "JNILocal", "JavaFrame", "NativeStack", "StickyClass",
+                "ThreadBlock", "MonitorUsed", "ThreadObject", "InternedString", "Finalizing",
+                "Debugger", "ReferenceCleanup", "VMInternal", "JNIMonitor", "JNIWeakGlobal",
+                "ClearedJNIWeakGlobal"
+        };
+
+        public final String[] classes;
+        public final int[] globals;
+        public final int[] weakGlobals;
+        /**
+         * count per art::RootType, followed by the number of live weak globals and the number
+         * of cleared weak globals (not counted in any class)
+         */
+        public final int[] rootTypes;
+
+        GlobalRefCensus(String[] classes, int[] globals, int[] weakGlobals, int[] rootTypes) {
+            this.classes = classes;
+            this.globals = globals;
+            this.weakGlobals = weakGlobals;
+            this.rootTypes = rootTypes;
+        }
+
+        /**
+         * @return changes from `before` to this census, sorted by the absolute change
+         */
+        public GlobalRefCensus diff(GlobalRefCensus before) {
+            var old = new HashMap<String, int[]>();
+            for (int i = 0; i < before.classes.length; i++) {
+                old.put(before.classes[i], new int[]{before.globals[i], before.weakGlobals[i]});
+            }
+            var rows = new ArrayList<Object[]>();
+            for (int i = 0; i < classes.length; i++) {
+                var o = old.remove(classes[i]);
+                int g = globals[i] - (o == null ? 0 : o[0]);
+                int w = weakGlobals[i] - (o == null ? 0 : o[1]);
+                if (g != 0 || w != 0) rows.add(new Object[]{classes[i], g, w});
+            }
+            for (var e : old.entrySet()) {
+                rows.add(new Object[]{e.getKey(), -e.getValue()[0], -e.getValue()[1]});
+            }
+            rows.sort((a, b) -> Integer.compare(
+                    Math.abs((int) b[1]) + Math.abs((int) b[2]), Math.abs((int) a[1]) + Math.abs((int) a[2])));
+            var names = new String[rows.size()];
+            var g = new int[rows.size()];
+            var w = new int[rows.size()];
+            for (int i = 0; i < rows.size(); i++) {
+                names[i] = (String) rows.get(i)[0];
+                g[i] = (int) rows.get(i)[1];
+                w[i] = (int) rows.get(i)[2];
+            }
+            var types = new int[rootTypes.length];
+            for (int i = 0; i < types.length && i < before.rootTypes.length; i++) {
+                types[i] = rootTypes[i] - before.rootTypes[i];
+            }
+            return new GlobalRefCensus(names, g, w, types);
+        }
+
+        public String toString(int top) {
+            var sb = new StringBuilder("roots:");
+            for (int i = 0; i < rootTypes.length && i < ROOT_TYPES.length; i++) {
+                if (rootTypes[i] != 0) sb.append(' ').append(ROOT_TYPES[i]).append('=').append(rootTypes[i]);
+            }
+            sb.append("\n  globals    weak  class");
+            for (int i = 0; i < classes.length && i < top; i++) {
+                sb.append(String.format(Locale.ROOT, "\n%9d %7d  %s", globals[i], weakGlobals[i], classes[i]));
+            }
+            if (classes.length > top) sb.append("\n  ... ").append(classes.length - top).append(" more classes");
+            return sb.toString();
+        }
+
+        @Override
+        public String toString() {
+            return toString(30);
+        }
+    }
+
+    private static native GlobalRefCensus nativeGlobalRefCensus();
+
+    public static GlobalRefCensus globalRefCensus() {
+        return nativeGlobalRefCensus();
+    }
+
+    public static final int QUERY_CLASS_LOADERS = 1;
+    public static final int QUERY_CLASSES = 2;
+    public static final int QUERY_GLOBAL_REFS = 4;
+    public static final int QUERY_OAT_PATHS = 8;
+
+    /**
+     * Result of {@link #query}. Fields that were not queried are null.
+     */
+    public static final class QueryResult {
+        public final ClassLoader[] classLoaders;
+        /** OAT paths of each class loader (null for non-dex loaders), parallel to classLoaders */
+        public final String[] oatPaths;
+        public final Class<?>[] classes;
+        public final Object[] globalRefs;
+        /** the class visit stopped at maxHoldNanos, classes is incomplete */
+        public final boolean truncated;
+        /** time the class linker lock was held */
+        public final long holdNanos;
+
+        QueryResult(ClassLoader[] classLoaders, String[] oatPaths, Class<?>[] classes, Object[] globalRefs, boolean truncated, long holdNanos) {
+            this.classLoaders = classLoaders;
+            this.oatPaths = oatPaths;
+            this.classes = classes;
+            this.globalRefs = globalRefs;
+            this.truncated = truncated;
+            this.holdNanos = holdNanos;
+        }
+    }
+
+    private static native QueryResult nativeQuery(int queries, Class<?> rootClass, long maxHoldNanos);
+
+    /**
+     * Runs several QUERY_* queries in a single native call, so the runtime state transition
+     * and the class linker lock are paid once instead of once per query.
+     * @param rootClass only return global refs that are instances of it, null for all
+     * @param maxHoldNanos upper bound of the time the class linker lock is held, 0 for unlimited
+     */
+    public static QueryResult query(int queries, Class<?> rootClass, long maxHoldNanos) {
+        return nativeQuery(queries, rootClass, maxHoldNanos);
+    }
+
+    /**
+     * Instance count and shallow size per class of the whole heap, sorted by size.
+     */
+    public static final class ClassHistogram {
+        public final String[] classes;
+        public final long[] counts;
+        public final long[] bytes;
+
+        ClassHistogram(String[] classes, long[] counts, long[] bytes) {
+            this.classes = classes;
+            this.counts = counts;
+            this.bytes = bytes;
+        }
+
+        public String toString(int top) {
+            long totalCount = 0, totalBytes = 0;
+            for (int i = 0; i < classes.length; i++) {
+                totalCount += counts[i];
+                totalBytes += bytes[i];
+            }
+            var sb = new StringBuilder(String.format(Locale.ROOT,
+                    "%d objects, %d bytes, %d classes\n   instances       bytes  class", totalCount, totalBytes, classes.length));
+            for (int i = 0; i < classes.length && i < top; i++) {
+                sb.append(String.format(Locale.ROOT, "\n%11d %11d  %s", counts[i], bytes[i], classes[i]));
+            }
+            if (classes.length > top) sb.append("\n  ... ").append(classes.length - top).append(" more classes");
+            return sb.toString();
+        }
+
+        @Override
+        public String toString() {
+            return toString(30);
+        }
+    }
+
+    /**
+     * A reference path found by {@link #findPaths}, objects[0] is a GC root (or the start object).
+     */
+    public static final class HeapPath {
+        public static final int KIND_FIELD = 2;
+        public static final int KIND_ARRAY_ELEMENT = 3;
+        public static final int KIND_STATIC_FIELD = 8;
+
+        public final Object[] objects;
+        /**
+         * jvmtiHeapReferenceKind of the reference to objects[i], kinds[0] is the root kind or 0 for the start object
+         */
+        public final int[] kinds;
+        /**
+         * array index, stack depth for local roots, or JVMTI field index
+         */
+        public final int[] indices;
+        /**
+         * the field of field references, null otherwise
+         */
+        public final Field[] fields;
+
+        HeapPath(Object[] objects, int[] kinds, int[] indices, Field[] fields) {
+            this.objects = objects;
+            this.kinds = kinds;
+            this.indices = indices;
+            this.fields = fields;
+        }
+
+        public static String kindName(int kind) {
+            switch (kind) {
+                case 0: return "Start";
+                case 1: return "Class";
+                case KIND_FIELD: return "Field";
+                case KIND_ARRAY_ELEMENT: return "ArrayElement";
+                case 4: return "ClassLoader";
+                case 5: return "Signers";
+                case 6: return "ProtectionDomain";
+                case 7: return "Interface";
+                case KIND_STATIC_FIELD: return "StaticField";
+                case 9: return "ConstantPool";
+                case 10: return "Superclass";
+                case 21: return "JNIGlobal";
+                case 22: return "SystemClass";
+                case 23: return "Monitor";
+                case 24: return "StackLocal";
+                case 25: return "JNILocal";
+                case 26: return "Thread";
+                default: return "Other";
+            }
+        }
+
+        @Override
+        public String toString() {
+            var sb = new StringBuilder("HeapPath{len=").append(objects.length - 1);
+            for (int i = 0; i < objects.length; i++) {
+                sb.append("\n  ").append(kindName(kinds[i]));
+                if (fields[i] != null) sb.append(' ').append(fields[i]);
+                else if (kinds[i] == KIND_ARRAY_ELEMENT) sb.append(' ').append(indices[i]);
+                sb.append(": ");
+                var o = objects[i];
+                sb.append(o == null ? "<collected>" : o.getClass().getName() + "@" + Integer.toHexString(System.identityHashCode(o)));
+            }
+            return sb.append("\n}").toString();
+        }
+    }
+
+    private static native HeapPath[] nativeFindPaths(Object start, Object target, Class<?> targetClass, int maxDepth, int maxResults);
+
+    /**
+     * Shortest reference paths to the target object or to instances of targetClass (one of them
+     * must be given), found natively by a breadth first search over the heap graph.
+     * @param start search from this object, or from the GC roots if null
+     * @param maxDepth maximum path length, 0 for unlimited
+     * @return at most maxResults paths, shortest first
+     */
+    public static HeapPath[] findPaths(Object start, Object target, Class<?> targetClass, int maxDepth, int maxResults) {
+        ensureJvmTi();
+        return nativeFindPaths(start, target, targetClass, maxDepth, maxResults);
+    }
+
+    /**
+     * Dominator tree of the reachable heap with retained sizes, built natively from one heap walk.
+     * The tree lives in native memory (see {@link #stats()}) until closed, objects allocated after
+     * it was built are not part of it.
+     */
+    public static final class DominatorTree implements Closeable {
+        private long mHandle;
+
+        private DominatorTree(long handle) {
+            mHandle = handle;
+        }
+
+        private void check() {
+            if (mHandle == 0) throw new IllegalStateException("dominator tree is closed");
+        }
+
+        /**
+         * @param parent an object, or null for the objects dominated only by the GC roots
+         * @return at most n objects immediately dominated by parent, largest retained size first
+         */
+        public synchronized Object[] top(Object parent, int n) {
+            check();
+            return nativeDominatorTop(mHandle, parent, n);
+        }
+
+        /**
+         * @return retained size in bytes, -1 if obj was not reachable when the tree was built
+         */
+        public synchronized long retainedSize(Object obj) {
+            check();
+            return nativeDominatorSizes(mHandle, new Object[]{obj})[0];
+        }
+
+        /**
+         * @return the top n retainers with their retained and shallow sizes, one per line
+         */
+        public synchronized String toString(Object parent, int n) {
+            check();
+            var objects = nativeDominatorTop(mHandle, parent, n);
+            var sizes = nativeDominatorSizes(mHandle, objects);
+            var sb = new StringBuilder(nativeDominatorStats(mHandle)).append("\n   retained     shallow  object");
+            for (int i = 0; i < objects.length; i++) {
+                var o = objects[i];
+                sb.append(String.format(Locale.ROOT, "\n%11d %11d  %s", sizes[i * 2], sizes[i * 2 + 1],
+                        o == null ? "<collected>" : o.getClass().getName() + "@" + Integer.toHexString(System.identityHashCode(o))));
+            }
+            return sb.toString();
+        }
+
+        /**
+         * @return object and edge counts, build time and native memory used
+         */
+        public synchronized String stats() {
+            check();
+            return nativeDominatorStats(mHandle);
+        }
+
+        @Override
+        public String toString() {
+            return mHandle == 0 ? "DominatorTree{closed}" : toString(null, 30);
+        }
+
+        @Override
+        public synchronized void close() {
+            if (mHandle == 0) return;
+            nativeDominatorClose(mHandle);
+            mHandle = 0;
+        }
+
+        @Override
+        protected void finalize() throws Throwable {
+            close();
+            super.finalize();
+        }
+    }
+
+    public static DominatorTree buildDominatorTree() {
+        ensureJvmTi();
+        return new DominatorTree(nativeBuildDominatorTree());
+    }
+
+    private static native long nativeBuildDominatorTree();
+
+    private static native Object[] nativeDominatorTop(long handle, Object parent, int n);
+
+    /**
+     * retained and shallow sizes of objects[i] at 2 * i and 2 * i + 1
+     */
+    private static native long[] nativeDominatorSizes(long handle, Object[] objects);
+
+    private static native String nativeDominatorStats(long handle);
+
+    private static native void nativeDominatorClose(long handle);
+
+    private static native String[] nativeDumpHeap(String path, boolean compress, long chunkSize);
+
+    /**
+     * Streams an HPROF heap dump of the reachable objects from the JVMTI agent. All threads are
+     * suspended during the walk, which waits for the writer thread when compression or I/O falls
+     * behind; every object is tagged, so native memory grows with the number of objects.
+     * @param compress gzip the output, every file is a complete gzip member
+     * @param chunkSize start a new file (path.1, path.2 ...) after about this many bytes, 0 for a single file
+     * @return the files written, concatenating them gives the whole dump
+     */
+    public static String[] dumpHeap(String path, boolean compress, long chunkSize) throws IOException {
+        ensureJvmTi();
+        return nativeDumpHeap(path, compress, chunkSize);
+    }
+
+    private static native ClassHistogram nativeClassHistogram();
+
+    public static ClassHistogram classHistogram() {
+        ensureJvmTi();
+        return nativeClassHistogram();
+    }
+
+    private static native int nativeMarkGeneration();
+
+    private static native void nativeResetGenerations();
+
+    private static native ClassHistogram nativeGenerationDiff(int since, Class<?> clazz, boolean child, int max, Object[][] out);
+
+    /**
+     * Tags every live object which has no generation yet with a new generation, in one heap pass.
+     * @return the new generation, starting at 1
+     */
+    public static int markGeneration() {
+        ensureJvmTi();
+        return nativeMarkGeneration();
+    }
+
+    /**
+     * Drops all generation tags.
+     */
+    public static void resetGenerations() {
+        ensureJvmTi();
+        nativeResetGenerations();
+    }
+
+    /**
+     * Live objects allocated after generation since was marked, grouped by class. Objects
+     * allocated after the last mark are counted too.
+     */
+    public static ClassHistogram generationDiff(int since) {
+        ensureJvmTi();
+        return nativeGenerationDiff(since, null, false, 0, null);
+    }
+
+    /**
+     * At most max live instances of clazz (and of its subclasses if child) allocated after
+     * generation since was marked.
+     */
+    public static Object[] generationObjects(int since, Class<?> clazz, boolean child, int max) {
+        ensureJvmTi();
+        var out = new Object[1][];
+        nativeGenerationDiff(since, clazz, child, max, out);
+        return out[0] == null ? new Object[0] : out[0];
+    }
+
+    private static native void nativeStartAllocationTracking(long intervalBytes, int maxDepth);
+
+    private static native void nativeStopAllocationTracking();
+
+    private static native int nativeDumpAllocations(String path, boolean bytes, boolean lines);
+
+    /**
+     * Starts sampling allocations with their stacks, dropping the samples of the previous run.
+     * @param intervalBytes mean number of bytes allocated by a thread between two samples, 0 samples every allocation
+     * @param maxDepth frames kept per stack, 0 for the maximum (128)
+     */
+    public static void startAllocationTracking(long intervalBytes, int maxDepth) {
+        ensureJvmTi();
+        nativeStartAllocationTracking(intervalBytes, maxDepth);
+    }
+
+    public static void stopAllocationTracking() {
+        ensureJvmTi();
+        nativeStopAllocationTracking();
+    }
+
+    /**
+     * Writes the allocation samples as collapsed stacks (for flamegraph.pl or speedscope), each
+     * ending with the allocated class. Can be called while tracking.
+     * @param bytes weight stacks by the bytes allocated between samples instead of by sample count
+     * @param lines add line numbers to the frames
+     * @return number of distinct stacks written
+     */
+    public static int dumpAllocations(String path, boolean bytes, boolean lines) throws IOException {
+        ensureJvmTi();
+        return nativeDumpAllocations(path, bytes, lines);
+    }
+
+    private static native void nativeStartCpuProfiling(long intervalMicros, int maxDepth, boolean allThreads, boolean lines);
+
+    private static native void nativeStopCpuProfiling();
+
+    private static native int nativeDumpCpuProfile(String path, boolean chrome);
+
+    /**
+     * Starts sampling the stacks of all threads from a native thread, dropping the previous profile.
+     * @param intervalMicros sampling interval, 0 for 10ms
+     * @param maxDepth frames kept per stack, 0 for 128
+     * @param allThreads also sample threads which are blocked, waiting or in native code
+     * @param lines count the lines of a method separately
+     */
+    public static void startCpuProfiling(long intervalMicros, int maxDepth, boolean allThreads, boolean lines) {
+        ensureJvmTi();
+        nativeStartCpuProfiling(intervalMicros, maxDepth, allThreads, lines);
+    }
+
+    public static void stopCpuProfiling() {
+        ensureJvmTi();
+        nativeStopCpuProfiling();
+    }
+
+    /**
+     * Writes the running or the last profile, as a Chrome DevTools .cpuprofile if chrome, as
+     * collapsed stacks (for flamegraph.pl or speedscope) otherwise.
+     * @return number of samples
+     */
+    public static int dumpCpuProfile(String path, boolean chrome) throws IOException {
+        ensureJvmTi();
+        return nativeDumpCpuProfile(path, chrome);
+    }
+
+    private static native void nativeStartMonitorProfiling(int maxDepth, boolean owners, boolean waits);
+
+    private static native void nativeStopMonitorProfiling();
+
+    private static native String nativeMonitorContentionReport(int top, int maxFrames, boolean lines);
+
+    private static native int nativeDumpMonitorContention(String path, int kind, boolean lines);
+
+    public static final int MONITOR_ACQUIRING = 0;
+    public static final int MONITOR_OWNER = 1;
+    public static final int MONITOR_WAITING = 2;
+
+    /**
+     * Starts recording the time threads block on contended monitors, dropping the previous data.
+     * @param maxDepth frames kept per stack, 0 for the maximum (64)
+     * @param owners also record the stack of the owner when a thread starts to block, which
+     *               costs a stack walk of the owner per contention
+     * @param waits also record Object.wait, which is not only paid on contention
+     */
+    public static void startMonitorProfiling(int maxDepth, boolean owners, boolean waits) {
+        ensureJvmTi();
+        nativeStartMonitorProfiling(maxDepth, owners, waits);
+    }
+
+    public static void stopMonitorProfiling() {
+        ensureJvmTi();
+        nativeStopMonitorProfiling();
+    }
+
+    /**
+     * The top monitor classes by blocked time, each with the heaviest acquiring, owner and
+     * waiting stacks (at most maxFrames frames, 0 for 8).
+     */
+    public static String monitorContention(int top, int maxFrames, boolean lines) {
+        ensureJvmTi();
+        return nativeMonitorContentionReport(top, maxFrames, lines);
+    }
+
+    /**
+     * Writes the stacks of one kind ({@link #MONITOR_ACQUIRING}, {@link #MONITOR_OWNER} or
+     * {@link #MONITOR_WAITING}) as collapsed stacks below the monitor class, weighted by nanoseconds.
+     * @return number of distinct stacks written
+     */
+    public static int dumpMonitorContention(String path, int kind, boolean lines) throws IOException {
+        ensureJvmTi();
+        return nativeDumpMonitorContention(path, kind, lines);
+    }
+
+    private static native void nativeStartGcMonitor(long sampleIntervalMs);
+
+    private static native void nativeStopGcMonitor();
+
+    private static native long[] nativeGcTimeline(long sinceNanos);
+
+    private static native String nativeGcReport(int last);
+
+    /**
+     * Starts recording GC pauses (the last 1024 are kept) and the heap occupancy around them.
+     * @param sampleIntervalMs interval of the periodic heap occupancy samples, 0 for 100ms
+     */
+    public static void startGcMonitor(long sampleIntervalMs) {
+        ensureJvmTi();
+        nativeStartGcMonitor(sampleIntervalMs);
+    }
+
+    public static void stopGcMonitor() {
+        ensureJvmTi();
+        nativeStopGcMonitor();
+    }
+
+    /**
+     * Pauses which ended after sinceNanos, as (start, end, used bytes before, used bytes after)
+     * quadruples, oldest first. Times are {@link System#nanoTime}, an unknown occupancy is -1.
+     */
+    public static long[] gcTimeline(long sinceNanos) {
+        ensureJvmTi();
+        return nativeGcTimeline(sinceNanos);
+    }
+
+    /**
+     * Pause time percentiles and the last pauses with the heap occupancy around them.
+     */
+    public static String gcReport(int last) {
+        ensureJvmTi();
+        return nativeGcReport(last);
+    }
+
+    private static native void nativeStartThreadCpuSampler(long intervalMs);
+
+    private static native void nativeStopThreadCpuSampler();
+
+    private static native String nativeThreadCpuReport(int top, int maxFrames, boolean lines);
+
+    /**
+     * Starts reading the CPU time of every thread from /proc at the given interval (0 for 1s),
+     * dropping the previous data.
+     */
+    public static void startThreadCpuSampler(long intervalMs) {
+        nativeStartThreadCpuSampler(intervalMs);
+    }
+
+    public static void stopThreadCpuSampler() {
+        nativeStopThreadCpuSampler();
+    }
+
+    /**
+     * The top threads by CPU time since the sampler started, with the current stacks (at most
+     * maxFrames frames, 0 for 8) of the Java threads among them.
+     */
+    public static String threadCpu(int top, int maxFrames, boolean lines) {
+        ensureJvmTi();
+        return nativeThreadCpuReport(top, maxFrames, lines);
+    }
+
+    private static native void nativeStartExceptionProfiling(int stackInterval, int maxDepth);
+
+    private static native void nativeStopExceptionProfiling();
+
+    private static native String nativeExceptionReport(int top, int maxFrames, boolean lines);
+
+    /**
+     * Starts counting thrown exceptions per (class, throw site, catch site), dropping the previous counts.
+     * @param stackInterval take the stack of the first throw of a site and of every
+     *                      stackInterval-th one after, 0 for no stacks
+     * @param maxDepth frames kept per stack, 0 for the maximum (64)
+     */
+    public static void startExceptionProfiling(int stackInterval, int maxDepth) {
+        ensureJvmTi();
+        nativeStartExceptionProfiling(stackInterval, maxDepth);
+    }
+
+    public static void stopExceptionProfiling() {
+        ensureJvmTi();
+        nativeStopExceptionProfiling();
+    }
+
+    /**
+     * The top throw sites by count, with their catch site and most sampled stack (at most
+     * maxFrames frames, 0 for 8).
+     */
+    public static String exceptionSites(int top, int maxFrames, boolean lines) {
+        ensureJvmTi();
+        return nativeExceptionReport(top, maxFrames, lines);
+    }
+
+    private static native void nativeClearMethodCache();
+
+    private static native String nativeBenchmarkMethodCache(int frames);
+
+    /**
+     * Drops the cached method names and line tables, needed after classes are redefined by
+     * another agent.
+     */
+    public static void clearMethodCache() {
+        ensureJvmTi();
+        nativeClearMethodCache();
+    }
+
+    /**
+     * Times symbolizing frames with plain JVMTI calls against the method cache, cold and warm.
+     * Clears the cache.
+     */
+    public static String benchmarkMethodCache(int frames) {
+        ensureJvmTi();
+        return nativeBenchmarkMethodCache(frames);
+    }
+
     public static native Member getCLInit(Class<?> clazz);
 
     private static native Object invokeNonVirtualInternal(Method method, Class<?> target, byte[] types, Object thiz, Object[] args) throws InvocationTargetException;
@@ -123,31 +966,121 @@ public class NativeUtils {
             return 6;
         } else if (type == double.class) {
             return 7;
-        } else if (type == Void.class) {
+        } else if (type == void.class) {
             return 9;
         }
         return 8;
     }
 
-    public static Object invokeNonVirtual(Method method, Object thiz, Object ...args) throws InvocationTargetException {
-        if (thiz == null) throw new NullPointerException("this == null");
+    private static byte[] nonVirtualTypes(Method method) {
         var modifier = method.getModifiers();
         if (Modifier.isStatic(modifier)) throw new IllegalArgumentException("expected instance method, got " + method);
         if (Modifier.isAbstract(modifier)) throw new IllegalArgumentException("cannot invoke abstract method " + method);
-        var clazz = method.getDeclaringClass();
-        if (!clazz.isInstance(thiz)) throw new IllegalArgumentException(thiz + " is not an instance of class " + clazz);
-
-        Class<?> retType = method.getReturnType();
         Class<?>[] pTypes = method.getParameterTypes();
-        byte[] types;
-        types = new byte[pTypes.length + 1];
-        types[0] = typeId(retType);
+        byte[] types = new byte[pTypes.length + 1];
+        types[0] = typeId(method.getReturnType());
         for (int i = 0; i < pTypes.length; i++) {
             types[i + 1] = typeId(pTypes[i]);
         }
+        return types;
+    }
+
+    private static void checkReceiver(Class<?> clazz, Object thiz) {
+        if (thiz == null) throw new NullPointerException("this == null");
+        if (!clazz.isInstance(thiz)) throw new IllegalArgumentException(thiz + " is not an instance of class " + clazz);
+    }
+
+    public static Object invokeNonVirtual(Method method, Object thiz, Object ...args) throws InvocationTargetException {
+        var clazz = method.getDeclaringClass();
+        var types = nonVirtualTypes(method);
+        checkReceiver(clazz, thiz);
         return invokeNonVirtualInternal(method, clazz, types, thiz, args);
     }
 
+    /**
+     * {@link #invokeNonVirtual} with the method id, declaring class and parameter types resolved
+     * once, for callers invoking the same method repeatedly (e.g. super calls from hooks).
+     * Must not be closed while another thread is invoking it.
+     */
+    public static final class NonVirtualInvoker implements Closeable {
+        private final Class<?> mClass;
+        private long mHandle;
+
+        private NonVirtualInvoker(Class<?> clazz, long handle) {
+            mClass = clazz;
+            mHandle = handle;
+        }
+
+        public Object invoke(Object thiz, Object... args) throws InvocationTargetException {
+            checkReceiver(mClass, thiz);
+            var handle = mHandle;
+            if (handle == 0) throw new IllegalStateException("invoker is closed");
+            // passing this keeps the invoker reachable, so the finalizer cannot free the handle during the call
+            return nativeInvokePrepared(this, handle, thiz, args);
+        }
+
+        @Override
+        public synchronized void close() {
+            if (mHandle == 0) return;
+            nativeClosePrepared(mHandle);
+            mHandle = 0;
+        }
+
+        @Override
+        protected void finalize() throws Throwable {
+            close();
+            super.finalize();
+        }
+    }
+
+    public static NonVirtualInvoker prepareNonVirtual(Method method) {
+        var clazz = method.getDeclaringClass();
+        return new NonVirtualInvoker(clazz, nativePrepareNonVirtual(method, clazz, nonVirtualTypes(method)));
+    }
+
+    private static native long nativePrepareNonVirtual(Method method, Class<?> target, byte[] types);
+
+    private static native Object nativeInvokePrepared(NonVirtualInvoker invoker, long handle, Object thiz, Object[] args) throws InvocationTargetException;
+
+    private static native void nativeClosePrepared(long handle);
+
+    private static final class InvokeBenchmark {
+        long mixed(int i, long j, double d, boolean z, char c, Object o) {
+            return i + j + (long) d + (z ? 1 : 0) + c + (o == null ? 0 : 1);
+        }
+    }
+
+    /**
+     * Times unboxing, boxing and non-virtual invokes of a method with mixed primitive and object
+     * parameters, through {@link #invokeNonVirtual} and through a {@link NonVirtualInvoker}.
+     */
+    public static String benchmarkInvoke(int iterations) {
+        Method method;
+        try {
+            method = InvokeBenchmark.class.getDeclaredMethod("mixed", int.class, long.class, double.class, boolean.class, char.class, Object.class);
+        } catch (NoSuchMethodException e) {
+            throw new IllegalStateException(e);
+        }
+        var target = new InvokeBenchmark();
+        var args = new Object[]{7, 1L << 40, 2.5, true, 'x', "s"};
+        var marshalling = nativeBenchmarkInvoke(nonVirtualTypes(method), args, iterations);
+        long unprepared, prepared;
+        try (var invoker = prepareNonVirtual(method)) {
+            var start = System.nanoTime();
+            for (int i = 0; i < iterations; i++) invokeNonVirtual(method, target, args);
+            unprepared = System.nanoTime() - start;
+            start = System.nanoTime();
+            for (int i = 0; i < iterations; i++) invoker.invoke(target, args);
+            prepared = System.nanoTime() - start;
+        } catch (InvocationTargetException e) {
+            throw new IllegalStateException(e);
+        }
+        return marshalling + String.format(Locale.ROOT, "\ninvoke: invokeNonVirtual %.1f ns, NonVirtualInvoker %.1f ns",
+                (double) unprepared / iterations, (double) prepared / iterations);
+    }
+
+    private static native String nativeBenchmarkInvoke(byte[] types, Object[] args, int iterations);
+
     public static void dummy() {
 
     }
@@ -35,6 +35,19 @@ sealed class Edge(open val obj: Any, open val prev: Edge?, val len: Int = prev?.
         }
     }
 
+    data class RootEdge(override val obj: Any, val kind: String) : Edge(obj, null) {
+        override fun toString(): String {
+            return toStringSafe(newLine = true)
+        }
+    }
+
+    // references the heap walk reports besides fields and array elements, such as class or class loader
+    data class ReferenceEdge(override val obj: Any, override val prev: Edge?, val kind: String) : Edge(obj, prev) {
+        override fun toString(): String {
+            return toStringSafe(newLine = true)
+        }
+    }
+
 }
 
 fun Edge.toStringSafe(limit: Int = -1, newLine: Boolean = false): String {
@@ -70,6 +83,14 @@ fun Edge.toStringSafe(limit: Int = -1, newLine: Boolean = false): String {
                 is Edge.WeakRefEdge -> {
                     append(" at WeakRef")
                 }
+                is Edge.RootEdge -> {
+                    append(" at Root ")
+                    append(edge.kind)
+                }
+                is Edge.ReferenceEdge -> {
+                    append(" at ")
+                    append(edge.kind)
+                }
             }
             i += 1
             edge = edge.prev
@@ -190,6 +211,32 @@ fun findPathToObject(start: Any, conf: FindObjectConfiguration) : List<Edge> {
     return result
 }
 
+fun NativeUtils.HeapPath.toEdge(): Edge {
+    fun objectAt(i: Int): Any = objects[i] ?: "<collected>"
+    var edge: Edge = if (kinds[0] == 0) Edge.StartEdge(objectAt(0))
+        else Edge.RootEdge(objectAt(0), NativeUtils.HeapPath.kindName(kinds[0]))
+    for (i in 1 until objects.size) {
+        val field = fields[i]
+        edge = when {
+            field != null -> Edge.FieldEdge(objectAt(i), edge, field)
+            kinds[i] == NativeUtils.HeapPath.KIND_ARRAY_ELEMENT -> Edge.ArrayIndexEdge(objectAt(i), edge, indices[i])
+            else -> Edge.ReferenceEdge(objectAt(i), edge, NativeUtils.HeapPath.kindName(kinds[i]))
+        }
+    }
+    return edge
+}
+
+// Shortest paths by a native breadth first search over the whole heap graph (JVMTI),
+// from the GC roots if start is null. conf.cond and conf.maxTries are not supported.
+fun findPathToObjectNative(start: Any?, conf: FindObjectConfiguration, maxResults: Int): List<Edge> {
+    val maxDepth = if (conf.maxDepth == Int.MAX_VALUE) 0 else conf.maxDepth
+    val paths = NativeUtils.findPaths(start, conf.targetObj, conf.targetClz, maxDepth, maxResults)
+    if (paths.isEmpty()) {
+        error("object not found")
+    }
+    return paths.map { it.toEdge() }
+}
+
 sealed class ObjectDiff {
     data class TypeDifference(val left: Any?, val right: Any?) : ObjectDiff()
     data class ValueDifference(val left: Any?, val right: Any?) : ObjectDiff()
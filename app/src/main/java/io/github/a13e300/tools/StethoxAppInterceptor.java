@@ -201,6 +201,7 @@ public class StethoxAppInterceptor implements IXposedHookLoadPackage {
                                         })
                                         .onFinalize(scope -> {
                                             ((HookFunction) ScriptableObject.getProperty(scope, "hook")).clearHooks();
+                                            ((HookFunction) ScriptableObject.getProperty(scope, "hook")).monitorClasses(false);
                                             ((OkHttpInterceptorObject) ScriptableObject.getProperty(scope, "okhttp3")).stop(true);
                                         })
                                         // .importClass(DexUtils.class)
@@ -33,6 +33,7 @@ import de.robv.android.xposed.XC_MethodReplacement;
 import de.robv.android.xposed.XposedBridge;
 import io.github.a13e300.tools.AsyncTraceKt;
 import io.github.a13e300.tools.FindObjectConfiguration;
+import io.github.a13e300.tools.Logger;
 import io.github.a13e300.tools.NativeUtils;
 import io.github.a13e300.tools.ObjectScannerKt;
 import io.github.a13e300.tools.StethoxAppInterceptor;
@@ -48,6 +49,8 @@ public class HookFunction extends BaseFunction {
 
     private final ConcurrentHashMap<Member, XC_MethodHook.Unhook> mHooks = new ConcurrentHashMap<>();
 
+    private Thread mClassMonitor;
+
     public HookFunction() {}
 
     public HookFunction(Scriptable scope) {
@@ -261,6 +264,35 @@ public class HookFunction extends BaseFunction {
         mHooks.clear();
     }
 
+    public synchronized void monitorClasses(boolean enabled) {
+        if (enabled == (mClassMonitor != null)) return;
+        if (!enabled) {
+            NativeUtils.monitorClasses(false);
+            mClassMonitor.interrupt();
+            mClassMonitor = null;
+            return;
+        }
+        var console = JsConsole.fromScope(getParentScope());
+        mClassMonitor = new Thread(() -> {
+            boolean running = true;
+            while (running) {
+                try {
+                    Thread.sleep(100);
+                } catch (InterruptedException e) {
+                    running = false;
+                }
+                // drain what is left after being stopped
+                String[] events;
+                while ((events = NativeUtils.drainClassEvents(256)).length > 0) {
+                    console.log(String.join("\n", events));
+                }
+            }
+        }, "StethoX-ClassMonitor");
+        mClassMonitor.setDaemon(true);
+        NativeUtils.monitorClasses(true);
+        mClassMonitor.start();
+    }
+
     @Override
     public String toString() {
         return "Use hook.help() for help";
@@ -329,12 +361,21 @@ public class HookFunction extends BaseFunction {
             + "    runOnHandler(callback, handler) & runOnUiThread(callback)\n"
             + "    trace() / traces(): parameters like hook, but without callback, the hook will print corresponding information automatically (traces contains stack trace)\n"
             + "    deoptimizeMethod(method)\n"
+            + "    monitorClasses(boolean enabled)\n"
+            + "      Print every class prepared in the VM to the console, events are buffered\n"
+            + "      per thread and printed in batches, overflowed events are counted.\n"
+            + "    profileClasses(boolean enabled) / classLoadProfile([top])\n"
+            + "      Measure how long defining, loading and linking every class takes, and print\n"
+            + "      latency percentiles per loader, package and thread, and the slowest classes.\n"
             + "    getObjectsOfClass(targetClass[, boolean containsSubClasses]):\n"
             + "      Get all objects in the VM, which class is `targetClass`, which can be a Class Object\n"
             + "      or a String (used for find class in the context's ClassLoader)\n"
             + "      If `containsSubClasses` is true, then the result contains objects which class is\n"
             + "      subclass of `targetClass`. If it is unspecified or false, only objects which class\n"
             + "      is exactly `targetClass` will be returned.\n"
+            + "    getObjectsOfClasses([targetClass, ...][, boolean containsSubClasses]):\n"
+            + "      Like `getObjectsOfClass` for several classes at once, the heap is walked only\n"
+            + "      once. The result contains an array of objects for each target class.\n"
             + "    getAssignableClasses(targetClass[, classLoader])\n"
             + "      Get all classes in the vm, which is assignable to `targetClass`.\n"
             + "      `targetClass` can be a Class object or String, like `getObjectsOfClass`\n"
@@ -536,6 +577,24 @@ public class HookFunction extends BaseFunction {
         return unhook;
     }
 
+    @JSFunction
+    public static void monitorClasses(Context cx, Scriptable thisObj, Object[] args, Function funObj) {
+        if (args.length != 1 || !(args[0] instanceof Boolean)) throw new IllegalArgumentException("usage: monitorClasses(boolean)");
+        ((HookFunction) thisObj).monitorClasses((Boolean) args[0]);
+    }
+
+    @JSFunction
+    public static void profileClasses(Context cx, Scriptable thisObj, Object[] args, Function funObj) {
+        if (args.length != 1 || !(args[0] instanceof Boolean)) throw new IllegalArgumentException("usage: profileClasses(boolean)");
+        NativeUtils.profileClassLoading((Boolean) args[0]);
+    }
+
+    @JSFunction
+    public static void classLoadProfile(Context cx, Scriptable thisObj, Object[] args, Function funObj) {
+        int top = args.length >= 1 && args[0] instanceof Number ? ((Number) args[0]).intValue() : 10;
+        JsConsole.fromScope(thisObj.getParentScope()).log(NativeUtils.getClassLoadProfile(top));
+    }
+
     @JSFunction
     public static void deoptimizeMethod(Context cx, Scriptable thisObj, Object[] args, Function funObj) throws Throwable {
         XposedBridge.class.getDeclaredMethod("deoptimizeMethod", Member.class).invoke(null, args[0]);
@@ -568,6 +627,45 @@ public class HookFunction extends BaseFunction {
         return ((HookFunction) thisObj).getObjectsOfClass(args);
     }
 
+    private Object[][] getObjectsOfClasses(Object[] args) throws Throwable {
+        if (args.length == 0) throw new IllegalArgumentException("usage: <classes> [containsSubClass]");
+        var arg0 = args[0];
+        if (arg0 instanceof Wrapper) arg0 = ((Wrapper) arg0).unwrap();
+        Object[] items;
+        if (arg0 instanceof Object[]) {
+            items = (Object[]) arg0;
+        } else if (arg0 instanceof Scriptable) {
+            items = Context.getCurrentContext().getElements((Scriptable) arg0);
+        } else {
+            throw new IllegalArgumentException("arg 0 must be an array of classes!");
+        }
+        var targets = new Class<?>[items.length];
+        for (int i = 0; i < items.length; i++) {
+            var item = items[i];
+            if (item instanceof Wrapper) item = ((Wrapper) item).unwrap();
+            if (item instanceof Class) {
+                targets[i] = (Class<?>) item;
+            } else if (item instanceof String) {
+                targets[i] = getClassLoader().loadClass((String) item);
+            } else {
+                throw new IllegalArgumentException("element " + i + " must be a class!");
+            }
+        }
+        boolean containsSubClass = false;
+        if (args.length >= 2) {
+            var arg1 = args[1];
+            if (arg1 instanceof Wrapper) arg1 = ((Wrapper) arg1).unwrap();
+            if (arg1 instanceof Boolean) containsSubClass = (Boolean) arg1;
+            else throw new IllegalArgumentException("arg1 must be a boolean!");
+        }
+        return NativeUtils.getObjectsOfClasses(targets, containsSubClass);
+    }
+
+    @JSFunction
+    public static Object[][] getObjectsOfClasses(Context cx, Scriptable thisObj, Object[] args, Function funObj) throws Throwable {
+        return ((HookFunction) thisObj).getObjectsOfClasses(args);
+    }
+
     private Class<?>[] getAssignableClasses(Object[] args) throws Throwable {
         if (args.length == 0) throw new IllegalArgumentException("usage: <clazz> [classloader]");
         Class<?> target;
@@ -668,9 +766,7 @@ public class HookFunction extends BaseFunction {
         if (startObject instanceof Wrapper) {
             startObject = ((Wrapper) startObject).unwrap();
         }
-        if (startObject == null) {
-            throw new NullPointerException("startObject is null!");
-        }
+        int maxResults = 10;
         if (args[1] instanceof NativeObject) {
             var o = (NativeObject) args[1];
             var maxDepthV = o.get("maxDepth");
@@ -687,6 +783,13 @@ public class HookFunction extends BaseFunction {
                 throw new IllegalArgumentException("maxTries " + maxDepthV + " (class=" + maxTriesV.getClass() + ")");
             }
 
+            var maxResultsV = o.get("maxResults");
+            if (maxResultsV instanceof Number) {
+                maxResults = ((Number) maxResultsV).intValue();
+            } else if (maxResultsV != null) {
+                throw new IllegalArgumentException("maxResults " + maxResultsV + " (class=" + maxResultsV.getClass() + ")");
+            }
+
             var obj = o.get("object");
             if (obj != null) {
                 if (obj instanceof Wrapper) {
@@ -721,6 +824,18 @@ public class HookFunction extends BaseFunction {
         if (targetObj == null && targetClass == null && condFunc == null) {
             throw new IllegalArgumentException("one of object, class, cond should be specified");
         }
+        if (startObject == null && condFunc != null) {
+            throw new IllegalArgumentException("cond requires a start object");
+        }
+        if (condFunc == null) {
+            try {
+                return ObjectScannerKt.findPathToObjectNative(startObject,
+                        new FindObjectConfiguration(null, maxDepth, maxTries, targetObj, targetClass), maxResults);
+            } catch (UnsupportedOperationException e) {
+                if (startObject == null) throw e;
+                Logger.e("native findPathToObject unavailable", e);
+            }
+        }
         var conf = new FindObjectConfiguration(
                 condFunc != null ? new Function1<>() {
 
@@ -738,6 +853,6 @@ public class HookFunction extends BaseFunction {
                 targetObj,
                 targetClass
         );
-        return ObjectScannerKt.findPathToObject(args[0], conf);
+        return ObjectScannerKt.findPathToObject(startObject, conf);
     }
 }